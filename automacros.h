@@ -51,7 +51,7 @@ char* markup_to_html (
     
 #define PROCESS_NOTE_CREATE_LINKS \
     if (!note->error) { \
-        psx_create_links (ctx, &note->tree); \
+        psx_create_links (ctx, ba, &note->tree); \
     } \
     
 #define PROCESS_NOTE_USER_CALLBACKS \
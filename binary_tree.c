@@ -2,6 +2,16 @@
  * Copyright (C) 2019 Santiago León O.
  */
 
+// Trees are kept balanced as AVL trees. Notes, files and entities are usually
+// inserted in sorted order (we get them sorted from iterate_dir() and the
+// ID generator), without rebalancing these trees degenerated into linked lists
+// with linear time lookups.
+//
+// Inserts and removals store the path of links from the root so rebalancing
+// doesn't need parent pointers. An AVL tree of height 64 needs more nodes than
+// we could ever allocate.
+#define BINARY_TREE_MAX_HEIGHT 64
+
 #define BINARY_TREE_NEW(PREFIX,KEY_TYPE,VALUE_TYPE,CMP_A_TO_B)                                           \
                                                                                                          \
 struct PREFIX ## _t {                                                                                    \
@@ -11,6 +21,9 @@ struct PREFIX ## _t {
     uint32_t num_nodes;                                                                                  \
                                                                                                          \
     struct PREFIX ## _node_t *root;                                                                      \
+                                                                                                         \
+    /*Removed nodes are reused by _allocate_node(), linked through ->right.*/                            \
+    struct PREFIX ## _node_t *free_list;                                                                 \
 };                                                                                                       \
                                                                                                          \
 /*Leftmost node will be the smallest.*/                                                                  \
@@ -21,6 +34,9 @@ struct PREFIX ## _node_t {
                                                                                                          \
     struct PREFIX ## _node_t *right;                                                                     \
     struct PREFIX ## _node_t *left;                                                                      \
+                                                                                                         \
+    /*Height of the subtree rooted at this node, leaves have height 1.*/                                 \
+    int height;                                                                                          \
 };                                                                                                       \
                                                                                                          \
 void PREFIX ## _destroy (struct PREFIX ## _t *tree)                                                      \
@@ -34,63 +50,187 @@ struct PREFIX ## _node_t* PREFIX ## _allocate_node (struct PREFIX ## _t *tree)
     /*If pool pointer is null we use our own pool, the user must call _destroy*/                         \
     if (tree->pool == NULL) tree->pool = &tree->_pool;                                                   \
                                                                                                          \
-    /* TODO: When we add removal of nodes, this should allocate them from a free
-    list of nodes.*/                                                                                     \
-    struct PREFIX ## _node_t *new_node =                                                                 \
-        mem_pool_push_struct (tree->pool, struct PREFIX ## _node_t);                                     \
+    struct PREFIX ## _node_t *new_node;                                                                  \
+    if (tree->free_list != NULL) {                                                                       \
+        new_node = tree->free_list;                                                                      \
+        tree->free_list = new_node->right;                                                               \
+                                                                                                         \
+    } else {                                                                                             \
+        new_node = mem_pool_push_struct (tree->pool, struct PREFIX ## _node_t);                          \
+    }                                                                                                    \
     *new_node = ZERO_INIT(struct PREFIX ## _node_t);                                                     \
+    new_node->height = 1;                                                                                \
     return new_node;                                                                                     \
 }                                                                                                        \
                                                                                                          \
+static inline                                                                                            \
+int PREFIX ## _node_height (struct PREFIX ## _node_t *node)                                              \
+{                                                                                                        \
+    return node == NULL ? 0 : node->height;                                                              \
+}                                                                                                        \
+                                                                                                         \
+static inline                                                                                            \
+void PREFIX ## _update_height (struct PREFIX ## _node_t *node)                                           \
+{                                                                                                        \
+    node->height = MAX(PREFIX ## _node_height (node->left), PREFIX ## _node_height (node->right)) + 1;   \
+}                                                                                                        \
+                                                                                                         \
+struct PREFIX ## _node_t* PREFIX ## _rotate_left (struct PREFIX ## _node_t *node)                        \
+{                                                                                                        \
+    struct PREFIX ## _node_t *new_root = node->right;                                                    \
+    node->right = new_root->left;                                                                        \
+    new_root->left = node;                                                                               \
+                                                                                                         \
+    PREFIX ## _update_height (node);                                                                     \
+    PREFIX ## _update_height (new_root);                                                                 \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+struct PREFIX ## _node_t* PREFIX ## _rotate_right (struct PREFIX ## _node_t *node)                       \
+{                                                                                                        \
+    struct PREFIX ## _node_t *new_root = node->left;                                                     \
+    node->left = new_root->right;                                                                        \
+    new_root->right = node;                                                                              \
+                                                                                                         \
+    PREFIX ## _update_height (node);                                                                     \
+    PREFIX ## _update_height (new_root);                                                                 \
+    return new_root;                                                                                     \
+}                                                                                                        \
+                                                                                                         \
+/* Restores the AVL property along a path of links from the root to the                                  \
+ point where a node was inserted or removed. Each element of path points to                              \
+ the link (root, left or right) that references a node in the path. Fixing                               \
+ them bottom up keeps the upper links valid, rotations only change the node                              \
+ stored in the link being fixed.*/                                                                       \
+void PREFIX ## _rebalance_path (struct PREFIX ## _node_t ***path, int path_len)                          \
+{                                                                                                        \
+    for (int i=path_len-1; i>=0; i--) {                                                                  \
+        struct PREFIX ## _node_t **link = path[i];                                                       \
+        struct PREFIX ## _node_t *node = *link;                                                          \
+        PREFIX ## _update_height (node);                                                                 \
+                                                                                                         \
+        int balance = PREFIX ## _node_height (node->left) - PREFIX ## _node_height (node->right);        \
+        if (balance > 1) {                                                                               \
+            if (PREFIX ## _node_height (node->left->left) < PREFIX ## _node_height (node->left->right)) {\
+                node->left = PREFIX ## _rotate_left (node->left);                                        \
+            }                                                                                            \
+            *link = PREFIX ## _rotate_right (node);                                                      \
+                                                                                                         \
+        } else if (balance < -1) {                                                                       \
+            if (PREFIX ## _node_height (node->right->right) < PREFIX ## _node_height (node->right->left)) {\
+                node->right = PREFIX ## _rotate_right (node->right);                                     \
+            }                                                                                            \
+            *link = PREFIX ## _rotate_left (node);                                                       \
+        }                                                                                                \
+    }                                                                                                    \
+}                                                                                                        \
+                                                                                                         \
 void PREFIX ## _insert (struct PREFIX ## _t *tree, KEY_TYPE key, VALUE_TYPE value)                       \
 {                                                                                                        \
     bool key_found = false;                                                                              \
-    if (tree->root == NULL) {                                                                            \
-        struct PREFIX ## _node_t *new_node = PREFIX ## _allocate_node (tree);                            \
-        new_node->key = key;                                                                             \
-        new_node->value = value;                                                                         \
                                                                                                          \
-        tree->root = new_node;                                                                           \
+    struct PREFIX ## _node_t **path[BINARY_TREE_MAX_HEIGHT];                                             \
+    int path_len = 0;                                                                                    \
+                                                                                                         \
+    struct PREFIX ## _node_t **curr_node = &tree->root;                                                  \
+    while (!key_found && *curr_node != NULL) {                                                           \
+        KEY_TYPE a = key;                                                                                \
+        KEY_TYPE b = (*curr_node)->key;                                                                  \
+        int c = CMP_A_TO_B;                                                                              \
+        if (c < 0) {                                                                                     \
+            path[path_len++] = curr_node;                                                                \
+            curr_node = &(*curr_node)->left;                                                             \
+                                                                                                         \
+        } else if (c > 0) {                                                                              \
+            path[path_len++] = curr_node;                                                                \
+            curr_node = &(*curr_node)->right;                                                            \
+                                                                                                         \
+        } else {                                                                                         \
+            /* Key already exists. Options of what we could do here:                                     \
+                                                                                                         \
+              - Assert that this will never happen.                                                      \
+              - Overwrite the existing value with the new one. The problem                               \
+                is if values are pointers in the future, then we could be                                \
+                leaking stuff without knowing?                                                           \
+              - Do nothing, but somehow let the caller know the key was                                  \
+                already there so we didn't insert the value they wanted.                                 \
+                                                                                                         \
+             I lean more towards the last option.*/                                                      \
+            key_found = true;                                                                            \
+            break;                                                                                       \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    if (!key_found) {                                                                                    \
+        *curr_node = PREFIX ## _allocate_node (tree);                                                    \
+        (*curr_node)->key = key;                                                                         \
+        (*curr_node)->value = value;                                                                     \
+                                                                                                         \
         tree->num_nodes++;                                                                               \
                                                                                                          \
-    } else {                                                                                             \
-        struct PREFIX ## _node_t **curr_node = &tree->root;                                              \
-        while (!key_found && *curr_node != NULL) {                                                       \
-            KEY_TYPE a = key;                                                                            \
-            KEY_TYPE b = (*curr_node)->key;                                                              \
-            int c = CMP_A_TO_B;                                                                          \
-            if (c < 0) {                                                                                 \
-                curr_node = &(*curr_node)->left;                                                         \
-                                                                                                         \
-            } else if (c > 0) {                                                                          \
-                curr_node = &(*curr_node)->right;                                                        \
-                                                                                                         \
-            } else {                                                                                     \
-                /* Key already exists. Options of what we could do here:
-
-                  - Assert that this will never happen.
-                  - Overwrite the existing value with the new one. The problem
-                    is if values are pointers in the future, then we could be
-                    leaking stuff without knowing?
-                  - Do nothing, but somehow let the caller know the key was
-                    already there so we didn't insert the value they wanted.
-
-                 I lean more towards the last option.*/                                                  \
-                key_found = true;                                                                        \
-                break;                                                                                   \
-            }                                                                                            \
+        PREFIX ## _rebalance_path (path, path_len);                                                      \
+    }                                                                                                    \
+}                                                                                                        \
+                                                                                                         \
+/* Returns false if the key wasn't in the tree. Pointers to nodes returned by                            \
+ _lookup() may be invalidated by this, when removing a node with 2 children                              \
+ the node of its successor is the one that's actually unlinked, after moving                             \
+ its key and value into the removed node.*/                                                              \
+bool PREFIX ## _remove (struct PREFIX ## _t *tree, KEY_TYPE key)                                         \
+{                                                                                                        \
+    bool key_found = false;                                                                              \
+                                                                                                         \
+    struct PREFIX ## _node_t **path[BINARY_TREE_MAX_HEIGHT];                                             \
+    int path_len = 0;                                                                                    \
+                                                                                                         \
+    struct PREFIX ## _node_t **curr_node = &tree->root;                                                  \
+    while (*curr_node != NULL) {                                                                         \
+        KEY_TYPE a = key;                                                                                \
+        KEY_TYPE b = (*curr_node)->key;                                                                  \
+        int c = CMP_A_TO_B;                                                                              \
+        if (c < 0) {                                                                                     \
+            path[path_len++] = curr_node;                                                                \
+            curr_node = &(*curr_node)->left;                                                             \
+                                                                                                         \
+        } else if (c > 0) {                                                                              \
+            path[path_len++] = curr_node;                                                                \
+            curr_node = &(*curr_node)->right;                                                            \
+                                                                                                         \
+        } else {                                                                                         \
+            key_found = true;                                                                            \
+            break;                                                                                       \
         }                                                                                                \
+    }                                                                                                    \
                                                                                                          \
-        if (!key_found) {                                                                                \
-            *curr_node = PREFIX ## _allocate_node (tree);                                                \
-            (*curr_node)->key = key;                                                                     \
-            (*curr_node)->value = value;                                                                 \
+    if (key_found) {                                                                                     \
+        struct PREFIX ## _node_t *removed = *curr_node;                                                  \
+        if (removed->left != NULL && removed->right != NULL) {                                           \
+            path[path_len++] = curr_node;                                                                \
                                                                                                          \
-            tree->num_nodes++;                                                                           \
+            struct PREFIX ## _node_t **successor = &removed->right;                                      \
+            while ((*successor)->left != NULL) {                                                         \
+                path[path_len++] = successor;                                                            \
+                successor = &(*successor)->left;                                                         \
+            }                                                                                            \
+                                                                                                         \
+            removed->key = (*successor)->key;                                                            \
+            removed->value = (*successor)->value;                                                        \
+                                                                                                         \
+            removed = *successor;                                                                        \
+            *successor = removed->right;                                                                 \
+                                                                                                         \
+        } else {                                                                                         \
+            *curr_node = removed->left != NULL ? removed->left : removed->right;                         \
         }                                                                                                \
                                                                                                          \
-        /* TODO: Rebalance the tree.*/                                                                   \
+        removed->right = tree->free_list;                                                                \
+        tree->free_list = removed;                                                                       \
+        tree->num_nodes--;                                                                               \
+                                                                                                         \
+        PREFIX ## _rebalance_path (path, path_len);                                                      \
     }                                                                                                    \
+                                                                                                         \
+    return key_found;                                                                                    \
 }                                                                                                        \
                                                                                                          \
 bool PREFIX ## _lookup (struct PREFIX ## _t *tree,                                                       \
@@ -138,10 +278,35 @@ bool PREFIX ## _maybe_get (struct PREFIX ## _t *tree,
     return false;                                                                                        \
 }                                                                                                        \
                                                                                                          \
-/*
- * This is only a convenience function. A zeroed out value will be returned
- * if the key is not found. There is no way to differentiate a zeroed out
- * stored value from a non existing key, use *_lookup() for that.
+/* Links the len nodes of an array that's already sorted by key into a                                   \
+ balanced tree and returns its root. Keys aren't compared, only left, right                              \
+ and height are set, so it's cheaper than inserting them one by one. Used to                             \
+ rebuild trees loaded from a file in the order BINARY_TREE_FOR visited them.*/                           \
+struct PREFIX ## _node_t* PREFIX ## _link_sorted (struct PREFIX ## _node_t *nodes, uint32_t len)         \
+{                                                                                                        \
+    if (len == 0) return NULL;                                                                           \
+                                                                                                         \
+    uint32_t mid = len/2;                                                                                \
+    struct PREFIX ## _node_t *node = &nodes[mid];                                                        \
+    node->left = PREFIX ## _link_sorted (nodes, mid);                                                    \
+    node->right = PREFIX ## _link_sorted (nodes + mid + 1, len - mid - 1);                               \
+    PREFIX ## _update_height (node);                                                                     \
+    return node;                                                                                         \
+}                                                                                                        \
+                                                                                                         \
+/* Replaces the content of an empty tree with the sorted array of nodes, see                             \
+ _link_sorted(). Nodes belong to the caller, they aren't freed by _destroy().*/                          \
+void PREFIX ## _set_sorted (struct PREFIX ## _t *tree, struct PREFIX ## _node_t *nodes, uint32_t len)    \
+{                                                                                                        \
+    assert (tree->root == NULL);                                                                         \
+    tree->root = PREFIX ## _link_sorted (nodes, len);                                                    \
+    tree->num_nodes = len;                                                                               \
+}                                                                                                        \
+                                                                                                         \
+/*                                                                                                       \
+ * This is only a convenience function. A zeroed out value will be returned                              \
+ * if the key is not found. There is no way to differentiate a zeroed out                                \
+ * stored value from a non existing key, use *_lookup() for that.                                        \
  */                                                                                                      \
 VALUE_TYPE PREFIX ## _get (struct PREFIX ## _t *tree,                                                    \
                      KEY_TYPE key)                                                                       \
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include "common.h"
+#include "binary_tree.c"
+#include "cli_parser.c"
+
+#include <time.h>
+
+// Micro benchmark for BINARY_TREE_NEW. Keys are inserted in sorted order (what
+// we get from iterate_dir() and the ID generator) and in random order, then
+// all of them are looked up. Before trees were balanced, the sorted case had
+// a height equal to the number of nodes.
+
+BINARY_TREE_NEW (u64_map, uint64_t, uint64_t, (a==b) ? 0 : (a<b ? -1 : 1));
+
+double wall_time_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+void shuffle (uint64_t *arr, int len)
+{
+    for (int i=len-1; i>0; i--) {
+        int j = rand() % (i+1);
+        uint64_t tmp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = tmp;
+    }
+}
+
+// Checks keys are iterated in order and that stored heights are consistent.
+// Returns the height of the subtree.
+int check_subtree (struct u64_map_node_t *node, bool *success)
+{
+    if (node == NULL) return 0;
+
+    int left_height = check_subtree (node->left, success);
+    int right_height = check_subtree (node->right, success);
+
+    if (node->left != NULL && node->left->key >= node->key) *success = false;
+    if (node->right != NULL && node->right->key <= node->key) *success = false;
+    if (abs(left_height - right_height) > 1) *success = false;
+    if (node->height != MAX(left_height, right_height) + 1) *success = false;
+
+    return node->height;
+}
+
+void bench (char *name, uint64_t *insert_keys, uint64_t *lookup_keys, int len, int iterations)
+{
+    STACK_ALLOCATE (struct u64_map_t, tree);
+
+    double start = wall_time_ms ();
+    for (int i=0; i<len; i++) {
+        u64_map_insert (tree, insert_keys[i], i);
+    }
+    double insert_time = wall_time_ms () - start;
+
+    uint64_t sum = 0;
+    start = wall_time_ms ();
+    for (int it=0; it<iterations; it++) {
+        for (int i=0; i<len; i++) {
+            sum += u64_map_get (tree, lookup_keys[i]);
+        }
+    }
+    double lookup_time = wall_time_ms () - start;
+
+    bool success = (tree->num_nodes == len);
+    int height = check_subtree (tree->root, &success);
+
+    // Remove half of the keys and check everything is still consistent.
+    for (int i=0; i<len; i+=2) {
+        if (!u64_map_remove (tree, insert_keys[i])) success = false;
+    }
+    for (int i=0; i<len; i++) {
+        if (u64_map_lookup (tree, insert_keys[i], NULL) != (i%2 == 1)) success = false;
+    }
+    if (tree->num_nodes != len/2) success = false;
+    check_subtree (tree->root, &success);
+
+    printf ("%-8s nodes: %d, height: %d, insert: %.1f ns/op, lookup: %.1f ns/op, %s (%" PRIu64 ")\n",
+            name, len, height,
+            insert_time*1000000.0/len, lookup_time*1000000.0/((double)len*iterations),
+            success ? "OK" : "FAILED", sum);
+
+    u64_map_destroy (tree);
+}
+
+int main (int argc, char **argv)
+{
+    int len = 100000;
+    char *len_str = get_cli_arg_opt ("--nodes", argv, argc);
+    if (len_str != NULL) len = atoi (len_str);
+
+    int iterations = 10;
+    char *iterations_str = get_cli_arg_opt ("--iterations", argv, argc);
+    if (iterations_str != NULL) iterations = atoi (iterations_str);
+
+    uint64_t *sorted = malloc (len*sizeof(uint64_t));
+    uint64_t *shuffled = malloc (len*sizeof(uint64_t));
+    for (int i=0; i<len; i++) {
+        sorted[i] = i;
+        shuffled[i] = i;
+    }
+    srand (0);
+    shuffle (shuffled, len);
+
+    bench ("sorted", sorted, shuffled, len, iterations);
+    bench ("random", shuffled, shuffled, len, iterations);
+
+    free (sorted);
+    free (shuffled);
+
+    return 0;
+}
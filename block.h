@@ -41,6 +41,39 @@ struct psx_token_t {
     bool is_eol;
 };
 
+// Inline tokens of a block's inline_content, as returned by ps_inline_next().
+// Creating links, running user callbacks and generating HTML all tokenize the
+// same text, so the first of them stores the tokens here and the others replay
+// them instead of scanning again. Values aren't stored, they are recovered
+// from the type and offsets. Offsets are relative to the start of
+// inline_content.
+// :inline_tokens
+#define PSX_INLINE_TOKEN_ESCAPED 0x1
+#define PSX_INLINE_TOKEN_EOF     0x2
+
+struct psx_inline_token_t {
+    uint32_t start;
+    uint32_t end;
+
+    // Scanner position changes, only needed to keep line and column numbers
+    // the same as when scanning.
+    uint32_t newlines;
+    uint32_t end_column;
+
+    uint8_t type;
+    uint8_t flags;
+};
+
+struct psx_inline_tokens_t {
+    // The inline_content these tokens were created from. They are only used
+    // while the block's content still has the same data pointer and length.
+    char *content;
+    uint32_t content_len;
+
+    uint32_t len;
+    struct psx_inline_token_t *tokens;
+};
+
 #define BLOCK_TYPES_TABLE                 \
     BLOCK_TYPES_ROW(BLOCK_TYPE_ROOT)      \
     BLOCK_TYPES_ROW(BLOCK_TYPE_LIST)      \
@@ -67,6 +100,7 @@ struct psx_block_t {
     int margin;
 
     string_t inline_content;
+    struct psx_inline_tokens_t *inline_tokens;
 
     int heading_number;
 
@@ -343,10 +343,37 @@ char* str_non_small_alloc (string_t *str, size_t len)
     return str->str;
 }
 
+// A view is a string_t pointing to null terminated data owned by something
+// else, like a pool or a string table. It's read like any other string, but
+// functions that would resize or free it assert instead, and str_free() only
+// resets it. To modify one, str_cpy() it into a normal string first.
+//
+// Views are non small strings with a capacity no allocated string can have.
+// :string_view
+#define STR_VIEW_CAPACITY 1
+
+static inline
+bool str_is_view (string_t *str)
+{
+    return !str_is_small(str) && str->capacity == STR_VIEW_CAPACITY;
+}
+
+static inline
+void str_set_view (string_t *str, char *data, size_t len)
+{
+    assert (data[len] == '\0');
+
+    *str = (string_t){0};
+    str->capacity = STR_VIEW_CAPACITY;
+    str->len = len;
+    str->str = data;
+}
+
 static inline
 void str_shrink (string_t *str, size_t len)
 {
     assert (len <= str_len(str));
+    assert (!str_is_view(str));
 
     if (!str_is_small(str)) {
         str->len = len;
@@ -361,13 +388,17 @@ void str_shrink (string_t *str, size_t len)
 static inline
 void str_maybe_grow (string_t *str, size_t len, bool keep_content)
 {
+    assert (!str_is_view(str));
+
     if (!str_is_small(str)) {
         if (len >= str->capacity) {
             if (keep_content) {
                 uint32_t tmp_len = str->len;
                 char *tmp = str->str;
 
-                str_non_small_alloc (str, len);
+                // Strings that keep their content are usually being appended
+                // to, growing geometrically keeps that linear.
+                str_non_small_alloc (str, MAX(len, 2*(size_t)str->capacity));
                 memcpy (str->str, tmp, tmp_len);
                 free (tmp);
             } else {
@@ -410,7 +441,7 @@ char* str_init (string_t *str, size_t len)
 
 void str_free (string_t *str)
 {
-    if (!str_is_small(str)) {
+    if (!str_is_small(str) && !str_is_view(str)) {
         free (str->str);
     }
     *str = (string_t){0};
@@ -464,14 +495,35 @@ char* str_data (string_t *str)
     return str->str;
 }
 
+// :string_view
+#define STR_VIEW_CAPACITY 1
+
+static inline
+bool str_is_view (string_t *str)
+{
+    return str->capacity == STR_VIEW_CAPACITY;
+}
+
+static inline
+void str_set_view (string_t *str, char *data, size_t len)
+{
+    assert (data[len] == '\0');
+
+    str->str = data;
+    str->len = len;
+    str->capacity = STR_VIEW_CAPACITY;
+}
+
 static inline
 void str_maybe_grow (string_t *str, size_t len, bool keep_content)
 {
+    assert (!str_is_view(str));
+
     if (len >= str->capacity) {
         if (keep_content) {
             uint32_t tmp_len = str->len;
             char *tmp = str->str;
-            str_alloc (str, len);
+            str_alloc (str, MAX(len, 2*(size_t)str->capacity));
             memcpy (str->str, tmp, tmp_len);
             free (tmp);
         } else {
@@ -493,7 +545,9 @@ char* str_init (string_t *str, size_t len)
 
 void str_free (string_t *str)
 {
-    free (str->str);
+    if (!str_is_view(str)) {
+        free (str->str);
+    }
     *str = (string_t){0};
 }
 
@@ -1245,15 +1299,13 @@ int sstr_cmp (sstring_t *a, sstring_t *b)
 static inline
 sstring_t sstr_strip (sstring_t str)
 {
-    if (str.len > 0) {
-        while (is_space (str.s) || *(str.s) == '\n') {
-            str.s++;
-            str.len--;
-        }
+    while (str.len > 0 && (is_space (str.s) || *(str.s) == '\n')) {
+        str.s++;
+        str.len--;
+    }
 
-        while (is_space (str.s + str.len - 1) || str.s[str.len - 1] == '\n') {
-            str.len--;
-        }
+    while (str.len > 0 && (is_space (str.s + str.len - 1) || str.s[str.len - 1] == '\n')) {
+        str.len--;
     }
 
     return str;
@@ -3425,6 +3477,52 @@ bool full_file_write (const void *data, ssize_t size, const char *path)
     return failed;
 }
 
+// Replaces the file at path without a window where it's partially written.
+// The content is written to a temporary file next to it, which is renamed over
+// path only if all writes succeeded. Concurrent readers see either the old or
+// the new file. Usage:
+//
+//   struct file_replace_t fr;
+//   FILE *f = file_replace_begin (&fr, path);
+//   if (f != NULL) {
+//       fwrite (data, 1, size, f);
+//       failed = file_replace_end (&fr);
+//   }
+struct file_replace_t {
+    const char *path;
+    string_t tmp_path;
+    FILE *file;
+};
+
+FILE* file_replace_begin (struct file_replace_t *fr, const char *path)
+{
+    *fr = ZERO_INIT (struct file_replace_t);
+    fr->path = path;
+    str_put_printf (&fr->tmp_path, 0, "%s.%d", path, getpid());
+
+    fr->file = fopen (str_data(&fr->tmp_path), "wb");
+    if (fr->file == NULL) {
+        str_free (&fr->tmp_path);
+    }
+
+    return fr->file;
+}
+
+// Returns true if any write failed, then path is left unchanged.
+bool file_replace_end (struct file_replace_t *fr)
+{
+    bool failed = ferror (fr->file) != 0;
+    if (fclose (fr->file) != 0) failed = true;
+
+    if (!failed && rename (str_data(&fr->tmp_path), fr->path) != 0) failed = true;
+    if (failed) unlink (str_data(&fr->tmp_path));
+
+    str_free (&fr->tmp_path);
+    fr->file = NULL;
+
+    return failed;
+}
+
 // TODO: Make this silent, then we will be able to just call it, without needing
 // to make sure the file exists beforehand.
 char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
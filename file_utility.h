@@ -2,8 +2,42 @@
  * Copyright (C) 2022 Santiago León O.
  */
 
+#include <pthread.h>
 #include "lib/regexp.h"
 
+// Compiled regular expressions are cached for the whole life of the process,
+// patterns we use are constants so there's no point in compiling them more
+// than once. Programs returned by this must not be freed.
+//
+// The regexp.c compiler keeps its state in a global variable, so compiling
+// patterns from multiple threads at the same time isn't safe. Executing
+// compiled programs with regexec() is fine though.
+// :regcomp_lock
+BINARY_TREE_NEW (regex_cache, const char*, Reprog*, strcmp(a, b));
+pthread_mutex_t regcomp_lock = PTHREAD_MUTEX_INITIALIZER;
+struct regex_cache_t regex_cache;
+
+Reprog* regcomp_cached (const char *pattern)
+{
+    pthread_mutex_lock (&regcomp_lock);
+
+    Reprog *prog = NULL;
+    if (!regex_cache_maybe_get (&regex_cache, pattern, &prog)) {
+        const char *error;
+        prog = regcomp (pattern, 0, &error);
+
+        if (prog != NULL) {
+            regex_cache_insert (&regex_cache, pattern, prog);
+        } else {
+            printf (ECMA_RED("error:") " invalid regular expression '%s': %s\n", pattern, error);
+        }
+    }
+
+    pthread_mutex_unlock (&regcomp_lock);
+
+    return prog;
+}
+
 char *identifier_r = "^[23456789CFGHJMPQRVWX]{8,}$";
 char *canonical_fname_r = "^(?:([0-9]+)_)?(?:(.+?)_)?([23456789CFGHJMPQRVWX]{8,})((?:\\.[0-9]+)+)?(?: (.+?))?(?:\\.([^.]+))?$";
 
@@ -68,6 +102,16 @@ int vlt_file_compare (struct vlt_file_t *a, struct vlt_file_t *b)
 }
 templ_sort_ll(vlt_file_sort,struct vlt_file_t, vlt_file_compare(a,b) < 0);
 
+// Directory listing stored in the vault index. Entries point into the loaded
+// index file, see vlt_index_load() for the format.
+// :vault_index
+struct vlt_index_dir_t {
+    struct timespec mtime;
+    uint32_t num_entries;
+    char *entries;
+};
+BINARY_TREE_NEW (vlt_index, char*, struct vlt_index_dir_t, strcmp(a, b));
+
 // TODO: A vault should be composed of file_repo_t which represent a single
 // directory whose file structure is controlled by weaver and derived from
 // metadata associated with the file IDs.
@@ -78,6 +122,28 @@ struct file_vault_t {
     char *base_dir;
 
     struct id_to_vlt_file_t files;
+
+    // Storage for all files, see vlt_pack_files().
+    uint64_t files_array_len;
+    struct vlt_file_t *files_array;
+
+    // Number of threads used by vlt_init(), values smaller than 2 scan in the
+    // calling thread.
+    int jobs;
+
+    // When set, vlt_init() stores the canonical files of each directory here.
+    // The next time, directories with the same modification time aren't read
+    // again, their listing is taken from the index.
+    // :vault_index
+    char *index_path;
+    struct vlt_index_t index;
+
+    // Statistics of the last vlt_init() call.
+    // :vault_scan
+    uint64_t num_scanned_entries;
+    uint64_t num_scanned_dirs;
+    uint64_t num_stat_calls;
+    uint64_t num_index_hits;
 };
 
 // NOTE: Assign X the 0 value (opposite to what Plus Codes do). Allows appending
@@ -163,6 +229,55 @@ void str_cat_id_random(string_t *s)
     strn_cat_id_random(s, ID_DEFAULT_LEN);
 }
 
+// Like str_cat_id_random() but takes the bits from a hash, so the same hash
+// always gets the same ID.
+void str_cat_id_from_hash (string_t *s, uint64_t hash)
+{
+    string_t tmp = {0};
+
+    str_cat_id (&tmp, hash >> (64 - ((ID_DEFAULT_LEN*9) >> 1)));
+    strn_cat_c (s, str_data(&tmp), ID_DEFAULT_LEN);
+
+    str_free (&tmp);
+}
+
+
+static inline
+bool is_canonical_id_char (char c)
+{
+    return (c >= '2' && c <= '9') ||
+        c == 'C' || c == 'F' || c == 'G' || c == 'H' || c == 'J' ||
+        c == 'M' || c == 'P' || c == 'Q' || c == 'R' || c == 'V' ||
+        c == 'W' || c == 'X';
+}
+
+// Equivalent to matching identifier_r. It's called for lots of attribute
+// values and tag contents while rendering notes, so avoid the regex engine.
+bool is_canonical_id (char *s)
+{
+    int len = 0;
+    while (is_canonical_id_char (s[len])) len++;
+
+    return s[len] == '\0' && len >= 8;
+}
+
+// Canonical file names must contain an ID, most files that aren't canonical
+// will be rejected by this before running the full regex.
+bool has_canonical_id_run (char *s, size_t len)
+{
+    int run = 0;
+    for (size_t i=0; i<len; i++) {
+        if (is_canonical_id_char (s[i])) {
+            run++;
+            if (run >= 8) return true;
+
+        } else {
+            run = 0;
+        }
+    }
+
+    return false;
+}
 
 static inline
 sstring_t r_group (Resub m, int i)
@@ -170,15 +285,18 @@ sstring_t r_group (Resub m, int i)
     return SSTRING((char*)m.sub[i].sp, m.sub[i].ep - m.sub[i].sp);
 }
 
-struct vlt_file_t* canonical_fname_parse (mem_pool_t *pool, char *s, size_t len)
+// regex must be canonical_fname_r compiled. It's a parameter so callers
+// parsing many names from multiple threads compile it once, instead of each
+// call going through regcomp_cached() and its lock.
+struct vlt_file_t* canonical_fname_parse (mem_pool_t *pool, Reprog *regex, char *s, size_t len)
 {
     struct vlt_file_t *result = NULL;
 
-    const char *error;
-    Resub m;
-    Reprog *regex = regcomp(canonical_fname_r, 0, &error);
+    if (len == 0) len = strlen (s);
+    if (!has_canonical_id_run (s, len)) return NULL;
 
-    if (!regexec(regex, s, &m, 0)) {
+    Resub m;
+    if (regex != NULL && !regexec(regex, s, &m, 0)) {
         result = mem_pool_push_struct (pool, struct vlt_file_t);
         *result = ZERO_INIT(struct vlt_file_t);
 
@@ -220,55 +338,486 @@ struct vlt_file_t* canonical_fname_parse (mem_pool_t *pool, char *s, size_t len)
     return result;
 }
 
-ITERATE_DIR_CB (maybe_process_canonical_file)
+void vlt_add_file (struct file_vault_t *vlt, struct vlt_file_t *file)
 {
-    struct file_vault_t *vlt = (struct file_vault_t*)data;
+    struct id_to_vlt_file_node_t *node = NULL;
+    if (id_to_vlt_file_lookup (&vlt->files, file->id, &node)) {
+        LINKED_LIST_PUSH(node->value, file);
+    } else {
+        id_to_vlt_file_insert (&vlt->files, file->id, file);
+    }
+}
+
+// File lists of each ID are sorted once and then copied into a single array,
+// files of the same ID end up next to each other in canonical order. After
+// this, file_id_lookup() is a read only operation that can be called from
+// multiple threads. The next pointers are kept so lists can still be iterated
+// as linked lists.
+void vlt_pack_files (struct file_vault_t *vlt)
+{
+    uint64_t num_files = 0;
+    {
+        BINARY_TREE_FOR (id_to_vlt_file, &vlt->files, curr_node) {
+            vlt_file_sort (&curr_node->value, -1);
+
+            LINKED_LIST_FOR (struct vlt_file_t*, curr_file, curr_node->value) {
+                num_files++;
+            }
+        }
+    }
+
+    vlt->files_array_len = num_files;
+    vlt->files_array = mem_pool_push_array (&vlt->pool, MAX(1, num_files), struct vlt_file_t);
+
+    uint64_t idx = 0;
+    {
+        BINARY_TREE_FOR (id_to_vlt_file, &vlt->files, curr_node) {
+            struct vlt_file_t *first = &vlt->files_array[idx];
+
+            LINKED_LIST_FOR (struct vlt_file_t*, curr_file, curr_node->value) {
+                struct vlt_file_t *packed = &vlt->files_array[idx];
+                *packed = *curr_file;
+                packed->next = NULL;
+                if (packed != first) {
+                    (packed-1)->next = packed;
+                }
+                idx++;
+            }
+
+            curr_node->value = first;
+        }
+    }
+}
+
+// Vault scan
+//
+// Scanning the files directory is dominated by filesystem calls, specially
+// when it's in a network filesystem. Each directory is a unit of work scanned
+// by a pool of threads, subdirectories found are pushed into a shared stack
+// any idle thread can take work from. The type of entries comes from d_type,
+// stat() is only called for symbolic links or when the filesystem doesn't
+// fill d_type.
+//
+// Threads don't touch the vault. Each scanned directory records its entries
+// in readdir order, with a placeholder for subdirectories. When all threads
+// finish, the resulting tree is walked depth first, adding files in the same
+// order iterate_dir() used to find them. This way the vault's content doesn't
+// depend on how threads were scheduled.
+//
+// Adding, removing or renaming an entry updates the modification time of the
+// directory that contains it. If the vault index has a listing for a directory
+// with the same modification time, we use it instead of reading the directory.
+// Then a vault with few changes costs one stat() per directory instead of
+// reading every entry.
+// :vault_scan
+struct vlt_scan_dir_t;
+
+struct vlt_scan_entry_t {
+    struct vlt_file_t *file;
+    struct vlt_scan_dir_t *subdir;
+
+    struct vlt_scan_entry_t *next;
+};
+
+struct vlt_scan_dir_t {
+    // Absolute path, always ends in a separator.
+    char *path;
+    struct timespec mtime;
+
+    LINKED_LIST_DECLARE(struct vlt_scan_entry_t, entries);
+
+    // Link in the stack of directories pending to be scanned.
+    struct vlt_scan_dir_t *next;
+};
+
+struct vlt_scan_t {
+    struct file_vault_t *vlt;
+    size_t base_dir_len;
+
+    // Compiled before starting the workers, see canonical_fname_parse().
+    Reprog *canonical_fname_regex;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+
+    struct vlt_scan_dir_t *pending;
+
+    // Directories pending or being scanned. When it gets to 0 we're done.
+    int num_unfinished;
+};
+
+struct vlt_scan_worker_t {
+    struct vlt_scan_t *scan;
+
+    // Files are allocated in pool, which lives as long as the vault.
+    // Everything else is only needed until files are added to the vault.
+    mem_pool_t *pool;
+    mem_pool_t scratch;
+
+    uint64_t num_entries;
+    uint64_t num_dirs;
+    uint64_t num_stat_calls;
+    uint64_t num_index_hits;
+};
+
+// Adds the entry called name in dir, path must contain its full path.
+void vlt_scan_add_entry (struct vlt_scan_worker_t *wrkr, struct vlt_scan_dir_t *dir, string_t *path, char *name, bool is_dir)
+{
+    struct vlt_scan_t *scan = wrkr->scan;
+
+    struct vlt_scan_entry_t *entry = NULL;
     if (!is_dir) {
-        char *basename = path_basename (fname);
-        struct vlt_file_t *file = canonical_fname_parse (&vlt->pool, basename, 0);
+        struct vlt_file_t *file = canonical_fname_parse (wrkr->pool, scan->canonical_fname_regex, name, 0);
         if (file != NULL) {
-            str_set (&file->path, fname + strlen(vlt->base_dir));
+            str_set (&file->path, str_data(path) + scan->base_dir_len);
 
-            struct id_to_vlt_file_node_t *node = NULL;
-            if (id_to_vlt_file_lookup (&vlt->files, file->id, &node)) {
-                LINKED_LIST_PUSH(node->value, file);
-            } else {
-                id_to_vlt_file_insert (&vlt->files, file->id, file);
+            entry = mem_pool_push_struct (&wrkr->scratch, struct vlt_scan_entry_t);
+            *entry = ZERO_INIT(struct vlt_scan_entry_t);
+            entry->file = file;
+        }
+
+    } else {
+        str_cat_c (path, "/");
+
+        struct vlt_scan_dir_t *subdir = mem_pool_push_struct (&wrkr->scratch, struct vlt_scan_dir_t);
+        *subdir = ZERO_INIT(struct vlt_scan_dir_t);
+        subdir->path = pom_strndup (&wrkr->scratch, str_data(path), str_len(path));
+
+        entry = mem_pool_push_struct (&wrkr->scratch, struct vlt_scan_entry_t);
+        *entry = ZERO_INIT(struct vlt_scan_entry_t);
+        entry->subdir = subdir;
+
+        pthread_mutex_lock (&scan->lock);
+        LINKED_LIST_PUSH (scan->pending, subdir);
+        scan->num_unfinished++;
+        pthread_cond_signal (&scan->work_available);
+        pthread_mutex_unlock (&scan->lock);
+    }
+
+    if (entry != NULL) {
+        LINKED_LIST_APPEND (dir->entries, entry);
+    }
+}
+
+bool vlt_scan_dir_from_index (struct vlt_scan_worker_t *wrkr, struct vlt_scan_dir_t *dir, string_t *path)
+{
+    struct vlt_scan_t *scan = wrkr->scan;
+    struct file_vault_t *vlt = scan->vlt;
+
+    struct vlt_index_dir_t cached;
+    if (vlt->index_path == NULL ||
+        !vlt_index_maybe_get (&vlt->index, dir->path + scan->base_dir_len, &cached) ||
+        cached.mtime.tv_sec != dir->mtime.tv_sec || cached.mtime.tv_nsec != dir->mtime.tv_nsec) {
+        return false;
+    }
+
+    wrkr->num_index_hits++;
+
+    size_t path_len = str_len (path);
+    char *entry = cached.entries;
+    for (uint32_t i=0; i<cached.num_entries; i++) {
+        char *name = entry + 1;
+        str_put_c (path, path_len, name);
+        vlt_scan_add_entry (wrkr, dir, path, name, *entry == 'd');
+
+        entry = name + strlen(name) + 1;
+    }
+
+    return true;
+}
+
+void vlt_scan_dir (struct vlt_scan_worker_t *wrkr, struct vlt_scan_dir_t *dir)
+{
+    wrkr->num_dirs++;
+
+    string_t path = {0};
+    str_set (&path, dir->path);
+    size_t path_len = str_len (&path);
+
+    // A directory whose modification time can't be read is never taken from
+    // the index, a zero mtime doesn't match any stored one.
+    struct stat st;
+    wrkr->num_stat_calls++;
+    if (stat(dir->path, &st) == 0) {
+        dir->mtime = st.st_mtim;
+    }
+
+    if (dir->mtime.tv_sec == 0 || !vlt_scan_dir_from_index (wrkr, dir, &path)) {
+        DIR *d = opendir (dir->path);
+        if (d == NULL) {
+            printf ("error: can't open directory '%s'\n", dir->path);
+            str_free (&path);
+            return;
+        }
+
+        struct dirent *entry_info;
+        while (read_dir (d, &entry_info)) {
+            // Hidden files, and the current and parent directories are skipped.
+            if (entry_info->d_name[0] == '.') continue;
+
+            wrkr->num_entries++;
+            str_put_c (&path, path_len, entry_info->d_name);
+
+            bool is_file = entry_info->d_type == DT_REG;
+            bool is_dir = entry_info->d_type == DT_DIR;
+            if (entry_info->d_type == DT_UNKNOWN || entry_info->d_type == DT_LNK) {
+                wrkr->num_stat_calls++;
+                if (stat(str_data(&path), &st) == 0) {
+                    is_file = S_ISREG(st.st_mode);
+                    is_dir = S_ISDIR(st.st_mode);
+                }
+            }
+
+            if (is_file || is_dir) {
+                vlt_scan_add_entry (wrkr, dir, &path, entry_info->d_name, is_dir);
             }
         }
+        closedir (d);
     }
+
+    str_free (&path);
 }
 
-void vlt_init (struct file_vault_t *vlt)
+void* vlt_scan_worker (void *data)
 {
-    mem_pool_variable_ensure((&vlt->files));
+    struct vlt_scan_worker_t *wrkr = (struct vlt_scan_worker_t*)data;
+    struct vlt_scan_t *scan = wrkr->scan;
+
+    pthread_mutex_lock (&scan->lock);
+    while (true) {
+        while (scan->pending == NULL && scan->num_unfinished > 0) {
+            pthread_cond_wait (&scan->work_available, &scan->lock);
+        }
+
+        if (scan->pending == NULL) break;
+
+        struct vlt_scan_dir_t *dir = LINKED_LIST_POP (scan->pending);
+        pthread_mutex_unlock (&scan->lock);
 
-    iterate_dir (vlt->base_dir, maybe_process_canonical_file, vlt);
+        vlt_scan_dir (wrkr, dir);
+
+        pthread_mutex_lock (&scan->lock);
+        scan->num_unfinished--;
+        if (scan->num_unfinished == 0) {
+            pthread_cond_broadcast (&scan->work_available);
+        }
+    }
+    pthread_mutex_unlock (&scan->lock);
+
+    return NULL;
 }
 
-bool is_canonical_id (char *s)
+void vlt_scan_add_files (struct file_vault_t *vlt, struct vlt_scan_dir_t *dir)
 {
-    const char *error;
-    Resub m;
-    Reprog *regex = regcomp(identifier_r, 0, &error);
-    int result = !regexec(regex, s, &m, 0);
+    LINKED_LIST_FOR (struct vlt_scan_entry_t*, curr_entry, dir->entries) {
+        if (curr_entry->file != NULL) {
+            vlt_add_file (vlt, curr_entry->file);
+        } else {
+            vlt_scan_add_files (vlt, curr_entry->subdir);
+        }
+    }
+}
 
-    return result;
+// :vault_index
+#define VLT_INDEX_HEADER "weaver-vault-index 1\n"
+
+// After the header, the index is a sequence of directory records:
+//
+//   <path relative to base_dir>\0 <mtime seconds:int64> <mtime nanoseconds:int64> <number of entries:uint32>
+//
+// followed by each entry, a type byte ('f' for files, 'd' for directories)
+// and its name\0. Only canonically named files are stored. Numbers use the
+// machine's byte order, this is a local cache, not an interchange format.
+//
+// Loading stops at the first malformed record, records before it are still
+// valid because each one is checked against the directory's mtime.
+static inline
+char* vlt_index_skip_str (char *pos, char *end)
+{
+    char *str_end = memchr (pos, '\0', end - pos);
+    return str_end != NULL ? str_end + 1 : NULL;
 }
 
-#define file_id_lookup(vlt,id) file_id_lookup_full(vlt,id,true)
-struct vlt_file_t* file_id_lookup_full (struct file_vault_t *vlt, uint64_t id, bool sorted)
+void vlt_index_load (struct file_vault_t *vlt)
 {
-    struct vlt_file_t *file = NULL;
+    if (vlt->index_path == NULL || !path_exists (vlt->index_path)) return;
+
+    uint64_t len = 0;
+    char *data = full_file_read (&vlt->pool, vlt->index_path, &len);
+    if (data == NULL) return;
+
+    size_t header_len = strlen (VLT_INDEX_HEADER);
+    if (len < header_len || strncmp (data, VLT_INDEX_HEADER, header_len) != 0) return;
+
+    char *pos = data + header_len;
+    char *end = data + len;
+    while (pos < end) {
+        char *path = pos;
+        pos = vlt_index_skip_str (pos, end);
+        if (pos == NULL || end - pos < 2*sizeof(int64_t) + sizeof(uint32_t)) break;
+
+        int64_t sec, nsec;
+        struct vlt_index_dir_t dir = {0};
+        memcpy (&sec, pos, sizeof(int64_t));
+        pos += sizeof(int64_t);
+        memcpy (&nsec, pos, sizeof(int64_t));
+        pos += sizeof(int64_t);
+        memcpy (&dir.num_entries, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        dir.mtime.tv_sec = sec;
+        dir.mtime.tv_nsec = nsec;
+        dir.entries = pos;
+
+        for (uint32_t i=0; pos != NULL && i<dir.num_entries; i++) {
+            if (pos == end || (*pos != 'f' && *pos != 'd')) {
+                pos = NULL;
+            } else {
+                pos = vlt_index_skip_str (pos + 1, end);
+            }
+        }
+        if (pos == NULL) break;
 
-    struct id_to_vlt_file_node_t *node = NULL;
-    if (id_to_vlt_file_lookup (&vlt->files, id, &node)) {
-        file = node->value;
+        vlt_index_insert (&vlt->index, path, dir);
+    }
+}
+
+void vlt_index_write_dir (FILE *f, struct vlt_scan_t *scan, struct vlt_scan_dir_t *dir, time_t scan_start)
+{
+    fwrite (dir->path + scan->base_dir_len, 1, strlen(dir->path + scan->base_dir_len) + 1, f);
+
+    // A directory modified in the same second we scanned it may change again
+    // without its mtime changing (filesystems with coarse timestamps). Store
+    // a zero mtime so it's read again next time.
+    int64_t sec = dir->mtime.tv_sec;
+    int64_t nsec = dir->mtime.tv_nsec;
+    if (sec + 1 >= scan_start) {
+        sec = 0;
+        nsec = 0;
+    }
+
+    uint32_t num_entries = 0;
+    LINKED_LIST_FOR (struct vlt_scan_entry_t*, curr_entry, dir->entries) {
+        num_entries++;
+    }
+
+    fwrite (&sec, sizeof(int64_t), 1, f);
+    fwrite (&nsec, sizeof(int64_t), 1, f);
+    fwrite (&num_entries, sizeof(uint32_t), 1, f);
+
+    {
+        LINKED_LIST_FOR (struct vlt_scan_entry_t*, curr_entry, dir->entries) {
+            if (curr_entry->file != NULL) {
+                char *name = path_basename (str_data(&curr_entry->file->path));
+                fputc ('f', f);
+                fwrite (name, 1, strlen(name) + 1, f);
+            } else {
+                char *name = curr_entry->subdir->path + strlen(dir->path);
+                fputc ('d', f);
+                fwrite (name, 1, strlen(name) - 1, f);
+                fputc ('\0', f);
+            }
+        }
+    }
+
+    {
+        LINKED_LIST_FOR (struct vlt_scan_entry_t*, curr_entry, dir->entries) {
+            if (curr_entry->subdir != NULL) {
+                vlt_index_write_dir (f, scan, curr_entry->subdir, scan_start);
+            }
+        }
+    }
+}
+
+// The index can get big, it's written through a buffered stream instead of
+// building it in a string_t.
+void vlt_index_write (struct vlt_scan_t *scan, struct vlt_scan_dir_t *root, time_t scan_start)
+{
+    struct file_replace_t fr;
+    FILE *f = file_replace_begin (&fr, scan->vlt->index_path);
+    if (f != NULL) {
+        fputs (VLT_INDEX_HEADER, f);
+        vlt_index_write_dir (f, scan, root, scan_start);
+        file_replace_end (&fr);
     }
+}
 
-    if (sorted) {
-        vlt_file_sort (&file, -1);
+void vlt_init (struct file_vault_t *vlt)
+{
+    mem_pool_variable_ensure((&vlt->files));
+
+    time_t scan_start = time(NULL);
+    vlt->index.pool = &vlt->pool;
+    vlt_index_load (vlt);
+
+    STACK_ALLOCATE (struct vlt_scan_t, scan);
+    scan->vlt = vlt;
+    scan->base_dir_len = strlen (vlt->base_dir);
+    scan->canonical_fname_regex = regcomp_cached (canonical_fname_r);
+    pthread_mutex_init (&scan->lock, NULL);
+    pthread_cond_init (&scan->work_available, NULL);
+
+    int num_workers = MAX(1, vlt->jobs);
+    struct vlt_scan_worker_t *workers = mem_pool_push_array (&vlt->pool, num_workers, struct vlt_scan_worker_t);
+    for (int i=0; i<num_workers; i++) {
+        workers[i] = ZERO_INIT(struct vlt_scan_worker_t);
+        workers[i].scan = scan;
+
+        workers[i].pool = mem_pool_push_struct (&vlt->pool, mem_pool_t);
+        *workers[i].pool = ZERO_INIT(mem_pool_t);
+        mem_pool_add_child (&vlt->pool, workers[i].pool);
+    }
+
+    struct vlt_scan_dir_t *root = mem_pool_push_struct (&workers[0].scratch, struct vlt_scan_dir_t);
+    *root = ZERO_INIT(struct vlt_scan_dir_t);
+    {
+        string_t root_path = str_new (vlt->base_dir);
+        str_path_ensure_ends_in_separator(&root_path);
+        root->path = pom_strndup (&workers[0].scratch, str_data(&root_path), str_len(&root_path));
+        str_free (&root_path);
     }
+    scan->pending = root;
+    scan->num_unfinished = 1;
 
+    pthread_t *threads = malloc (num_workers*sizeof(pthread_t));
+    for (int i=1; i<num_workers; i++) {
+        pthread_create (&threads[i], NULL, vlt_scan_worker, &workers[i]);
+    }
+    vlt_scan_worker (&workers[0]);
+    for (int i=1; i<num_workers; i++) {
+        pthread_join (threads[i], NULL);
+    }
+    free (threads);
+
+    vlt_scan_add_files (vlt, root);
+    vlt_pack_files (vlt);
+
+    vlt->num_scanned_entries = 0;
+    vlt->num_scanned_dirs = 0;
+    vlt->num_stat_calls = 0;
+    vlt->num_index_hits = 0;
+    for (int i=0; i<num_workers; i++) {
+        vlt->num_scanned_entries += workers[i].num_entries;
+        vlt->num_scanned_dirs += workers[i].num_dirs;
+        vlt->num_stat_calls += workers[i].num_stat_calls;
+        vlt->num_index_hits += workers[i].num_index_hits;
+    }
+
+    // The index only needs to be written again if some directory was read.
+    if (vlt->index_path != NULL && vlt->num_index_hits < vlt->num_scanned_dirs) {
+        vlt_index_write (scan, root, scan_start);
+    }
+
+    for (int i=0; i<num_workers; i++) {
+        mem_pool_destroy (&workers[i].scratch);
+    }
+
+    pthread_mutex_destroy (&scan->lock);
+    pthread_cond_destroy (&scan->work_available);
+}
+
+struct vlt_file_t* file_id_lookup (struct file_vault_t *vlt, uint64_t id)
+{
+    struct vlt_file_t *file = NULL;
+    id_to_vlt_file_maybe_get (&vlt->files, id, &file);
     return file;
 }
@@ -2,15 +2,97 @@
  * Copyright (C) 2021 Santiago León O.
  */
 
-BINARY_TREE_NEW(attribute_map, string_t, string_t, strcmp(str_data(&a),str_data(&b)))
+// A site with thousands of notes creates millions of elements, most of them
+// text nodes. To keep them small, everything an element points to lives in the
+// html_t's pool: tag names are interned into the table below, attributes are a
+// small array that's only allocated if the element has any, and text nodes are
+// slices of pooled memory.
+
+#define HTML_TAG_INLINE         0x1
+#define HTML_TAG_VOID           0x2
+#define HTML_TAG_PRESERVE_SPACE 0x4 // Whitespace in text inside it is significant
+#define HTML_TAG_BLOCK_CHILDREN 0x8 // Only has block children, whitespace between them is ignored
+
+#define HTML_TAGS_TABLE                             \
+    HTML_TAGS_ROW(HTML_TAG_NONE,       "",       0) \
+    HTML_TAGS_ROW(HTML_TAG_A,          "a",      HTML_TAG_INLINE) \
+    HTML_TAGS_ROW(HTML_TAG_B,          "b",      HTML_TAG_INLINE) \
+    HTML_TAGS_ROW(HTML_TAG_I,          "i",      HTML_TAG_INLINE) \
+    HTML_TAGS_ROW(HTML_TAG_P,          "p",      HTML_TAG_INLINE) \
+    HTML_TAGS_ROW(HTML_TAG_PRE,        "pre",    HTML_TAG_INLINE|HTML_TAG_PRESERVE_SPACE) \
+    HTML_TAGS_ROW(HTML_TAG_CODE,       "code",   HTML_TAG_PRESERVE_SPACE) \
+    HTML_TAGS_ROW(HTML_TAG_DIV,        "div",    0) \
+    HTML_TAGS_ROW(HTML_TAG_SPAN,       "span",   0) \
+    HTML_TAGS_ROW(HTML_TAG_UL,         "ul",     HTML_TAG_BLOCK_CHILDREN) \
+    HTML_TAGS_ROW(HTML_TAG_OL,         "ol",     HTML_TAG_BLOCK_CHILDREN) \
+    HTML_TAGS_ROW(HTML_TAG_LI,         "li",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H1,         "h1",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H2,         "h2",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H3,         "h3",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H4,         "h4",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H5,         "h5",     0) \
+    HTML_TAGS_ROW(HTML_TAG_H6,         "h6",     0) \
+    HTML_TAGS_ROW(HTML_TAG_IFRAME,     "iframe", 0) \
+    HTML_TAGS_ROW(HTML_TAG_AREA,       "area",   HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_BASE,       "base",   HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_BR,         "br",     HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_COL,        "col",    HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_EMBED,      "embed",  HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_HR,         "hr",     HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_IMG,        "img",    HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_INPUT,      "input",  HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_LINK,       "link",   HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_META,       "meta",   HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_PARAM,      "param",  HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_SOURCE,     "source", HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_TRACK,      "track",  HTML_TAG_VOID) \
+    HTML_TAGS_ROW(HTML_TAG_WBR,        "wbr",    HTML_TAG_VOID)
+
+#define HTML_TAGS_ROW(id,name,flags) id,
+enum html_tag_t {
+    HTML_TAGS_TABLE
+
+    // Tags that aren't in the table keep a pooled copy of their name.
+    HTML_TAG_OTHER
+};
+#undef HTML_TAGS_ROW
+
+#define HTML_TAGS_ROW(id,name,flags) {name, sizeof(name)-1, flags},
+struct html_tag_info_t {
+    char *name;
+    uint32_t len;
+    uint32_t flags;
+} html_tags[] = {
+    HTML_TAGS_TABLE
+};
+#undef HTML_TAGS_ROW
+
+struct html_attribute_t {
+    sstring_t name;
+
+    char *value;
+    uint32_t value_len;
+    uint32_t value_capacity;
+};
 
 struct html_element_t {
-    string_t tag;
-    struct attribute_map_t attributes;
+    enum html_tag_t tag;
+    sstring_t tag_name;
+
+    // Sorted by name, this is the order in which they are serialized.
+    struct html_attribute_t *attributes;
+    uint16_t attributes_len;
+    uint16_t attributes_size;
+
+    // Text that was appended without escaping, it's HTML and is always written
+    // as is.
+    bool is_raw;
 
     struct html_element_t *next;
 
-    string_t text;
+    // Text nodes are elements with non empty text. The text is always null
+    // terminated.
+    sstring_t text;
     struct html_element_t *children;
     struct html_element_t *children_end;
 };
@@ -29,12 +111,54 @@ void html_destroy (struct html_t *html)
     mem_pool_destroy (html->pool);
 }
 
-void html_escape (string_t *str)
+// Copies text into the pool escaping < and >.
+sstring_t html_escaped_strn (mem_pool_t *pool, size_t len, char *text)
 {
-    str_replace (str, "<", "&lt;", NULL);
-    str_replace (str, ">", "&gt;", NULL);
+    size_t escaped_len = len;
+    for (size_t i=0; i<len; i++) {
+        if (text[i] == '<' || text[i] == '>') escaped_len += 3;
+    }
+
+    char *res = mem_pool_push_size (pool, escaped_len + 1);
+    if (escaped_len == len) {
+        memcpy (res, text, len);
+
+    } else {
+        char *pos = res;
+        for (size_t i=0; i<len; i++) {
+            if (text[i] == '<') {
+                memcpy (pos, "&lt;", 4);
+                pos += 4;
+            } else if (text[i] == '>') {
+                memcpy (pos, "&gt;", 4);
+                pos += 4;
+            } else {
+                *pos++ = text[i];
+            }
+        }
+    }
+    res[escaped_len] = '\0';
+
+    return SSTRING(res, escaped_len);
 }
 
+static inline
+void html_element_tag_set_strn (struct html_t *html, struct html_element_t *html_element, size_t len, char *tag_name)
+{
+    for (int i=0; i<ARRAY_SIZE(html_tags); i++) {
+        if (html_tags[i].len == len && strncmp (html_tags[i].name, tag_name, len) == 0) {
+            html_element->tag = i;
+            html_element->tag_name = SSTRING(html_tags[i].name, html_tags[i].len);
+            return;
+        }
+    }
+
+    html_element->tag = HTML_TAG_OTHER;
+    html_element->tag_name = SSTRING(pom_strndup (html->pool, tag_name, len), len);
+}
+
+#define html_element_tag_set(html,html_element,tag_name) html_element_tag_set_strn(html,html_element,strlen(tag_name),tag_name)
+
 struct html_element_t* html_new_node (struct html_t *html)
 {
     mem_pool_variable_ensure (html);
@@ -43,19 +167,14 @@ struct html_element_t* html_new_node (struct html_t *html)
     if (html->element_fl != NULL) {
         new_element = LINKED_LIST_POP (html->element_fl);
 
-        // TODO: This isn't implemented in binary_tree.c
-        // attribute_map_clear (&new_element->attributes);
-        str_set (&new_element->tag, "");
-        str_set (&new_element->text, "");
-
     } else {
         new_element = mem_pool_push_struct (html->pool, struct html_element_t);
-        *new_element = ZERO_INIT (struct html_element_t);
-        new_element->attributes.pool = html->pool;
-        str_pool (html->pool, &new_element->tag);
-        str_pool (html->pool, &new_element->text);
     }
 
+    *new_element = ZERO_INIT (struct html_element_t);
+    new_element->tag_name = SSTRING("", 0);
+    new_element->text = SSTRING("", 0);
+
     return new_element;
 }
 
@@ -64,7 +183,7 @@ struct html_element_t* html_new_element_strn (struct html_t *html, ssize_t len,
 {
     struct html_element_t *new_element = html_new_node (html);
 
-    strn_set (&new_element->tag, tag_name, len);
+    html_element_tag_set_strn (html, new_element, len, tag_name);
 
     if (html->root == NULL) {
         html->root = new_element;
@@ -95,7 +214,9 @@ void html_element_append_child (struct html_t *html, struct html_element_t *html
 void html_element_set_text (struct html_t *html, struct html_element_t *html_element, char *text)
 {
     struct html_element_t *new_text_node = html_new_node (html);
-    str_set (&new_text_node->text, text);
+    size_t len = strlen(text);
+    new_text_node->text = SSTRING(pom_strndup (html->pool, text, len), len);
+    new_text_node->is_raw = true;
 
     // Recycle the old children node
     if (html_element->children != NULL) {
@@ -111,8 +232,7 @@ void html_element_set_text (struct html_t *html, struct html_element_t *html_ele
 void html_element_append_strn (struct html_t *html, struct html_element_t *html_element, size_t len, char *text)
 {
     struct html_element_t *new_text_node = html_new_node (html);
-    strn_set (&new_text_node->text, text, len);
-    html_escape (&new_text_node->text);
+    new_text_node->text = html_escaped_strn (html->pool, len, text);
     LINKED_LIST_APPEND (html_element->children, new_text_node);
 }
 
@@ -122,9 +242,10 @@ bool html_element_child_ends_in_space (struct html_element_t *html_element)
     bool result = false;
 
     if (html_element->children != NULL &&
-        str_len(&html_element->children_end->tag) == 0) {
-        char c = str_last(&html_element->children_end->text);
-        result = is_space(&c);
+        html_element->children_end->tag_name.len == 0 &&
+        html_element->children_end->text.len > 0) {
+        struct html_element_t *last = html_element->children_end;
+        result = is_space(&last->text.s[last->text.len - 1]);
     }
 
     return result;
@@ -134,179 +255,458 @@ bool html_element_child_ends_in_space (struct html_element_t *html_element)
 void html_element_append_no_escape_strn (struct html_t *html, struct html_element_t *html_element, size_t len, char *text)
 {
     struct html_element_t *new_text_node = html_new_node (html);
-    strn_set (&new_text_node->text, text, len);
+    new_text_node->text = SSTRING(pom_strndup (html->pool, text, len), len);
+    new_text_node->is_raw = true;
     LINKED_LIST_APPEND (html_element->children, new_text_node);
 }
 
-// TODO: Make this receive printf parameters and format string.
-void html_element_attribute_set (struct html_t *html, struct html_element_t *html_element,
-    sstring_t attribute, sstring_t value)
+// Makes a text node end at len, also removes trailing spaces.
+void html_text_node_shrink (struct html_element_t *text_node, size_t len)
+{
+    assert (len <= text_node->text.len);
+
+    while (len > 0 && text_node->text.s[len-1] == ' ') len--;
+    if (len < text_node->text.len) {
+        text_node->text.len = len;
+        text_node->text.s[len] = '\0';
+    }
+}
+
+// Returns the attribute with the passed name, creating it if it doesn't exist.
+struct html_attribute_t* html_element_attribute_get (struct html_t *html, struct html_element_t *html_element, sstring_t name)
 {
     mem_pool_variable_ensure (html);
 
-    string_t *attribute_str = strn_new_pooled (html->pool, attribute.s, attribute.len);
+    int idx = 0;
+    while (idx < html_element->attributes_len) {
+        sstring_t *curr_name = &html_element->attributes[idx].name;
+        int cmp = strncmp (curr_name->s, name.s, MIN(curr_name->len, name.len));
+        if (cmp == 0) cmp = (int)curr_name->len - (int)name.len;
+        if (cmp == 0) {
+            return &html_element->attributes[idx];
 
-    struct attribute_map_node_t *node;
-    attribute_map_lookup (&html_element->attributes, *attribute_str, &node);
-    if (node == NULL) {
-        string_t *value_str = strn_new_pooled (html->pool, value.s, value.len);
-        attribute_map_insert (&html_element->attributes, *attribute_str, *value_str);
+        } else if (cmp > 0) {
+            break;
+        }
 
-    } else {
-        strn_set (&node->value, value.s, value.len);
+        idx++;
+    }
+
+    if (html_element->attributes_len == html_element->attributes_size) {
+        // Elements rarely have more than a couple of attributes, when growing
+        // the old array is left in the pool.
+        int new_size = html_element->attributes_size == 0 ? 2 : 2*html_element->attributes_size;
+        struct html_attribute_t *new_attributes = mem_pool_push_array (html->pool, new_size, struct html_attribute_t);
+        if (html_element->attributes_len > 0) {
+            memcpy (new_attributes, html_element->attributes, html_element->attributes_len*sizeof(*new_attributes));
+        }
+
+        html_element->attributes = new_attributes;
+        html_element->attributes_size = new_size;
+    }
+
+    memmove (&html_element->attributes[idx + 1], &html_element->attributes[idx],
+             (html_element->attributes_len - idx)*sizeof(*html_element->attributes));
+    html_element->attributes_len++;
+
+    struct html_attribute_t *attribute = &html_element->attributes[idx];
+    *attribute = ZERO_INIT (struct html_attribute_t);
+    attribute->name = SSTRING(pom_strndup (html->pool, name.s, name.len), name.len);
+    attribute->value = "";
+
+    return attribute;
+}
+
+static inline
+void html_attribute_value_cat (struct html_t *html, struct html_attribute_t *attribute, char *separator, sstring_t value)
+{
+    // Only separate from a previous value, an attribute that was just created
+    // hasn't allocated one yet.
+    size_t separator_len = attribute->value_capacity > 0 ? strlen(separator) : 0;
+    size_t new_len = attribute->value_len + separator_len + value.len;
+
+    if (new_len + 1 > attribute->value_capacity) {
+        char *new_value = mem_pool_push_size (html->pool, new_len + 1);
+        memcpy (new_value, attribute->value, attribute->value_len);
+        attribute->value = new_value;
+        attribute->value_capacity = new_len + 1;
     }
+
+    memcpy (attribute->value + attribute->value_len, separator, separator_len);
+    memcpy (attribute->value + attribute->value_len + separator_len, value.s, value.len);
+    attribute->value_len = new_len;
+    attribute->value[new_len] = '\0';
+}
+
+// TODO: Make this receive printf parameters and format string.
+void html_element_attribute_set (struct html_t *html, struct html_element_t *html_element,
+    sstring_t attribute, sstring_t value)
+{
+    struct html_attribute_t *attr = html_element_attribute_get (html, html_element, attribute);
+    attr->value_len = 0;
+    html_attribute_value_cat (html, attr, "", value);
 }
 
 // NOTE: Don't pass multiple space-separated classes as value, instead call this
 // function multiple times.
 void html_element_class_add (struct html_t *html, struct html_element_t *html_element, char *value)
 {
-    mem_pool_variable_ensure (html);
+    struct html_attribute_t *attr = html_element_attribute_get (html, html_element, SSTR("class"));
+    html_attribute_value_cat (html, attr, " ", SSTR(value));
+}
 
-    string_t attr = {0};
-    str_set (&attr, "class");
+void html_element_style_add (struct html_t *html, struct html_element_t *html_element, char *value)
+{
+    struct html_attribute_t *attr = html_element_attribute_get (html, html_element, SSTR("style"));
+    html_attribute_value_cat (html, attr, "; ", SSTR(value));
+}
 
-    struct attribute_map_node_t *node;
-    attribute_map_lookup (&html_element->attributes, attr, &node);
-    if (node == NULL) {
-        html_element_attribute_set (html, html_element, SSTR(str_data(&attr)), SSTR(value));
+static inline
+bool html_element_is_text_node (struct html_element_t *element)
+{
+    return element->text.len > 0;
+}
 
-    } else {
-        str_cat_printf (&node->value, " %s", value);
+static inline
+bool html_is_inline_tag (struct html_element_t *element)
+{
+    return element->tag != HTML_TAG_OTHER && (html_tags[element->tag].flags & HTML_TAG_INLINE);
+}
+
+static inline
+bool html_is_void_element (struct html_element_t *element)
+{
+    return element->tag != HTML_TAG_OTHER && (html_tags[element->tag].flags & HTML_TAG_VOID);
+}
+
+static inline
+bool html_tag_has_flag (struct html_element_t *element, uint32_t flag)
+{
+    return element->tag != HTML_TAG_OTHER && (html_tags[element->tag].flags & flag);
+}
+
+//////////////////////
+// HTML SERIALIZATION
+//
+// Elements are written through a small buffered writer that either appends to
+// a string_t or writes to a file descriptor. Notes are written to their output
+// file as they are serialized, without building the full HTML in memory first.
+//
+// Passing HTML_MINIFY as indentation writes compact HTML instead of pretty
+// printing it. Indentation is dropped, line breaks are kept only where they
+// separate elements whose spacing could be visible, and runs of whitespace in
+// escaped text are collapsed into a single space, except inside elements
+// flagged with HTML_TAG_PRESERVE_SPACE. The result renders the same.
+// :minify
+
+#define HTML_WRITER_BUFFER_SIZE 16384
+
+#define HTML_MINIFY -1
+
+struct html_writer_t {
+    int fd;
+    string_t *str;
+    bool error;
+
+    bool minify;
+    int preserve_space;
+
+    // Last character written, indentation depends on it.
+    char last;
+
+    uint32_t len;
+    char buffer[HTML_WRITER_BUFFER_SIZE];
+};
+
+void html_writer_init_fd (struct html_writer_t *w, int fd)
+{
+    w->fd = fd;
+    w->str = NULL;
+    w->error = false;
+    w->minify = false;
+    w->preserve_space = 0;
+    w->last = '\0';
+    w->len = 0;
+}
+
+void html_writer_init_str (struct html_writer_t *w, string_t *str)
+{
+    w->fd = -1;
+    w->str = str;
+    w->error = false;
+    w->minify = false;
+    w->preserve_space = 0;
+    w->last = str_len(str) > 0 ? str_last(str) : '\0';
+    w->len = 0;
+}
+
+static inline
+void html_writer_output (struct html_writer_t *w, const char *data, size_t len)
+{
+    if (w->str != NULL) {
+        strn_cat_c (w->str, (char*)data, len);
+
+    } else if (!w->error) {
+        size_t bytes_written = 0;
+        while (bytes_written < len) {
+            ssize_t status = write (w->fd, data + bytes_written, len - bytes_written);
+            if (status == -1) {
+                if (errno == EINTR) continue;
+                w->error = true;
+                break;
+            }
+            bytes_written += status;
+        }
     }
-    str_free (&attr);
 }
 
-// FIXME: Why does this cause a double free but the cass add doesn't?... is it
-// related to the fact that classes are shirt and style strings are longer?...
-void html_element_style_add (struct html_t *html, struct html_element_t *html_element, char *value)
+void html_writer_flush (struct html_writer_t *w)
 {
-    mem_pool_variable_ensure (html);
+    if (w->len > 0) {
+        html_writer_output (w, w->buffer, w->len);
+        w->len = 0;
+    }
+}
 
-    string_t attr = {0};
-    str_set (&attr, "style");
+static inline
+void html_writer_strn (struct html_writer_t *w, const char *data, size_t len)
+{
+    if (len == 0) return;
 
-    struct attribute_map_node_t *node;
-    attribute_map_lookup (&html_element->attributes, attr, &node);
-    if (node == NULL) {
-        // And the double freed block was allocated here...
-        html_element_attribute_set (html, html_element, SSTR(str_data(&attr)), SSTR(value));
+    if (w->len + len > HTML_WRITER_BUFFER_SIZE) {
+        html_writer_flush (w);
+    }
+
+    if (len > HTML_WRITER_BUFFER_SIZE) {
+        html_writer_output (w, data, len);
 
     } else {
-        // The double free seems to come from here!...
-        str_cat_printf (&node->value, "; %s", value);
+        memcpy (w->buffer + w->len, data, len);
+        w->len += len;
     }
-    str_free (&attr);
+
+    w->last = data[len-1];
 }
 
 static inline
-bool html_element_is_text_node (struct html_element_t *element)
+void html_writer_sstr (struct html_writer_t *w, sstring_t *str)
 {
-    return str_len (&element->text) > 0;
+    html_writer_strn (w, str->s, str->len);
 }
 
 static inline
-bool html_is_inline_tag (struct html_element_t *element)
+void html_writer_char (struct html_writer_t *w, char c)
 {
-    char *inline_tags[] = {"pre", "p", "i", "b", "a"};
-    for (int i=0; i<ARRAY_SIZE(inline_tags); i++) {
-        if (strcmp(str_data(&element->tag), inline_tags[i]) == 0) return true;
+    if (w->len == HTML_WRITER_BUFFER_SIZE) {
+        html_writer_flush (w);
     }
-    return false;
+
+    w->buffer[w->len++] = c;
+    w->last = c;
 }
 
 static inline
-bool html_is_void_element (struct html_element_t *element)
+bool html_is_space (char c)
 {
-    char *void_elemens[] = {"area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param", "source", "track", "wbr"};
-    for (int i=0; i<ARRAY_SIZE(void_elemens); i++) {
-        if (strcmp(str_data(&element->tag), void_elemens[i]) == 0) return true;
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Writes text replacing runs of whitespace with a single space. Whitespace at
+// the start is skipped if the last character written was whitespace.
+// :minify
+void html_writer_collapsed_sstr (struct html_writer_t *w, sstring_t *text)
+{
+    char *end = text->s + text->len;
+    char *pos = text->s;
+    bool after_space = html_is_space (w->last);
+
+    while (pos < end) {
+        char *start = pos;
+        while (pos < end && !html_is_space(*pos)) pos++;
+        html_writer_strn (w, start, pos - start);
+        if (pos > start) after_space = false;
+
+        if (pos < end) {
+            while (pos < end && html_is_space(*pos)) pos++;
+            if (!after_space) html_writer_char (w, ' ');
+            after_space = true;
+        }
     }
-    return false;
 }
 
+// Line break before a child element, or before the closing tag of an element
+// with children.
 static inline
-void html_maybe_cat_tag_end (string_t *str, struct html_element_t *element, int curr_indent)
+void html_writer_separator (struct html_writer_t *w, struct html_element_t *parent)
+{
+    if (!w->minify || !html_tag_has_flag (parent, HTML_TAG_BLOCK_CHILDREN)) {
+        html_writer_char (w, '\n');
+    }
+}
+
+// Same as str_cat_indented_c() for strings without line breaks.
+static inline
+void html_writer_indent (struct html_writer_t *w, int curr_indent)
+{
+    if (!w->minify && w->last == '\n') {
+        for (int i=0; i<curr_indent; i++) {
+            html_writer_char (w, ' ');
+        }
+    }
+}
+
+static inline
+void html_write_maybe_tag_end (struct html_writer_t *w, struct html_element_t *element, int curr_indent)
 {
     if (!html_is_void_element (element)) {
-        str_cat_indented_printf (str, curr_indent, "</%s>", str_data(&element->tag));
+        html_writer_indent (w, curr_indent);
+        html_writer_strn (w, "</", 2);
+        html_writer_sstr (w, &element->tag_name);
+        html_writer_char (w, '>');
     }
 }
 
-void str_cat_html_element (string_t *str, struct html_element_t *element, int indent, int curr_indent)
+void html_write_element (struct html_writer_t *w, struct html_element_t *element, int indent, int curr_indent)
 {
     if (html_element_is_text_node (element)) {
-        str_cat (str, &element->text);
+        if (w->minify && !element->is_raw && w->preserve_space == 0) {
+            html_writer_collapsed_sstr (w, &element->text);
+        } else {
+            html_writer_sstr (w, &element->text);
+        }
 
     } else {
-        str_cat_indented_printf (str, curr_indent, "<%s", str_data(&element->tag));
-
-        BINARY_TREE_FOR(attribute_map, &element->attributes, attr_node)
-        {
-            if (str_len(&attr_node->value) > 0) {
-                str_cat_printf (str, " %s=\"%s\"", str_data(&attr_node->key), str_data(&attr_node->value));
-            } else {
-                str_cat_printf (str, " %s", str_data(&attr_node->key));
+        html_writer_indent (w, curr_indent);
+        html_writer_char (w, '<');
+        html_writer_sstr (w, &element->tag_name);
+
+        for (int i=0; i<element->attributes_len; i++) {
+            struct html_attribute_t *attr = &element->attributes[i];
+
+            html_writer_char (w, ' ');
+            html_writer_sstr (w, &attr->name);
+            if (attr->value_len > 0) {
+                html_writer_strn (w, "=\"", 2);
+                html_writer_strn (w, attr->value, attr->value_len);
+                html_writer_char (w, '"');
             }
         }
 
-        str_cat_printf (str, ">");
+        html_writer_char (w, '>');
 
         if (element->children != NULL) {
+            bool preserve_space = html_tag_has_flag (element, HTML_TAG_PRESERVE_SPACE);
+            if (preserve_space) w->preserve_space++;
+
             bool was_inlined = true;
             LINKED_LIST_FOR (struct html_element_t*, curr_child, element->children)
             {
                 if (!html_element_is_text_node (curr_child) && !html_is_inline_tag(element)) {
                     was_inlined = false;
-                    str_cat_c (str, "\n");
-                    str_cat_html_element (str, curr_child, indent, curr_indent+indent);
+                    html_writer_separator (w, element);
+                    html_write_element (w, curr_child, indent, curr_indent+indent);
 
                 } else {
-                    str_cat_html_element (str, curr_child, indent, 0);
+                    html_write_element (w, curr_child, indent, 0);
                 }
             }
 
+            if (preserve_space) w->preserve_space--;
+
             if (!was_inlined) {
-                str_cat_c (str, "\n");
-                html_maybe_cat_tag_end (str, element, curr_indent);
+                html_writer_separator (w, element);
+                html_write_maybe_tag_end (w, element, curr_indent);
 
             } else {
-                html_maybe_cat_tag_end (str, element, 0);
+                html_write_maybe_tag_end (w, element, 0);
             }
 
         } else {
-            html_maybe_cat_tag_end (str, element, 0);
+            html_write_maybe_tag_end (w, element, 0);
+        }
+    }
+}
+
+void html_write (struct html_writer_t *w, struct html_t *html, int indent)
+{
+    w->minify = (indent == HTML_MINIFY);
+
+    html_write_element (w, html->root, indent, 0);
+    if (!w->minify) html_writer_char (w, '\n');
+}
+
+// Returns true on failure, like full_file_write().
+bool html_write_file (struct html_t *html, int indent, const char *path)
+{
+    bool failed = false;
+
+    int file = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file != -1) {
+        struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+        html_writer_init_fd (w, file);
+
+        html_write (w, html, indent);
+        html_writer_flush (w);
+
+        if (w->error) {
+            printf ("Error writing %s: %s\n", path, strerror(errno));
+            failed = true;
+        }
+
+        free (w);
+        close (file);
+
+    } else {
+        failed = true;
+        if (errno != EACCES) {
+            printf ("Error opening %s: %s\n", path, strerror(errno));
         }
     }
+
+    return failed;
+}
+
+void str_cat_html_element (string_t *str, struct html_element_t *element, int indent, int curr_indent)
+{
+    struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+    html_writer_init_str (w, str);
+    w->minify = (indent == HTML_MINIFY);
+    html_write_element (w, element, indent, curr_indent);
+    html_writer_flush (w);
+    free (w);
 }
 
 static inline
 void str_cat_html(string_t *str, struct html_t *html, int indent)
 {
-    str_cat_html_element (str,html->root,indent,0);
-    str_cat_c (str, "\n");
+    struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+    html_writer_init_str (w, str);
+    html_write (w, html, indent);
+    html_writer_flush (w);
+    free (w);
 }
 
 static inline
-void str_cat_html_element_children(string_t *str,
+void str_cat_html_element_siblings(string_t *str,
     struct html_element_t *element, int indent)
 {
-    LINKED_LIST_FOR (struct html_element_t*, curr_child, element->children)
+    struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+    html_writer_init_str (w, str);
+    w->minify = (indent == HTML_MINIFY);
+    LINKED_LIST_FOR (struct html_element_t*, curr_child, element)
     {
-        str_cat_html_element (str,curr_child,indent,0);
+        html_write_element (w, curr_child, indent, 0);
     }
-    str_cat_c (str, "\n");
+    if (!w->minify) html_writer_char (w, '\n');
+    html_writer_flush (w);
+    free (w);
 }
 
 static inline
-void str_cat_html_element_siblings(string_t *str,
+void str_cat_html_element_children(string_t *str,
     struct html_element_t *element, int indent)
 {
-    LINKED_LIST_FOR (struct html_element_t*, curr_child, element)
-    {
-        str_cat_html_element (str,curr_child,indent,0);
-    }
-    str_cat_c (str, "\n");
+    str_cat_html_element_siblings (str, element->children, indent);
 }
 
 char* html_to_str (struct html_t *html, mem_pool_t *pool, int indent)
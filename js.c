@@ -2,6 +2,203 @@
  * Copyright (C) 2021 Santiago León O.
  */
 
+// Math rendering cache
+//
+// Rendered KaTeX HTML is stored in the weaver home directory, keyed by the
+// hash of the display mode and the expression. Expressions that didn't change
+// since the last run cost a tree lookup, they don't touch the javascript
+// engine at all. If every expression of a run is in the cache, KaTeX isn't
+// even loaded.
+//
+// The cache is discarded if KaTeX changes, a different version may render
+// expressions differently.
+//
+// Entries are kept in memory even if there's no cache file, so expressions
+// repeated in a run are rendered once, and rt_prerender_math() can fill the
+// cache from multiple threads before user callbacks run.
+// :math_cache
+#define MATH_CACHE_HEADER "weaver-math-cache 2"
+
+// TODO: Put this in an embedded resource so we don't depend on the location
+// from which the executable is run. Builds with KATEX_BYTECODE don't read it.
+// :remove_relative_paths
+#define KATEX_PATH "static/lib/katex/katex.min.js"
+
+// :katex_bytecode
+#if !defined(NO_JS) && defined(KATEX_BYTECODE)
+#include KATEX_BYTECODE
+#endif
+
+struct math_cache_entry_t {
+    bool is_display_mode;
+
+    // Set when the entry is looked up or added in this run.
+    bool is_used;
+
+    uint32_t expression_len;
+    char *expression;
+
+    uint32_t html_len;
+    char *html;
+};
+BINARY_TREE_NEW (math_cache, uint64_t, struct math_cache_entry_t*, (a==b) ? 0 : (a<b ? -1 : 1));
+
+struct math_cache_t math_cache;
+pthread_mutex_t math_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+char *math_cache_path = NULL;
+bool math_cache_changed = false;
+
+uint64_t math_cache_key (bool is_display_mode, int len, char *expression)
+{
+    uint64_t key = build_hash (BUILD_HASH_INIT, &is_display_mode, sizeof(is_display_mode));
+    return build_hash (key, expression, len);
+}
+
+struct math_cache_entry_t* math_cache_find (uint64_t key, bool is_display_mode, int len, char *expression)
+{
+    pthread_mutex_lock (&math_cache_lock);
+    struct math_cache_entry_t *entry = NULL;
+    if (math_cache_maybe_get (&math_cache, key, &entry)) {
+        if (entry->is_display_mode != is_display_mode || entry->expression_len != len ||
+            memcmp (entry->expression, expression, len) != 0) {
+            entry = NULL;
+
+        } else {
+            entry->is_used = true;
+        }
+    }
+    pthread_mutex_unlock (&math_cache_lock);
+
+    return entry;
+}
+
+void math_cache_put (uint64_t key, bool is_display_mode, int len, char *expression, size_t html_len, const char *html)
+{
+    pthread_mutex_lock (&math_cache_lock);
+    mem_pool_variable_ensure ((&math_cache));
+
+    struct math_cache_entry_t *entry = mem_pool_push_struct (math_cache.pool, struct math_cache_entry_t);
+    entry->is_display_mode = is_display_mode;
+    entry->is_used = true;
+    entry->expression_len = len;
+    entry->expression = pom_strndup (math_cache.pool, expression, len);
+    entry->html_len = html_len;
+    entry->html = pom_strndup (math_cache.pool, html, html_len);
+
+    math_cache_insert (&math_cache, key, entry);
+    math_cache_changed = true;
+    pthread_mutex_unlock (&math_cache_lock);
+}
+
+void math_cache_header (string_t *str)
+{
+    uint64_t katex_hash = BUILD_HASH_INIT;
+#if !defined(NO_JS) && defined(KATEX_BYTECODE)
+    katex_hash = build_hash (katex_hash, (void*)katex_bytecode, KATEX_BYTECODE_LEN);
+#else
+    struct stat st = {0};
+    stat (KATEX_PATH, &st);
+    katex_hash = build_hash (katex_hash, &st.st_size, sizeof(st.st_size));
+    katex_hash = build_hash (katex_hash, &st.st_mtime, sizeof(st.st_mtime));
+#endif
+
+    str_cat_printf (str, MATH_CACHE_HEADER " %016" PRIx64 "\n", katex_hash);
+}
+
+// After the header, each entry is
+//
+//   <i|d> <expression length> <html length>\n<expression><html>\n
+//
+// lengths are used instead of separators because neither the expression nor
+// the HTML are restricted in what characters they can contain.
+void math_cache_load (char *path)
+{
+    math_cache_path = path;
+    mem_pool_variable_ensure ((&math_cache));
+
+    if (!path_exists (path)) return;
+
+    uint64_t len = 0;
+    char *data = full_file_read (math_cache.pool, path, &len);
+    if (data == NULL) return;
+
+    string_t header = {0};
+    math_cache_header (&header);
+
+    if (len >= str_len(&header) && strncmp (data, str_data(&header), str_len(&header)) == 0) {
+        char *pos = data + str_len(&header);
+        char *end = data + len;
+        while (pos < end) {
+            char *record_start = pos;
+            bool is_display_mode = (*pos == 'd');
+
+            char *lengths_end;
+            uint64_t expression_len = strtoull (pos + 1, &lengths_end, 10);
+            uint64_t html_len = strtoull (lengths_end, &lengths_end, 10);
+            if (*lengths_end != '\n' || (*record_start != 'i' && *record_start != 'd') ||
+                (uint64_t)(end - lengths_end) < expression_len + html_len + 2) {
+                break;
+            }
+            pos = lengths_end + 1;
+
+            struct math_cache_entry_t *entry = mem_pool_push_struct (math_cache.pool, struct math_cache_entry_t);
+            entry->is_display_mode = is_display_mode;
+            entry->expression_len = expression_len;
+            entry->expression = pos;
+            pos += expression_len;
+            entry->html_len = html_len;
+            entry->html = pos;
+            pos += html_len;
+            pos++; // Skip record separator
+
+            math_cache_insert (&math_cache, math_cache_key (is_display_mode, expression_len, entry->expression), entry);
+        }
+    }
+
+    str_free (&header);
+}
+
+// The cache can get big, it's written through a buffered stream because
+// appending to a string_t reallocates it for every entry.
+//
+// If drop_unused is true, entries that weren't used in this run are removed.
+// Only runs that rendered all notes should pass true, otherwise we would drop
+// expressions of notes that weren't rendered.
+void math_cache_write (bool drop_unused)
+{
+    if (math_cache_path == NULL) return;
+
+    bool has_unused = false;
+    if (drop_unused) {
+        BINARY_TREE_FOR (math_cache, &math_cache, curr_node) {
+            if (!curr_node->value->is_used) has_unused = true;
+        }
+    }
+
+    if (!math_cache_changed && !has_unused) return;
+
+    struct file_replace_t fr;
+    FILE *f = file_replace_begin (&fr, math_cache_path);
+    if (f != NULL) {
+        string_t header = {0};
+        math_cache_header (&header);
+        fwrite (str_data(&header), 1, str_len(&header), f);
+        str_free (&header);
+
+        BINARY_TREE_FOR (math_cache, &math_cache, curr_node) {
+            struct math_cache_entry_t *entry = curr_node->value;
+            if (drop_unused && !entry->is_used) continue;
+
+            fprintf (f, "%c %" PRIu32 " %" PRIu32 "\n", entry->is_display_mode ? 'd' : 'i', entry->expression_len, entry->html_len);
+            fwrite (entry->expression, 1, entry->expression_len, f);
+            fwrite (entry->html, 1, entry->html_len, f);
+            fputc ('\n', f);
+        }
+
+        file_replace_end (&fr);
+    }
+}
+
 #ifndef NO_JS
 #include "lib/duk_config.h"
 #include "lib/duktape.h"
@@ -15,49 +212,159 @@ static void duktape_custom_fatal_handler(void *udata, const char *msg) {
     abort();
 }
 
-duk_context *katex_ctx = NULL;
+// Duktape heaps can only be used by one thread at a time. Each thread
+// rendering math takes a heap with KaTeX already loaded from a shared pool and
+// returns it when done, so there are never more heaps than threads rendering
+// math concurrently. The KaTeX source is read once and shared by all heaps,
+// or if weaver was built with KATEX_BYTECODE, heaps load the embedded
+// bytecode instead, which skips parsing and compiling it.
+//
+// After KaTeX is loaded, the bottom of a heap's value stack holds the katex
+// object, its renderToString() function and the options objects for each
+// mode. Each expression is then a call to the compiled function with the
+// expression as string argument, so there's no javascript code to escape or
+// compile.
+// :katex_heap_pool
+#define KATEX_OBJECT_IDX 0
+#define KATEX_RENDER_IDX 1
+#define KATEX_INLINE_OPTIONS_IDX 2
+#define KATEX_DISPLAY_OPTIONS_IDX 3
+
+struct katex_heap_t {
+    duk_context *ctx;
+
+    // Link in katex_all_heaps, which owns the heaps, and in katex_free_heaps
+    // while the heap isn't being used.
+    struct katex_heap_t *all_next;
+    struct katex_heap_t *free_next;
+};
+
+pthread_mutex_t katex_heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+struct katex_heap_t *katex_free_heaps = NULL;
+struct katex_heap_t *katex_all_heaps = NULL;
+char *katex_code = NULL;
+
+// Must be called with katex_heaps_lock held, evaluation of KaTeX's code
+// happens outside of it.
+struct katex_heap_t* katex_heap_new ()
+{
+#ifndef KATEX_BYTECODE
+    if (katex_code == NULL) {
+        katex_code = full_file_read (NULL, KATEX_PATH, NULL);
+    }
+#endif
+
+    struct katex_heap_t *heap = malloc (sizeof(struct katex_heap_t));
+    void *my_udata = (void *) 0xc0ffee;
+    heap->ctx = duk_create_heap(NULL, NULL, NULL, my_udata, duktape_custom_fatal_handler);
+    heap->all_next = katex_all_heaps;
+    heap->free_next = NULL;
+    katex_all_heaps = heap;
+
+    return heap;
+}
+
+void katex_heap_init (struct katex_heap_t *heap)
+{
+    duk_context *ctx = heap->ctx;
+
+#ifdef KATEX_BYTECODE
+    // :katex_bytecode
+    duk_push_external_buffer (ctx);
+    duk_config_buffer (ctx, -1, (void*)katex_bytecode, KATEX_BYTECODE_LEN);
+    duk_load_function (ctx);
+    duk_call (ctx, 0);
+    duk_pop (ctx);
+#else
+    duk_eval_string_noresult(ctx, katex_code);
+#endif
+
+    duk_get_global_string (ctx, "katex");
+    duk_get_prop_string (ctx, KATEX_OBJECT_IDX, "renderToString");
+
+    duk_push_object (ctx);
+    duk_push_false (ctx);
+    duk_put_prop_string (ctx, -2, "throwOnError");
+    duk_push_false (ctx);
+    duk_put_prop_string (ctx, -2, "displayMode");
+
+    duk_push_object (ctx);
+    duk_push_false (ctx);
+    duk_put_prop_string (ctx, -2, "throwOnError");
+    duk_push_true (ctx);
+    duk_put_prop_string (ctx, -2, "displayMode");
+}
+
+struct katex_heap_t* katex_heap_acquire ()
+{
+    struct katex_heap_t *heap = NULL;
+    bool is_new = false;
+
+    pthread_mutex_lock (&katex_heaps_lock);
+    if (katex_free_heaps != NULL) {
+        heap = katex_free_heaps;
+        katex_free_heaps = heap->free_next;
+    } else {
+        heap = katex_heap_new ();
+        is_new = true;
+    }
+    pthread_mutex_unlock (&katex_heaps_lock);
+
+    if (is_new) {
+        katex_heap_init (heap);
+    }
+
+    return heap;
+}
+
+void katex_heap_release (struct katex_heap_t *heap)
+{
+    pthread_mutex_lock (&katex_heaps_lock);
+    heap->free_next = katex_free_heaps;
+    katex_free_heaps = heap;
+    pthread_mutex_unlock (&katex_heaps_lock);
+}
 
 void str_cat_math_strn (string_t *str, bool is_display_mode, int len, char *expression)
 {
-    mem_pool_t pool = {0};
-    string_t buff = {0};
-    strn_set (&buff, expression, len);
-
-    // Double escape backslashes.
-    str_replace (&buff, "\\", "\\\\", NULL);
-
-    // Escape the string literal terminator we're using to built the javascript
-    // code. Needs to happen _after_ backlash escape because it's not LaTeX but
-    // Javascript.
-    str_replace (&buff, "\"", "\\\"", NULL);
-
-    str_set_printf (&buff, "\nkatex.renderToString(\"%.*s\", {throwOnError: false, displayMode: %s});", str_len(&buff), str_data(&buff), is_display_mode ? "true" : "false");
-
-    if (katex_ctx == NULL) {
-        // TODO: Put this in an embedded resource so we don't depend on the location
-        // from which the executable is run.
-        // :remove_relative_paths
-        char *code = full_file_read (&pool, "static/lib/katex/katex.min.js", NULL);
-        void *my_udata = (void *) 0xc0ffee;
-        katex_ctx = duk_create_heap(NULL, NULL, NULL, my_udata, duktape_custom_fatal_handler);
-        duk_eval_string_noresult(katex_ctx, code);
+    uint64_t key = math_cache_key (is_display_mode, len, expression);
+    struct math_cache_entry_t *entry = math_cache_find (key, is_display_mode, len, expression);
+    if (entry != NULL) {
+        strn_cat_c (str, entry->html, entry->html_len);
+        return;
     }
 
-    duk_push_string(katex_ctx, str_data(&buff));
-    duk_push_string(katex_ctx, "katex");
-    duk_compile(katex_ctx, 0);
-    duk_call(katex_ctx, 0);
+    struct katex_heap_t *heap = katex_heap_acquire ();
+    duk_context *ctx = heap->ctx;
+
+    duk_dup (ctx, KATEX_RENDER_IDX);
+    duk_dup (ctx, KATEX_OBJECT_IDX);
+    duk_push_lstring (ctx, expression, len);
+    duk_dup (ctx, is_display_mode ? KATEX_DISPLAY_OPTIONS_IDX : KATEX_INLINE_OPTIONS_IDX);
+    duk_call_method (ctx, 2);
 
-    char *html_expression = (char*) duk_get_string(katex_ctx, -1);
-    str_cat_c (str, html_expression);
+    duk_size_t html_len;
+    const char *html_expression = duk_get_lstring(ctx, -1, &html_len);
+    strn_cat_c (str, html_expression, html_len);
+    math_cache_put (key, is_display_mode, len, expression, html_len, html_expression);
 
-    str_free (&buff);
-    mem_pool_destroy (&pool);
+    duk_pop (ctx);
+    katex_heap_release (heap);
 }
 
 void js_destroy ()
 {
-    duk_destroy_heap(katex_ctx);
+    while (katex_all_heaps != NULL) {
+        struct katex_heap_t *heap = katex_all_heaps;
+        katex_all_heaps = heap->all_next;
+
+        duk_destroy_heap(heap->ctx);
+        free (heap);
+    }
+    katex_free_heaps = NULL;
+
+    free (katex_code);
+    katex_code = NULL;
 }
 
 #else
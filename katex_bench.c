@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include "common.h"
+#include "binary_tree.c"
+#include "cli_parser.c"
+#include "lib/duk_config.h"
+#include "lib/duktape.h"
+
+#include <time.h>
+
+// Measures the startup cost of a KaTeX heap when evaluating katex.min.js from
+// source, and when loading the bytecode katex_dump embeds into weaver. Each
+// iteration creates a heap, loads KaTeX and renders a single expression,
+// which is what a run with one math tag does.
+// :katex_bytecode
+
+double wall_time_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+void render_expression (duk_context *ctx, string_t *html)
+{
+    duk_eval_string (ctx, "katex.renderToString(\"e^{\\\\pi i} = -1\", {throwOnError: false});");
+    str_set (html, duk_get_string (ctx, -1));
+    duk_pop (ctx);
+}
+
+int main (int argc, char **argv)
+{
+    char *katex_path = "static/lib/katex/katex.min.js";
+    char *path_str = get_cli_arg_opt ("--katex", argv, argc);
+    if (path_str != NULL) katex_path = path_str;
+
+    int iterations = 10;
+    char *iterations_str = get_cli_arg_opt ("--iterations", argv, argc);
+    if (iterations_str != NULL) iterations = atoi (iterations_str);
+
+    mem_pool_t pool = {0};
+    uint64_t code_len = 0;
+    char *code = full_file_read (&pool, katex_path, &code_len);
+    if (code == NULL) return 1;
+
+    // Get the bytecode the same way katex_dump does.
+    duk_context *dump_ctx = duk_create_heap_default ();
+    duk_push_string (dump_ctx, "katex.min.js");
+    duk_compile_lstring_filename (dump_ctx, 0, code, code_len);
+    duk_dump_function (dump_ctx);
+    duk_size_t bytecode_len;
+    void *bytecode = duk_get_buffer (dump_ctx, -1, &bytecode_len);
+
+    string_t source_html = {0};
+    double start = wall_time_ms ();
+    for (int i=0; i<iterations; i++) {
+        duk_context *ctx = duk_create_heap_default ();
+        duk_eval_lstring_noresult (ctx, code, code_len);
+        render_expression (ctx, &source_html);
+        duk_destroy_heap (ctx);
+    }
+    double source_time = (wall_time_ms () - start)/iterations;
+
+    string_t bytecode_html = {0};
+    start = wall_time_ms ();
+    for (int i=0; i<iterations; i++) {
+        duk_context *ctx = duk_create_heap_default ();
+        duk_push_external_buffer (ctx);
+        duk_config_buffer (ctx, -1, bytecode, bytecode_len);
+        duk_load_function (ctx);
+        duk_call (ctx, 0);
+        duk_pop (ctx);
+        render_expression (ctx, &bytecode_html);
+        duk_destroy_heap (ctx);
+    }
+    double bytecode_time = (wall_time_ms () - start)/iterations;
+
+    bool success = strcmp (str_data(&source_html), str_data(&bytecode_html)) == 0;
+
+    printf ("source:   %.2f ms/heap (%" PRIu64 " bytes)\n", source_time, code_len);
+    printf ("bytecode: %.2f ms/heap (%" PRIu64 " bytes)\n", bytecode_time, (uint64_t)bytecode_len);
+    printf ("output %s\n", success ? "OK" : "FAILED");
+
+    str_free (&source_html);
+    str_free (&bytecode_html);
+    duk_destroy_heap (dump_ctx);
+    mem_pool_destroy (&pool);
+
+    return success ? 0 : 1;
+}
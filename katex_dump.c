@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+
+#include "common.h"
+#include "lib/duk_config.h"
+#include "lib/duktape.h"
+
+// Build step that compiles KaTeX's source and writes its Duktape bytecode as a
+// C header. When weaver is built with -DKATEX_BYTECODE="<header path>", js.c
+// embeds it and creates KaTeX heaps with duk_load_function(), skipping the
+// parse and compilation of katex.min.js every time a heap is created (see
+// weaver_build() in pymk.py).
+//
+// What gets dumped is the compiled program, not the state after running it.
+// Duktape can't serialize a heap, so loading still executes KaTeX's top level
+// code, only parsing and compiling are saved.
+// :katex_bytecode
+
+int main (int argc, char **argv)
+{
+    if (argc != 3) {
+        printf ("usage: %s KATEX_SOURCE OUTPUT_HEADER\n", argv[0]);
+        return 1;
+    }
+
+    int retval = 0;
+    mem_pool_t pool = {0};
+
+    uint64_t code_len = 0;
+    char *code = full_file_read (&pool, argv[1], &code_len);
+    if (code == NULL) {
+        retval = 1;
+
+    } else {
+        duk_context *ctx = duk_create_heap_default ();
+
+        duk_push_string (ctx, path_basename (argv[1]));
+        if (duk_pcompile_lstring_filename (ctx, 0, code, code_len) != 0) {
+            printf (ECMA_RED("error:") " could not compile '%s': %s\n", argv[1], duk_safe_to_string (ctx, -1));
+            retval = 1;
+
+        } else {
+            duk_dump_function (ctx);
+
+            duk_size_t bytecode_len;
+            unsigned char *bytecode = duk_get_buffer (ctx, -1, &bytecode_len);
+
+            // Bytes are written as a string literal instead of an array
+            // initializer, compilers handle big literals a lot faster.
+            string_t header = {0};
+            str_cat_printf (&header, "// Generated by katex_dump from %s, do not edit.\n", argv[1]);
+            str_cat_printf (&header, "#define KATEX_BYTECODE_LEN %" PRIu64 "\n", (uint64_t)bytecode_len);
+            str_cat_c (&header, "static const char katex_bytecode[] =\n\"");
+
+            char *out = malloc (bytecode_len*4 + bytecode_len/32*4 + 1);
+            char *pos = out;
+            for (duk_size_t i=0; i<bytecode_len; i++) {
+                if (i > 0 && i%32 == 0) {
+                    pos += sprintf (pos, "\"\n\"");
+                }
+                pos += sprintf (pos, "\\%03o", bytecode[i]);
+            }
+            strn_cat_c (&header, out, pos - out);
+            free (out);
+
+            str_cat_c (&header, "\";\n");
+
+            if (full_file_write (str_data(&header), str_len(&header), argv[2])) {
+                retval = 1;
+            }
+            str_free (&header);
+        }
+
+        duk_destroy_heap (ctx);
+    }
+
+    mem_pool_destroy (&pool);
+    return retval;
+}
@@ -18,6 +18,7 @@ struct note_runtime_t* rt_get ()
 void rt_destroy (struct note_runtime_t *rt)
 {
     mem_pool_destroy (&rt->pool);
+    mem_pool_destroy (&rt->sources_pool);
 }
 
 struct note_t* rt_new_note (struct note_runtime_t *rt, char *id, size_t id_len)
@@ -106,6 +107,434 @@ void rt_process_note (mem_pool_t *pool_out, struct file_vault_t *vlt, struct spl
     }
 }
 
+// Build cache
+//
+// Each note gets a build key that hashes everything its HTML is derived from:
+// its source, the SPLX data of its blocks (which other notes can add to, like
+// backlinks) and the data of everything it looked up outside of itself while
+// being rendered. These lookups are recorded as build deps (see
+// note_add_build_dep()), for each one we hash what could change how it's
+// rendered. On top of that, all keys are salted with state global to a run
+// (see rt_build_salt()).
+//
+// The cache stores each note's key and deps. In the next run we evaluate the
+// cached deps against the new data, if the resulting key matches the stored
+// one, the note's HTML from the previous run is still valid and we skip
+// generating it. Changing a note only invalidates notes that depend on what
+// changed, instead of all of them.
+// :build_cache
+
+uint64_t build_hash_attribute (uint64_t hash, struct splx_node_t *node, char *attr)
+{
+    struct splx_node_list_t *values = splx_node_get_attributes (node, attr);
+    LINKED_LIST_FOR (struct splx_node_list_t *, curr_value, values) {
+        hash = build_hash_str (hash, str_data(&curr_value->node->str));
+    }
+    hash = build_hash_str (hash, "");
+
+    return hash;
+}
+
+uint64_t build_hash_attributes (uint64_t hash, struct splx_node_t *node)
+{
+    hash = build_hash_str (hash, str_data(&node->str));
+    BINARY_TREE_FOR (cstr_to_splx_node_list_map, &node->attributes, curr_attribute) {
+        hash = build_hash_str (hash, curr_attribute->key);
+        LINKED_LIST_FOR (struct splx_node_list_t *, curr_value, curr_attribute->value) {
+            hash = build_hash_str (hash, str_data(&curr_value->node->str));
+        }
+    }
+    hash = build_hash_str (hash, "");
+
+    return hash;
+}
+
+// Data of an entity that shows up when linking to it. It's also what decides
+// if the link is redacted in public builds, private types are part of the
+// salt.
+uint64_t build_hash_entity (uint64_t hash, struct splx_node_t *entity)
+{
+    bool is_found = entity != NULL;
+    hash = build_hash (hash, &is_found, sizeof(is_found));
+
+    if (is_found) {
+        hash = build_hash_str (hash, str_data(&entity->str));
+        hash = build_hash_attribute (hash, entity, "name");
+        hash = build_hash_attribute (hash, entity, "a");
+        hash = build_hash_attribute (hash, entity, "t:virtual_id");
+        hash = build_hash_attribute (hash, entity, "url");
+    }
+
+    return hash;
+}
+
+uint64_t build_hash_block_data (uint64_t hash, struct splx_node_t *data)
+{
+    hash = build_hash_attributes (hash, data);
+
+    // Backlinks are rendered with the name of the source and only if the note
+    // it comes from is visible.
+    struct splx_node_list_t *backlinks = splx_node_get_attributes (data, "backlink");
+    LINKED_LIST_FOR (struct splx_node_list_t *, curr_backlink, backlinks) {
+        struct splx_node_t *source = curr_backlink->node;
+        hash = build_hash_attribute (hash, source, "name");
+
+        struct note_t *note = rt_get_note_by_id (str_data(splx_node_get_id(source)));
+        bool is_visible = note != NULL && note->tree != NULL && note_is_visible (note);
+        hash = build_hash (hash, &is_visible, sizeof(is_visible));
+    }
+
+    return hash;
+}
+
+// Returns false if the note depends on something that can't be hashed, then
+// it has to be rendered every time.
+bool rt_note_build_key (struct note_runtime_t *rt, struct note_t *note,
+                        struct build_dep_t *deps, int deps_len, uint64_t *key)
+{
+    uint64_t hash = build_hash (rt->build_salt, &note->source_hash, sizeof(note->source_hash));
+
+    // Replayed notes don't have a full block tree, their data nodes are the
+    // ones in block ops.
+    for (int i=0; i<note->data_ops_len; i++) {
+        struct note_data_op_t *op = &note->data_ops[i];
+        if (op->type == NOTE_DATA_OP_BLOCK && op->node != NULL) {
+            hash = build_hash_block_data (hash, op->node);
+        }
+    }
+
+    bool is_cacheable = true;
+    for (int i=0; i<deps_len; i++) {
+        struct build_dep_t *dep = &deps[i];
+        hash = build_hash (hash, &dep->type, sizeof(dep->type));
+        hash = build_hash_str (hash, dep->name);
+        hash = build_hash_str (hash, dep->value);
+
+        if (dep->type == BUILD_DEP_REFERENCE) {
+            hash = build_hash_entity (hash, psx_link_target (rt, dep->name, dep->value));
+
+        } else if (dep->type == BUILD_DEP_SUMMARY) {
+            string_t title = {0};
+            str_set_view (&title, dep->value, strlen(dep->value));
+
+            struct note_t *target = rt_get_note_by_title (&title);
+            bool is_found = target != NULL;
+            hash = build_hash (hash, &is_found, sizeof(is_found));
+            if (is_found) {
+                hash = build_hash_str (hash, target->id);
+                hash = build_hash (hash, &target->source_hash, sizeof(target->source_hash));
+            }
+
+        } else if (dep->type == BUILD_DEP_LATE_TAG) {
+            if (!psx_late_tag_build_hash (rt, dep->name, dep->value, &hash)) {
+                is_cacheable = false;
+            }
+        }
+    }
+
+    *key = hash;
+    return is_cacheable;
+}
+
+// Hashes state that affects the output of all notes. Changing any of it
+// invalidates the whole cache.
+void rt_build_salt (struct note_runtime_t *rt, char *target_path)
+{
+    uint64_t salt = BUILD_HASH_INIT;
+
+    // Changes to weaver itself may change the generated HTML.
+    salt = build_hash_str (salt, __DATE__ " " __TIME__);
+
+    salt = build_hash_str (salt, target_path);
+    salt = build_hash (salt, &rt->is_public, sizeof(rt->is_public));
+    salt = build_hash (salt, &rt->minify_html, sizeof(rt->minify_html));
+    for (int i=0; i<rt->private_types_len; i++) {
+        salt = build_hash_str (salt, rt->private_types[i]);
+    }
+
+    // Referenced files are rendered as links to their path.
+    BINARY_TREE_FOR (id_to_vlt_file, &rt->vlt.files, curr_node) {
+        LINKED_LIST_FOR (struct vlt_file_t*, curr_file, curr_node->value) {
+            salt = build_hash_str (salt, str_data(&curr_file->path));
+        }
+    }
+
+    rt->build_salt = salt;
+}
+
+// Notes whose source didn't change since the last run replay the SPLX data
+// writes stored in the cache, instead of being parsed.
+void rt_mark_replayed_notes (struct note_runtime_t *rt)
+{
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        curr_note->source_hash = build_hash (BUILD_HASH_INIT, str_data(&curr_note->psplx), str_len(&curr_note->psplx));
+
+        struct build_cache_entry_t entry = {0};
+        if (!curr_note->error &&
+            build_cache_maybe_get (rt->build_cache, curr_note->id, &entry) &&
+            entry.source_hash == curr_note->source_hash && entry.data_ops_len > 0)
+        {
+            curr_note->is_replayed = true;
+            for (int i=0; i<entry.data_ops_len; i++) {
+                DYNAMIC_ARRAY_APPEND (curr_note->data_ops, entry.data_ops[i]);
+            }
+        }
+    }
+}
+
+// Applies the data ops of a replayed note that happened in the given phase.
+// Each phase replays in note order, so the SPLX data ends up the same as if
+// all notes had been parsed.
+void rt_replay_data_ops (struct psx_parser_ctx_t *ctx, enum note_phase_t phase)
+{
+    struct note_runtime_t *rt = ctx->rt;
+    struct note_t *note = ctx->note;
+
+    for (int i=0; i<note->data_ops_len; i++) {
+        struct note_data_op_t *op = &note->data_ops[i];
+        if (op->phase != phase) continue;
+
+        if (op->type == NOTE_DATA_OP_BLOCK) {
+            struct splx_node_t *parent_entity = op->has_parent ? note->tree->data : NULL;
+            op->node = psx_block_data_add (ctx, op->args[0], op->args[1], op->args[2], parent_entity);
+            op->is_private = psx_block_data_is_private (op->node);
+
+            // The first block op is always the one of the note's root block.
+            // Only the root is needed for notes that aren't rendered.
+            if (note->tree == NULL) {
+                note->tree = psx_block_new (&rt->block_allocation);
+                note->tree->type = BLOCK_TYPE_ROOT;
+                note->tree->data = op->node;
+                note->tree->is_private = op->is_private;
+            }
+
+        } else if (op->type == NOTE_DATA_OP_LINK) {
+            string_t type = {0};
+            string_t name = {0};
+            str_set_view (&type, op->args[0], strlen(op->args[0]));
+            str_set_view (&name, op->args[1], strlen(op->args[1]));
+            psx_create_link (&rt->sd, note->tree->data, note->id, &type, &name);
+
+        } else if (op->type == NOTE_DATA_OP_SUMMARY) {
+            // Same check as summary_tag_handler(). If it fails now the note
+            // gets an error when parsed again, its summary dep changed.
+            string_t title = {0};
+            str_set_view (&title, op->args[0], strlen(op->args[0]));
+
+            struct note_t *target = rt_get_note_by_title (&title);
+            if (target != NULL && psx_note_summary (target) != NULL) {
+                rt_link_entities_by_id (note->id, target->id, NULL, NULL);
+            }
+        }
+    }
+}
+
+// The deps of a note are only known after generating its HTML. Here we still
+// don't have them, we check the ones stored in the cache.
+void rt_mark_up_to_date_notes (struct note_runtime_t *rt)
+{
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        if (curr_note->error || curr_note->tree == NULL || str_len(&curr_note->error_msg) > 0) continue;
+
+        struct build_cache_entry_t entry = {0};
+        if (build_cache_maybe_get (rt->build_cache, curr_note->id, &entry) && entry.source_hash == curr_note->source_hash) {
+            uint64_t key;
+            if (rt_note_build_key (rt, curr_note, entry.deps, entry.deps_len, &key) && key == entry.key) {
+                curr_note->build_key = key;
+                curr_note->is_up_to_date = true;
+                curr_note->is_cacheable = true;
+            }
+        }
+    }
+}
+
+// Replayed notes that have to be rendered still need their block tree. They
+// go through all phases again, but because they are marked as replayed they
+// take the data nodes from their block ops and don't write into the SPLX
+// data.
+void rt_parse_replayed_notes (struct note_runtime_t *rt, struct psx_parser_ctx_t *ctx)
+{
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        if (!curr_note->is_replayed || curr_note->is_up_to_date) continue;
+
+        struct note_t *note = curr_note;
+        ctx->note = curr_note;
+        ctx->id = curr_note->id;
+        ctx->path = str_data(&curr_note->path);
+        ctx->error_msg = &curr_note->error_msg;
+
+        mem_pool_t *pool_l = &rt->pool;
+        char *markup = str_data(&curr_note->psplx);
+        struct block_allocation_t *ba = &rt->block_allocation;
+
+        note->next_block_op = 0;
+        PROCESS_NOTE_PARSE
+        PROCESS_NOTE_CREATE_LINKS
+        PROCESS_NOTE_USER_CALLBACKS
+    }
+}
+
+// Called after generating HTML, when the deps of rendered notes are known.
+void rt_update_build_keys (struct note_runtime_t *rt)
+{
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        if (curr_note->error || curr_note->tree == NULL || curr_note->is_up_to_date) continue;
+
+        curr_note->is_cacheable =
+            rt_note_build_key (rt, curr_note, curr_note->build_deps, curr_note->build_deps_len, &curr_note->build_key);
+    }
+}
+
+// Parallel note processing
+//
+// Only HTML generation runs in parallel. The parse, link creation and user
+// callback phases write into the shared SPLX data in an order dependent way
+// (virtual IDs, link and backlink order, statement nodes), making them
+// parallel while keeping the output byte-identical would mean buffering
+// basically all of their side effects.
+//
+// HTML generation mostly reads shared state. The few writes it does are
+// buffered per note and merged back in note order after all workers finish
+// (see rt_add_used_file_id() and rt_queue_late_callback()).
+// :parallel_note_processing
+
+#define RT_NOTE_JOB_CB(name) void name(struct psx_parser_ctx_t *ctx, struct note_t *note)
+typedef RT_NOTE_JOB_CB(rt_note_job_cb_t);
+
+struct rt_notes_job_t {
+    struct psx_parser_ctx_t *ctx;
+    rt_note_job_cb_t *cb;
+
+    struct note_t **notes;
+    int notes_len;
+
+    int next_note;
+};
+
+void* rt_notes_worker (void *data)
+{
+    struct rt_notes_job_t *job = (struct rt_notes_job_t*)data;
+
+    STACK_ALLOCATE (struct psx_parser_ctx_t, ctx);
+    *ctx = *job->ctx;
+
+    int note_idx;
+    while ((note_idx = __atomic_fetch_add (&job->next_note, 1, __ATOMIC_RELAXED)) < job->notes_len) {
+        struct note_t *note = job->notes[note_idx];
+
+        ctx->note = note;
+        ctx->id = note->id;
+        ctx->path = str_data(&note->path);
+        ctx->error_msg = &note->error_msg;
+
+        job->cb (ctx, note);
+    }
+
+    return NULL;
+}
+
+// Calls cb for each one of the notes from rt->jobs threads, in no particular
+// order. The calling thread is one of them, so only jobs-1 threads are
+// created. If we can't create a thread, the ones we have will take its share.
+void rt_for_notes_parallel (struct note_runtime_t *rt, struct note_t **notes, int notes_len, struct psx_parser_ctx_t *ctx, rt_note_job_cb_t *cb)
+{
+    struct rt_notes_job_t job = {0};
+    job.ctx = ctx;
+    job.cb = cb;
+    job.notes = notes;
+    job.notes_len = notes_len;
+
+    int num_threads = MIN(rt->jobs, notes_len) - 1;
+    pthread_t *threads = malloc (MAX(num_threads, 1)*sizeof(pthread_t));
+
+    int num_started = 0;
+    for (int i=0; i<num_threads; i++) {
+        if (pthread_create (&threads[num_started], NULL, rt_notes_worker, &job) == 0) {
+            num_started++;
+        }
+    }
+
+    rt_notes_worker (&job);
+
+    for (int i=0; i<num_started; i++) {
+        pthread_join (threads[i], NULL);
+    }
+
+    free (threads);
+}
+
+struct note_t** rt_notes_array (mem_pool_t *pool, struct note_runtime_t *rt)
+{
+    struct note_t **notes = mem_pool_push_array (pool, rt->notes_len, struct note_t*);
+
+    int i = 0;
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        notes[i++] = curr_note;
+    }
+
+    return notes;
+}
+
+RT_NOTE_JOB_CB (rt_generate_html_cb)
+{
+    if (note->is_up_to_date) return;
+
+    PROCESS_NOTE_GENERATE_HTML
+}
+
+void rt_generate_html_parallel (struct note_runtime_t *rt, struct psx_parser_ctx_t *ctx)
+{
+    mem_pool_t pool = {0};
+    struct note_t **notes = rt_notes_array (&pool, rt);
+
+    rt->is_parallel_phase = true;
+    rt_for_notes_parallel (rt, notes, rt->notes_len, ctx, rt_generate_html_cb);
+    rt->is_parallel_phase = false;
+
+    // Merge buffered writes in note order.
+    for (int i=0; i<rt->notes_len; i++) {
+        struct note_t *note = notes[i];
+
+        for (int j=0; j<note->used_file_ids_len; j++) {
+            DYNAMIC_ARRAY_APPEND (rt->used_file_ids, note->used_file_ids[j]);
+        }
+        free (note->used_file_ids);
+        note->used_file_ids = NULL;
+        note->used_file_ids_len = 0;
+        note->used_file_ids_size = 0;
+
+        if (note->invocations != NULL) {
+            LINKED_LIST_APPEND (rt->invocations, note->invocations);
+            rt->invocations_end = note->invocations_end;
+            note->invocations = NULL;
+            note->invocations_end = NULL;
+        }
+    }
+
+    mem_pool_destroy (&pool);
+}
+
+// Math is rendered by a user callback, which runs sequentially. When running
+// with multiple jobs, all math found in note trees is rendered in parallel
+// beforehand, then the callbacks find the HTML in the math cache.
+// :katex_heap_pool
+RT_NOTE_JOB_CB (rt_prerender_math_cb)
+{
+    if (note->error || note->tree == NULL) return;
+
+    psx_block_tree_prerender_math (ctx, note->tree);
+}
+
+void rt_prerender_math (struct note_runtime_t *rt, struct psx_parser_ctx_t *ctx)
+{
+    mem_pool_t pool = {0};
+    struct note_t **notes = rt_notes_array (&pool, rt);
+
+    rt_for_notes_parallel (rt, notes, rt->notes_len, ctx, rt_prerender_math_cb);
+
+    mem_pool_destroy (&pool);
+}
+
 void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
 {
     STACK_ALLOCATE (struct psx_parser_ctx_t, ctx);
@@ -114,6 +543,12 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
     ctx->sd = &rt->sd;
 
 
+    // :build_cache
+    if (rt->build_cache != NULL) {
+        rt_mark_replayed_notes (rt);
+    }
+
+    rt->phase = NOTE_PHASE_PARSE;
     {
         LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
             struct note_t *note = curr_note;
@@ -124,6 +559,11 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
 
             //printf ("%s\n", str_data(&curr_note->path));
 
+            if (note->is_replayed) {
+                rt_replay_data_ops (ctx, rt->phase);
+                continue;
+            }
+
             mem_pool_t *pool_l = &rt->pool;
             char *markup = str_data(&curr_note->psplx);
 
@@ -131,6 +571,7 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
         }
     }
 
+    rt->phase = NOTE_PHASE_CREATE_LINKS;
     {
         LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
             struct note_t *note = curr_note;
@@ -139,10 +580,24 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
             ctx->path = str_data(&curr_note->path);
             ctx->error_msg = &curr_note->error_msg;
 
+            if (note->is_replayed) {
+                rt_replay_data_ops (ctx, rt->phase);
+                continue;
+            }
+
+            struct block_allocation_t *ba = &rt->block_allocation;
+
             PROCESS_NOTE_CREATE_LINKS
         }
     }
 
+#ifndef NO_JS
+    if (rt->jobs > 1 && rt->notes_len > 1) {
+        rt_prerender_math (rt, ctx);
+    }
+#endif
+
+    rt->phase = NOTE_PHASE_USER_CALLBACKS;
     {
         LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
             struct note_t *note = curr_note;
@@ -151,23 +606,46 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
             ctx->path = str_data(&curr_note->path);
             ctx->error_msg = &curr_note->error_msg;
 
+            if (note->is_replayed) {
+                rt_replay_data_ops (ctx, rt->phase);
+                continue;
+            }
+
             struct block_allocation_t *ba = &rt->block_allocation;
 
             PROCESS_NOTE_USER_CALLBACKS
         }
     }
 
+    if (rt->build_cache != NULL) {
+        rt_mark_up_to_date_notes (rt);
+        rt_parse_replayed_notes (rt, ctx);
+    }
+
     {
-        bool has_output = false;
-        LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
-            struct note_t *note = curr_note;
-            ctx->note = curr_note;
-            ctx->id = curr_note->id;
-            ctx->path = str_data(&curr_note->path);
-            ctx->error_msg = &curr_note->error_msg;
+        if (rt->jobs > 1 && rt->notes_len > 1) {
+            rt_generate_html_parallel (rt, ctx);
+
+        } else {
+            LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+                if (curr_note->is_up_to_date) continue;
+
+                struct note_t *note = curr_note;
+                ctx->note = curr_note;
+                ctx->id = curr_note->id;
+                ctx->path = str_data(&curr_note->path);
+                ctx->error_msg = &curr_note->error_msg;
 
-            PROCESS_NOTE_GENERATE_HTML
+                PROCESS_NOTE_GENERATE_HTML
+            }
+        }
+
+        if (rt->build_cache != NULL) {
+            rt_update_build_keys (rt);
+        }
 
+        bool has_output = false;
+        LINKED_LIST_FOR (struct note_t*, note, rt->notes) {
             if (error_msg_out != NULL && str_len(&note->error_msg) > 0) {
                 if (has_output) {
                     str_cat_c (error_msg_out, "\n");
@@ -183,7 +661,7 @@ void rt_process_notes (struct note_runtime_t *rt, string_t *error_msg_out)
 void rt_queue_late_callback (struct note_t *note, struct psx_tag_t *tag, struct html_element_t *html_placeholder, psx_late_user_tag_cb_t *cb)
 {
     struct note_runtime_t *rt = rt_get ();
-    struct late_cb_invocation_t *invocation = mem_pool_push_struct(&rt->pool, struct late_cb_invocation_t);
+    struct late_cb_invocation_t *invocation = mem_pool_push_struct(rt_note_pool(rt, note), struct late_cb_invocation_t);
     *invocation = ZERO_INIT(struct late_cb_invocation_t);
 
     invocation->note = note;
@@ -191,7 +669,49 @@ void rt_queue_late_callback (struct note_t *note, struct psx_tag_t *tag, struct
     invocation->html_placeholder = html_placeholder;
     invocation->cb = cb;
 
-    LINKED_LIST_APPEND(rt->invocations, invocation);
+    // :build_cache
+    string_t tag_name = {0};
+    str_set_sstr (&tag_name, &tag->token.value);
+    note_add_build_dep (note, BUILD_DEP_LATE_TAG, str_data(&tag_name), str_data(&tag->content));
+    str_free (&tag_name);
+
+    // :parallel_note_processing
+    if (rt->is_parallel_phase) {
+        LINKED_LIST_APPEND(note->invocations, invocation);
+    } else {
+        LINKED_LIST_APPEND(rt->invocations, invocation);
+    }
+}
+
+void rt_add_used_file_id (struct note_t *note, uint64_t id)
+{
+    struct note_runtime_t *rt = rt_get ();
+
+    // :parallel_note_processing
+    if (rt->is_parallel_phase && note != NULL) {
+        DYNAMIC_ARRAY_APPEND(note->used_file_ids, id);
+    } else {
+        DYNAMIC_ARRAY_APPEND(rt->used_file_ids, id);
+    }
+}
+
+// Pool for allocations that must live as long as the runtime but are done
+// while processing a note. The runtime's pool can't be used from multiple
+// threads, but the note's pool lives as long as the note, which is enough.
+mem_pool_t* rt_note_pool (struct note_runtime_t *rt, struct note_t *note)
+{
+    if (rt->is_parallel_phase && note != NULL) {
+        return &note->pool;
+    } else {
+        return &rt->pool;
+    }
+}
+
+// Indentation of all HTML we output, pretty printed unless --minify was passed.
+// :minify
+int rt_html_indent (struct note_runtime_t *rt)
+{
+    return (rt != NULL && rt->minify_html) ? HTML_MINIFY : 2;
 }
 
 // At the moment we just ensure the orphan list callbacks are invoked at last,
@@ -230,3 +750,76 @@ void rt_late_user_callbacks(struct note_runtime_t *rt)
             curr_invocation->html_placeholder);
     }
 }
+
+// JavaScript output
+//
+// The static site ships note data as JavaScript and JSON files, these write
+// strings into them.
+
+// Bit tricks to test 8 bytes at a time, from "Bit Twiddling Hacks". Testing for
+// bytes less than n is only exact for n <= 128.
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define swar_has_less(x,n) (((x) - SWAR_ONES*(n)) & ~(x) & SWAR_HIGHS)
+#define swar_has_byte(x,b) swar_has_less((x) ^ (SWAR_ONES*(uint8_t)(b)), 1)
+
+// Writes a string as a quoted JavaScript string literal. With '"' as quote
+// it's also a valid JSON string. Escapes the quote, backslashes, control
+// characters, and U+2028 and U+2029 which older JavaScript engines don't accept
+// inside string literals. Runs that don't need escaping are found 8 bytes at a
+// time and written with a single fwrite().
+void fwrite_js_string (FILE *f, char quote, const char *s, size_t len)
+{
+    fputc (quote, f);
+
+    size_t start = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i + 8 <= len) {
+            uint64_t x;
+            memcpy (&x, s + i, sizeof(x));
+            if (swar_has_less (x, 0x20) || swar_has_byte (x, '\\') ||
+                swar_has_byte (x, quote) || swar_has_byte (x, 0xE2)) {
+                break;
+            }
+            i += 8;
+        }
+        if (i >= len) break;
+
+        uint8_t c = s[i];
+        char escaped[8];
+        size_t escaped_src_len = 1;
+        if (c == quote || c == '\\') {
+            snprintf (escaped, sizeof(escaped), "\\%c", c);
+        } else if (c == '\n') {
+            strcpy (escaped, "\\n");
+        } else if (c == '\r') {
+            strcpy (escaped, "\\r");
+        } else if (c == '\t') {
+            strcpy (escaped, "\\t");
+        } else if (c < 0x20) {
+            snprintf (escaped, sizeof(escaped), "\\u%04x", c);
+        } else if (c == 0xE2 && i + 2 < len && (uint8_t)s[i+1] == 0x80 &&
+                   ((uint8_t)s[i+2] == 0xA8 || (uint8_t)s[i+2] == 0xA9)) {
+            snprintf (escaped, sizeof(escaped), "\\u%04x", (uint8_t)s[i+2] == 0xA8 ? 0x2028 : 0x2029);
+            escaped_src_len = 3;
+        } else {
+            i++;
+            continue;
+        }
+
+        fwrite (s + start, 1, i - start, f);
+        fputs (escaped, f);
+        i += escaped_src_len;
+        start = i;
+    }
+
+    fwrite (s + start, 1, len - start, f);
+    fputc (quote, f);
+}
+
+static inline
+void fwrite_js_string_c (FILE *f, char quote, const char *s)
+{
+    fwrite_js_string (f, quote, s, strlen(s));
+}
@@ -15,6 +15,98 @@ typedef PSX_LATE_USER_TAG_CB(psx_late_user_tag_cb_t);
 BINARY_TREE_NEW (psx_late_user_tag_cb, char*, psx_late_user_tag_cb_t*, strcmp(a, b));
 void psx_populate_internal_late_cb_tree (struct psx_late_user_tag_cb_t *tree);
 
+// :build_cache
+#define BUILD_HASH_INIT 0xcbf29ce484222325ULL
+
+// 64 bit FNV-1a
+uint64_t build_hash (uint64_t hash, void *data, size_t len)
+{
+    unsigned char *bytes = (unsigned char*)data;
+    for (size_t i=0; i<len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static inline
+uint64_t build_hash_str (uint64_t hash, char *str)
+{
+    // Include the null terminator so consecutive strings can't alias.
+    return build_hash (hash, str, strlen(str) + 1);
+}
+
+// Something outside of a note that its HTML depends on. They are recorded while
+// processing the note, and kept in the cache to check if the HTML is still
+// valid in the next run (see rt_note_build_key()).
+enum build_dep_type_t {
+    BUILD_DEP_REFERENCE, // Entity referenced by type and ID or name, like \note{Title}
+    BUILD_DEP_SUMMARY,   // Note summarized by title
+    BUILD_DEP_LATE_TAG,  // Tag handled by a late callback, like \entity_list{type}
+};
+
+struct build_dep_t {
+    enum build_dep_type_t type;
+
+    // Entity type for references, tag name for late tags, unused for
+    // summaries.
+    char *name;
+
+    // Reference, note title or tag content.
+    char *value;
+};
+
+// Phases of rt_process_notes() that write into the SPLX data.
+enum note_phase_t {
+    NOTE_PHASE_PARSE,
+    NOTE_PHASE_CREATE_LINKS,
+    NOTE_PHASE_USER_CALLBACKS,
+};
+
+// A write a note did into the SPLX data while being processed. The order of
+// these writes across notes decides the order of attributes and entities, so
+// notes whose source didn't change replay them in the same phase instead of
+// being parsed again (see rt_replay_data_ops()).
+enum note_data_op_type_t {
+    NOTE_DATA_OP_BLOCK,   // Data node of a block, see psx_block_data_add()
+    NOTE_DATA_OP_LINK,    // Link created from an inline tag, see psx_create_link()
+    NOTE_DATA_OP_SUMMARY, // Link to a note used in \summary
+};
+
+struct note_data_op_t {
+    enum note_data_op_type_t type;
+    enum note_phase_t phase;
+
+    // Block: ID of the node (NULL for anonymous nodes), types of its data tag
+    // separated by spaces and the tag's TSPLX content. Types and content are
+    // NULL if the block has no data tag.
+    // Link: type and reference of the target, as written in the tag.
+    // Summary: title of the summarized note.
+    char *args[3];
+    bool has_parent;
+
+    // Result of applying a block op, blocks of a replayed note that's parsed
+    // again use these instead of creating new ones.
+    struct splx_node_t *node;
+    bool is_private;
+};
+
+struct build_cache_entry_t {
+    uint64_t key;
+    uint64_t source_hash;
+
+    int deps_len;
+    struct build_dep_t *deps;
+
+    int data_ops_len;
+    struct note_data_op_t *data_ops;
+};
+BINARY_TREE_NEW (build_cache, char*, struct build_cache_entry_t, strcmp(a,b));
+
+uint64_t build_hash_attributes (uint64_t hash, struct splx_node_t *node);
+uint64_t build_hash_entity (uint64_t hash, struct splx_node_t *entity);
+
 struct late_cb_invocation_t {
     struct note_t *note;
     struct psx_tag_t *tag;
@@ -26,6 +118,11 @@ struct late_cb_invocation_t {
 
 struct note_runtime_t {
     mem_pool_t pool;
+
+    // Note sources, see rt_init_push_file(). Separate from pool so they can
+    // use large bins, they would leave most of a small bin unused.
+    mem_pool_t sources_pool;
+
     int notes_len;
     struct note_t *notes;
     struct splx_data_t *metadata;
@@ -34,6 +131,7 @@ struct note_runtime_t {
     char **title_note_ids;
 
     bool is_public;
+    bool minify_html;
     int private_types_len;
     char **private_types;
 
@@ -53,6 +151,18 @@ struct note_runtime_t {
     int next_virtual_id;
 
     string_t changes_log;
+
+    // Number of threads used by rt_process_notes(), values smaller than 2 mean
+    // all work happens in the calling thread.
+    int jobs;
+    bool is_parallel_phase;
+
+    // When set, notes whose build key matches the one in the cache aren't
+    // rendered again, their output from the last run is still valid.
+    // :build_cache
+    struct build_cache_t *build_cache;
+    uint64_t build_salt;
+    enum note_phase_t phase;
 } __g_note_runtime;
 
 struct note_t* rt_new_note (struct note_runtime_t *rt, char *id, size_t id_len);
@@ -62,6 +172,9 @@ struct note_t* rt_get_note_by_id (char *id);
 void rt_link_entities_by_id (char *src_id, char *tgt_id, char *text, char *section);
 void rt_link_entities (struct splx_node_t *src, struct splx_node_t *tgt, char *text, char *section);
 void rt_queue_late_callback (struct note_t *note, struct psx_tag_t *tag, struct html_element_t *html_placeholder, psx_late_user_tag_cb_t *cb);
+void rt_add_used_file_id (struct note_t *note, uint64_t id);
+mem_pool_t* rt_note_pool (struct note_runtime_t *rt, struct note_t *note);
+int rt_html_indent (struct note_runtime_t *rt);
 
 #define CFG_TARGET_DIR "target-dir"
 #define CFG_TITLE_NOTES "title-notes"
@@ -17,6 +17,15 @@ struct note_link_t {
     struct note_link_t *next;
 };
 
+// Title and first paragraph of a note, see psx_note_summary().
+// :note_summary
+struct psx_note_summary_t {
+    struct psx_block_t *title;
+
+    // NULL if the block after the title isn't a paragraph.
+    struct psx_block_t *paragraph;
+};
+
 struct note_t {
     mem_pool_t pool;
 
@@ -24,15 +33,45 @@ struct note_t {
 
     char *id;
     string_t title;
+
+    // Notes loaded by rt_init_push_file() don't own their source, it's a read
+    // only view into the runtime's sources_pool.
     string_t psplx;
 
     struct psx_block_t *tree;
+    struct psx_note_summary_t *summary;
 
     struct html_t *html;
 
     bool error;
     string_t error_msg;
 
+    // While notes are processed in parallel, writes to shared runtime state
+    // are buffered here. They get merged into the runtime in note order so the
+    // result is the same as processing notes sequentially.
+    // :parallel_note_processing
+    DYNAMIC_ARRAY_DEFINE(uint64_t,used_file_ids);
+    LINKED_LIST_DECLARE(struct late_cb_invocation_t,invocations);
+
+    // :build_cache
+    uint64_t source_hash;
+    uint64_t build_key;
+    bool is_up_to_date;
+    bool is_cacheable;
+    DYNAMIC_ARRAY_DEFINE(struct build_dep_t,build_deps);
+
+    // Set if the note's writes to the SPLX data are replayed from the cache
+    // instead of parsing it. If it has to be rendered anyway, it's parsed
+    // without writing them again, next_block_op then is the block op whose
+    // node the next data block gets.
+    bool is_replayed;
+    int next_block_op;
+    DYNAMIC_ARRAY_DEFINE(struct note_data_op_t,data_ops);
+
+    // Number of virtual IDs given to data blocks of this note, see
+    // psx_set_virtual_id().
+    int virtual_ids_len;
+
     struct note_t *next;
 };
 
@@ -41,15 +80,60 @@ void note_init (struct note_t *note)
     mem_pool_t *pool = &note->pool;
     str_pool (pool, &note->path);
     str_pool (pool, &note->title);
-    str_pool (pool, &note->psplx);
     str_pool (pool, &note->error_msg);
 }
 
 void note_destroy (struct note_t *note)
 {
+    free (note->build_deps);
+    free (note->data_ops);
     mem_pool_destroy (&note->pool);
 }
 
+// Notes can be processed in parallel, but each one by a single thread at a
+// time, so deps are allocated from the note's pool.
+// :build_cache
+void note_add_build_dep (struct note_t *note, enum build_dep_type_t type, char *name, char *value)
+{
+    if (note == NULL) return;
+
+    struct build_dep_t dep = {0};
+    dep.type = type;
+    dep.name = pom_strdup (&note->pool, name != NULL ? name : "");
+    dep.value = pom_strdup (&note->pool, value);
+    DYNAMIC_ARRAY_APPEND (note->build_deps, dep);
+}
+
+// Only called from phases that run sequentially, but allocates from the
+// note's pool like note_add_build_dep().
+// :build_cache
+struct note_data_op_t* note_add_data_op (struct note_t *note, enum note_data_op_type_t type, char *arg0, char *arg1, char *arg2)
+{
+    if (note == NULL) return NULL;
+
+    struct note_data_op_t op = {0};
+    op.type = type;
+    op.phase = rt_get()->phase;
+
+    char *args[] = {arg0, arg1, arg2};
+    for (int i=0; i<ARRAY_SIZE(args); i++) {
+        if (args[i] != NULL) op.args[i] = pom_strdup (&note->pool, args[i]);
+    }
+
+    DYNAMIC_ARRAY_APPEND (note->data_ops, op);
+    return &note->data_ops[note->data_ops_len-1];
+}
+
+struct note_data_op_t* note_next_block_op (struct note_t *note)
+{
+    while (note->next_block_op < note->data_ops_len) {
+        struct note_data_op_t *op = &note->data_ops[note->next_block_op++];
+        if (op->type == NOTE_DATA_OP_BLOCK) return op;
+    }
+
+    return NULL;
+}
+
 // :content_width
 int psx_content_width = 728; // px
 
@@ -83,6 +167,11 @@ struct psx_parser_state_t {
     struct psx_token_t token;
     struct psx_token_t token_peek;
 
+    // When set, ps_inline_next() replays these tokens instead of scanning.
+    // :inline_tokens
+    struct psx_inline_tokens_t *inline_tokens;
+    uint32_t inline_token_idx;
+
     DYNAMIC_ARRAY_DEFINE (struct psx_block_t*, block_stack);
     DYNAMIC_ARRAY_DEFINE (struct psx_block_unit_t*, block_unit_stack);
 };
@@ -103,10 +192,70 @@ void ps_destroy (struct psx_parser_state_t *ps)
     mem_pool_destroy (&ps->pool);
 }
 
+// Character classes for the tokenizers. Operators are ,=[]{}\^|` a run of text
+// in ps_inline_next_full() ends at an operator, a space or the end of a line.
+// :tokenizer_fast_path
+#define PSX_CHAR_OPERATOR 0x1
+#define PSX_CHAR_TEXT_END 0x2
+
+static const uint8_t psx_char_class[256] = {
+    [','] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['='] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['['] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    [']'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['{'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['}'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['\\'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['^'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['|'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+    ['`'] = PSX_CHAR_OPERATOR|PSX_CHAR_TEXT_END,
+
+    [' ']  = PSX_CHAR_TEXT_END,
+    ['\t'] = PSX_CHAR_TEXT_END,
+    ['\n'] = PSX_CHAR_TEXT_END,
+    ['\0'] = PSX_CHAR_TEXT_END,
+};
+
 static inline
 bool char_is_operator (char c)
 {
-    return char_in_str(c, ",=[]{}\\^|`");
+    return psx_char_class[(uint8_t)c] & PSX_CHAR_OPERATOR;
+}
+
+#if defined(SCR_CHUNK_SIZE)
+static inline
+uint32_t psx_text_end_mask (scr_chunk_t chunk)
+{
+    // Same characters as PSX_CHAR_TEXT_END in psx_char_class.
+    return scr_chunk_eq(chunk, ',') | scr_chunk_eq(chunk, '=') |
+        scr_chunk_eq(chunk, '[') | scr_chunk_eq(chunk, ']') |
+        scr_chunk_eq(chunk, '{') | scr_chunk_eq(chunk, '}') |
+        scr_chunk_eq(chunk, '\\') | scr_chunk_eq(chunk, '^') |
+        scr_chunk_eq(chunk, '|') | scr_chunk_eq(chunk, '`') |
+        scr_chunk_eq(chunk, ' ') | scr_chunk_eq(chunk, '\t') |
+        scr_chunk_eq(chunk, '\n') | scr_chunk_eq(chunk, '\0');
+}
+#endif
+
+// Returns a pointer to the first character at or after str that ends a run of
+// text. See scr_line_end() about reading past the end of the string.
+// :tokenizer_fast_path
+__attribute__((no_sanitize_address))
+char* psx_text_end (char *str)
+{
+    // Most runs of text are words, shorter than a chunk. Looking them up in
+    // the table is faster than setting up the chunk comparisons.
+    for (int i=0; i<16; i++) {
+        if (psx_char_class[(uint8_t)str[i]] & PSX_CHAR_TEXT_END) return str + i;
+    }
+    str += 16;
+
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, psx_text_end_mask);
+#else
+    while (!(psx_char_class[(uint8_t)*str] & PSX_CHAR_TEXT_END)) str++;
+    return str;
+#endif
 }
 
 static inline
@@ -819,12 +968,85 @@ bool ps_match(struct psx_parser_state_t *ps, enum psx_token_type_t type, char *v
     return match;
 }
 
+// Looks for a stored token that starts at the current position. Consumers
+// mostly ask for tokens in order, so the one after the last replayed token is
+// checked first, otherwise we do a binary search. Not finding one is fine, it
+// happens after skipping over a tag's parameters or content with
+// psx_match_tag_data(), the caller then scans normally. Tokenizing only depends
+// on the text from the current position on, so replaying a token that starts
+// here returns the same as scanning.
+// :inline_tokens
+static inline
+struct psx_inline_token_t* ps_inline_token_find (struct psx_parser_state_t *ps)
+{
+    struct psx_inline_tokens_t *tokens = ps->inline_tokens;
+    uint32_t offset = scr_pos(PS_SCR) - PS_SCR->str;
+
+    uint32_t idx = ps->inline_token_idx;
+    if (idx >= tokens->len || tokens->tokens[idx].start != offset) {
+        uint32_t low = 0;
+        uint32_t high = tokens->len;
+        while (low < high) {
+            uint32_t mid = low + (high - low)/2;
+            if (tokens->tokens[mid].start < offset) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        idx = low;
+        if (idx >= tokens->len || tokens->tokens[idx].start != offset) {
+            return NULL;
+        }
+    }
+
+    ps->inline_token_idx = idx + 1;
+    return &tokens->tokens[idx];
+}
+
 #define ps_inline_next(ps) ps_inline_next_full(ps,true)
 struct psx_token_t ps_inline_next_full(struct psx_parser_state_t *ps, bool escape_operators)
 {
     struct psx_token_t tok = {0};
 
-    if (PS_SCR->is_eof || scr_curr_char(PS_SCR) == '\0') {
+    struct psx_inline_token_t *stored = NULL;
+    if (escape_operators && ps->inline_tokens != NULL && !PS_SCR->is_eof) {
+        stored = ps_inline_token_find (ps);
+    }
+
+    if (stored != NULL) {
+        char *start = PS_SCR->str + stored->start;
+        uint32_t len = stored->end - stored->start;
+
+        tok.type = stored->type;
+        if (stored->flags & PSX_INLINE_TOKEN_ESCAPED) {
+            tok.value = SSTRING(start + 1, 1);
+
+        } else if (tok.type == TOKEN_TYPE_TEXT_TAG || tok.type == TOKEN_TYPE_DATA_TAG) {
+            tok.value = SSTRING(start + 1, len - 1);
+
+        } else if (tok.type == TOKEN_TYPE_SPACE) {
+            tok.coalesced_spaces = len;
+            tok.value = SSTRING(" ", 1);
+
+        } else {
+            tok.value = SSTRING(start, len);
+        }
+
+        PS_SCR->pos = start + len;
+        if (stored->newlines > 0) {
+            PS_SCR->line_number += stored->newlines;
+            PS_SCR->column_number = stored->end_column;
+        } else {
+            PS_SCR->column_number += len;
+        }
+
+        if (stored->flags & PSX_INLINE_TOKEN_EOF) {
+            PS_SCR->is_eof = true;
+        }
+
+    } else if (PS_SCR->is_eof || scr_curr_char(PS_SCR) == '\0') {
         // :eof_set
         ps->scr.is_eof = true;
 
@@ -863,16 +1085,23 @@ struct psx_token_t ps_inline_next_full(struct psx_parser_state_t *ps, bool escap
         tok.type = TOKEN_TYPE_SPACE;
 
     } else {
+        // This used to call scr_advance_char() while not at an operator or a
+        // space, checking for \n after advancing. The first character is
+        // always consumed, even if it's a \n, then we stop at the first
+        // operator, space, \n or \0. Stopping at \0 sets is_eof, the loop
+        // called scr_advance_char() on it.
+        // :tokenizer_fast_path
         char *start = scr_pos(PS_SCR);
-        while (!PS_SCR->is_eof && !ps_is_operator(ps) && !scr_is_space(PS_SCR)) {
-            scr_advance_char (PS_SCR);
+        char *end = psx_text_end (start + 1);
+
+        PS_SCR->column_number += end - start;
+        PS_SCR->pos = end;
+        if (*end == '\n') {
+            PS_SCR->line_number++;
+            PS_SCR->column_number = 0;
 
-            // NOTE: Why this is necessary is very tricky. Removing it causes
-            // an end of a note consisting of single word paragraphs to
-            // disappear. Adding the check at within the while() condition
-            // causes an infinite loop. It MUST be here, inside the while and
-            // after scr_advance_char().
-            if (*ps->scr.pos == '\n') break;
+        } else if (*end == '\0') {
+            PS_SCR->is_eof = true;
         }
 
         tok.value = SSTRING(start, scr_pos(PS_SCR) - start);
@@ -885,6 +1114,85 @@ struct psx_token_t ps_inline_next_full(struct psx_parser_state_t *ps, bool escap
     return tok;
 }
 
+// Tokenizes the whole content once and stores the result. The tokens are
+// allocated from pool, the temporary array is malloc'd because we don't know
+// how many there will be.
+// :inline_tokens
+struct psx_inline_tokens_t* psx_inline_tokens_new (mem_pool_t *pool, char *content, uint32_t content_len)
+{
+    STACK_ALLOCATE (struct psx_parser_state_t, ps);
+    ps_init (ps, content);
+
+    uint32_t tokens_size = content_len/4 + 8;
+    uint32_t tokens_len = 0;
+    struct psx_inline_token_t *tokens = malloc (tokens_size*sizeof(*tokens));
+
+    while (!PS_SCR->is_eof) {
+        char *start = scr_pos(PS_SCR);
+        int line_number = PS_SCR->line_number;
+        bool is_escaped = (*start == '\\' && char_is_operator(start[1]) && start[1] != '\\');
+
+        struct psx_token_t tok = ps_inline_next (ps);
+        if (scr_pos(PS_SCR) == start) break;
+
+        if (tokens_len == tokens_size) {
+            tokens_size *= 2;
+            tokens = realloc (tokens, tokens_size*sizeof(*tokens));
+        }
+
+        struct psx_inline_token_t *new_token = &tokens[tokens_len++];
+        new_token->start = start - content;
+        new_token->end = scr_pos(PS_SCR) - content;
+        new_token->newlines = PS_SCR->line_number - line_number;
+        new_token->end_column = PS_SCR->column_number;
+        new_token->type = tok.type;
+        new_token->flags = 0;
+        if (is_escaped) new_token->flags |= PSX_INLINE_TOKEN_ESCAPED;
+        if (PS_SCR->is_eof) new_token->flags |= PSX_INLINE_TOKEN_EOF;
+    }
+
+    struct psx_inline_tokens_t *res = mem_pool_push_struct (pool, struct psx_inline_tokens_t);
+    res->content = content;
+    res->content_len = content_len;
+    res->len = tokens_len;
+    res->tokens = mem_pool_push_array (pool, tokens_len, struct psx_inline_token_t);
+    memcpy (res->tokens, tokens, tokens_len*sizeof(*tokens));
+
+    free (tokens);
+    ps_destroy (ps);
+
+    return res;
+}
+
+// Returns the stored tokens of a block, or NULL if there are none or its
+// content was replaced since they were created. Code that edits content in
+// place without changing its length must set inline_tokens to NULL.
+static inline
+struct psx_inline_tokens_t* psx_block_inline_tokens (struct psx_block_t *block)
+{
+    struct psx_inline_tokens_t *tokens = block->inline_tokens;
+    if (tokens != NULL &&
+        (tokens->content != str_data(&block->inline_content) ||
+         tokens->content_len != str_len(&block->inline_content))) {
+        tokens = NULL;
+    }
+
+    return tokens;
+}
+
+// Creates the tokens of a block if it doesn't have them. This allocates from
+// pool, so only call it from phases that process notes sequentially, parallel
+// ones only read tokens through psx_block_inline_tokens().
+struct psx_inline_tokens_t* psx_block_inline_tokens_create (mem_pool_t *pool, struct psx_block_t *block)
+{
+    if (psx_block_inline_tokens (block) == NULL) {
+        block->inline_tokens =
+            psx_inline_tokens_new (pool, str_data(&block->inline_content), str_len(&block->inline_content));
+    }
+
+    return block->inline_tokens;
+}
+
 struct psx_tag_t {
     struct psx_token_t token;
 
@@ -1542,6 +1850,18 @@ void html_append_link (struct psx_parser_state_t *ps,
     }
 }
 
+// Entity a link points to. The reference can be an ID, otherwise it's the name
+// of an entity with the given type.
+struct splx_node_t* psx_link_target (struct note_runtime_t *rt, char *type, char *reference)
+{
+    struct splx_node_t *target = splx_get_node_by_id (&rt->sd, reference);
+    if (target == NULL) {
+        target = splx_get_node_by_name_optional_type(&rt->sd, type, reference);
+    }
+
+    return target;
+}
+
 void html_redact_or_append_link (struct psx_parser_state_t *ps,
                                  struct html_t *html,
                                  struct html_element_t *parent,
@@ -1559,14 +1879,10 @@ void html_redact_or_append_link (struct psx_parser_state_t *ps,
     string_t section = {0};
     psx_match_link (str_data(s), NULL, &text, &reference, &section, NULL);
 
-    bool reference_is_id = (splx_get_node_by_id(&rt->sd, str_data(&reference)) != NULL);
-    struct splx_node_t *target = NULL;
-    if (reference_is_id) {
-        target = splx_get_node_by_id (&rt->sd, str_data(&reference));
+    struct splx_node_t *target = psx_link_target (rt, type, str_data(&reference));
 
-    } else {
-        target = splx_get_node_by_name_optional_type(&rt->sd, type, str_data(&reference));
-    }
+    // :build_cache
+    note_add_build_dep (ps->ctx.note, BUILD_DEP_REFERENCE, type, str_data(&reference));
 
 
     // TODO: Should really be doing...
@@ -1583,7 +1899,7 @@ void html_redact_or_append_link (struct psx_parser_state_t *ps,
 
             string_t text = {0};
             LINKED_LIST_FOR (struct html_element_t *, e1, html_parent->children) {
-                str_cat(&text, &e1->text);
+                str_cat_sstr(&text, &e1->text);
             }
 
             // TODO: A tag with a body containing unbalanced braces can cause an
@@ -1607,7 +1923,7 @@ void html_redact_or_append_link (struct psx_parser_state_t *ps,
 
                     pprev = prev;
                     prev = curr;
-                    curr_pos += str_len(&curr->text);
+                    curr_pos += curr->text.len;
                 }
 
                 // TODO: This leaks the nodes that were redacted.
@@ -1621,7 +1937,7 @@ void html_redact_or_append_link (struct psx_parser_state_t *ps,
                         }
                         assert (prev != NULL);
 
-                    } else if (is_empty_str(str_data(&prev->text))) {
+                    } else if (is_empty_str(prev->text.s)) {
                         // If we landed at a text node with empty text, move
                         // back to strip the space before the redaacting
                         // parenthesis.
@@ -1641,8 +1957,7 @@ void html_redact_or_append_link (struct psx_parser_state_t *ps,
                 // Handle opening parenthesis not at the start of element's
                 // text.
                 if (curr_pos > pos) {
-                    str_shrink(&prev->text, pos - (curr_pos - str_len(&prev->text)));
-                    str_rstrip (&prev->text);
+                    html_text_node_shrink (prev, pos - (curr_pos - prev->text.len));
                 }
 
                 cstr_find_close_parenthesis (ps->scr.pos, count, &pos);
@@ -1734,13 +2049,16 @@ void str_cat_inline_content_as_plain (char *content, string_t *str)
 //
 // TODO: How do we handle the prescence of nested blocks here?, ignore them and
 // print them or raise an error and stop parsing.
-void block_content_parse_text (struct psx_parser_ctx_t *ctx, struct html_t *html, struct html_element_t *container, char *content,
-    bool force_external_links)
+#define block_content_parse_text(ctx,html,container,content,force_external_links) \
+    block_content_parse_text_full(ctx,html,container,content,NULL,force_external_links)
+void block_content_parse_text_full (struct psx_parser_ctx_t *ctx, struct html_t *html, struct html_element_t *container, char *content,
+    struct psx_inline_tokens_t *tokens, bool force_external_links)
 {
     string_t buff = {0};
     STACK_ALLOCATE (struct psx_parser_state_t, ps);
     ps->ctx = *ctx;
     ps_init (ps, content);
+    ps->inline_tokens = tokens;
     char *original_pos = NULL;
 
     // Remove escaping character of escaped title sequences or escaped '\' at
@@ -1856,11 +2174,10 @@ void block_content_parse_text (struct psx_parser_ctx_t *ctx, struct html_t *html
             if (tag->has_content) {
                 str_replace (&tag->content, "\n", " ", NULL);
 
-                const char *error;
                 Resub m;
-                Reprog *regex = regcomp("^.*(youtu.be\\/|youtube(-nocookie)?.com\\/(v\\/|.*u\\/\\w\\/|embed\\/|.*v=))([\\w-]{11}).*", 0, &error);
+                Reprog *regex = regcomp_cached("^.*(youtu.be\\/|youtube(-nocookie)?.com\\/(v\\/|.*u\\/\\w\\/|embed\\/|.*v=))([\\w-]{11}).*");
 
-                if (!regexec(regex, str_data(&tag->content), &m, 0)) {
+                if (regex != NULL && !regexec(regex, str_data(&tag->content), &m, 0)) {
                     sstring_t video_id = SSTRING((char*) m.sub[4].sp, m.sub[4].ep - m.sub[4].sp);
 
                     // Assume 16:9 aspect ratio
@@ -1879,7 +2196,6 @@ void block_content_parse_text (struct psx_parser_ctx_t *ctx, struct html_t *html
                     html_element_attribute_set (html, html_element, SSTR("allow"), SSTR("accelerometer; autoplay; clipboard-write; encrypted-media; gyroscope; picture-in-picture"));
                     html_element_attribute_set (html, html_element, SSTR("allowfullscreen"), SSTR(""));
                     psx_append_html_element(ps, html, html_element);
-                    regfree (regex);
 
                 } else { success = false; }
             } else { success = false; }
@@ -1914,10 +2230,7 @@ void block_content_parse_text (struct psx_parser_ctx_t *ctx, struct html_t *html
                         uint64_t id = canonical_id_parse(curr_image, 0);
                         struct vlt_file_t *file = file_id_lookup (ctx->vlt, id);
 
-                        struct note_runtime_t *rt = rt_get();
-                        if (rt) {
-                            DYNAMIC_ARRAY_APPEND(rt->used_file_ids, id);
-                        }
+                        rt_add_used_file_id (ctx->note, id);
 
                         string_t file_extension = {0};
                         str_set (&file_extension, str_data(&file->extension));
@@ -2028,7 +2341,7 @@ void block_content_parse_text (struct psx_parser_ctx_t *ctx, struct html_t *html
             psx_late_user_tag_cb_t *cb = psx_late_user_tag_cb_get(&rt->user_late_cb_tree, str_data(&buff));
 
             if (cb != NULL) {
-                struct psx_tag_t *tag = ps_parse_tag_full (&rt->pool, ps, &original_pos, false);
+                struct psx_tag_t *tag = ps_parse_tag_full (rt_note_pool (rt, ctx->note), ps, &original_pos, false);
                 rt_queue_late_callback (ctx->note, tag, psx_get_head_html_element(ps), cb);
 
             } else {
@@ -2177,6 +2490,7 @@ void psx_block_tree_user_callbacks_full (struct psx_parser_ctx_t *ctx, struct bl
         struct psx_parser_state_t *ps_inline = &_ps_inline;
         ps_inline->ctx = *ctx;
         ps_init (ps_inline, str_data(&block->inline_content));
+        ps_inline->inline_tokens = psx_block_inline_tokens_create (ba->pool, block);
 
         struct psx_user_tag_cb_t user_cb_tree = {0};
         user_cb_tree.pool = &ps_inline->pool;
@@ -2238,6 +2552,11 @@ void psx_block_tree_user_callbacks_full (struct psx_parser_ctx_t *ctx, struct bl
             }
             str_cat_c (&block->inline_content, p);
             free (original);
+
+            // Replacements change the content, tokenize it again now so HTML
+            // generation doesn't have to.
+            block->inline_tokens = NULL;
+            psx_block_inline_tokens_create (ba->pool, block);
         }
 
         // TODO: What will happen if a parse error occurs here?. We should print
@@ -2247,11 +2566,16 @@ void psx_block_tree_user_callbacks_full (struct psx_parser_ctx_t *ctx, struct bl
     }
 }
 
-void psx_set_virtual_id (struct splx_node_t *node)
+// Virtual IDs are derived from a key that identifies the entity instead of
+// being random, so they are the same in every run as long as the entity is. The
+// build cache relies on this, otherwise any link to a virtual entity would
+// change every time.
+// :build_cache
+void psx_set_virtual_id (struct splx_node_t *node, uint64_t key)
 {
     struct note_runtime_t *rt = rt_get();
     string_t virtual_id = {0};
-    str_cat_id_random (&virtual_id);
+    str_cat_id_from_hash (&virtual_id, key);
     splx_node_attribute_append_c_str(&rt->sd, node, "t:virtual_id", str_data(&virtual_id), SPLX_NODE_TYPE_STRING);
     rt->next_virtual_id++;
     str_free(&virtual_id);
@@ -2304,7 +2628,11 @@ struct splx_node_t* psx_get_or_set_entity(struct splx_data_t *sd,
 
     if (!found && entity == NULL) {
         entity = splx_node (sd, id, SPLX_NODE_TYPE_OBJECT);
-        psx_set_virtual_id(entity);
+
+        // There's a single virtual entity for each name, any later link to
+        // the same name finds this one.
+        uint64_t key = build_hash_str (BUILD_HASH_INIT, "name");
+        psx_set_virtual_id(entity, build_hash_str (key, str_data(&name_clean)));
         splx_node_attribute_append_c_str(sd, entity, "a", type, SPLX_NODE_TYPE_OBJECT);
         splx_node_attribute_append_c_str(sd, entity, "name", str_data(&name_clean), SPLX_NODE_TYPE_STRING);
     }
@@ -2355,8 +2683,19 @@ void psx_create_link(struct splx_data_t *sd,
     str_free (&section);
 }
 
-#define psx_create_links(ctx,root) psx_create_links_full(ctx,root,NULL)
-void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct psx_block_t **root, struct psx_block_t **block_p)
+// Link from the note being processed. Replayed notes already have their links
+// in the SPLX data.
+// :build_cache
+void psx_note_create_link (struct psx_parser_ctx_t *ctx, string_t *type, string_t *name)
+{
+    if (ctx->note->is_replayed) return;
+
+    note_add_data_op (ctx->note, NOTE_DATA_OP_LINK, str_data(type), str_data(name), NULL);
+    psx_create_link(&ctx->rt->sd, ctx->note->tree->data, ctx->note->id, type, name);
+}
+
+#define psx_create_links(ctx,ba,root) psx_create_links_full(ctx,ba,root,NULL)
+void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct block_allocation_t *ba, struct psx_block_t **root, struct psx_block_t **block_p)
 {
     if (block_p == NULL) block_p = root;
 
@@ -2365,7 +2704,7 @@ void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct psx_block_t **r
     if (block->block_content != NULL) {
         struct psx_block_t **sub_block = &((*block_p)->block_content);
         while (*sub_block != NULL) {
-            psx_create_links_full (ctx, root, sub_block);
+            psx_create_links_full (ctx, ba, root, sub_block);
             sub_block = &(*sub_block)->next;
         }
 
@@ -2373,6 +2712,11 @@ void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct psx_block_t **r
         STACK_ALLOCATE (struct psx_parser_state_t, ps_inline);
         ps_init (ps_inline, str_data(&block->inline_content));
 
+        // This is the first time we tokenize the block, later phases replay
+        // these tokens.
+        // :inline_tokens
+        ps_inline->inline_tokens = psx_block_inline_tokens_create (ba->pool, block);
+
         while (!ps_inline->scr.is_eof && !ps_inline->error) {
             ps_inline_next (ps_inline);
             if (ps_match(ps_inline, TOKEN_TYPE_TEXT_TAG, "link") ||
@@ -2407,7 +2751,7 @@ void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct psx_block_t **r
                     // TODO: What should happen if an inline data tag has content?...
                     // TODO: What if it has multiple parameters or named parameters?
 
-                    psx_create_link(&ctx->rt->sd, ctx->note->tree->data, ctx->note->id, &type, &name);
+                    psx_note_create_link (ctx, &type, &name);
 
                     str_free(&type);
                     str_free(&name);
@@ -2424,7 +2768,7 @@ void psx_create_links_full (struct psx_parser_ctx_t *ctx, struct psx_block_t **r
                     str_set_sstr(&type, &ps_inline->token.value);
                     string_t name = strn_new (content, content_len);
 
-                    psx_create_link(&ctx->rt->sd, ctx->note->tree->data, ctx->note->id, &type, &name);
+                    psx_note_create_link (ctx, &type, &name);
 
                     str_free(&type);
                     str_free(&name);
@@ -2452,7 +2796,7 @@ void append_attribute_value (struct psx_parser_ctx_t *ctx, struct html_t *html,
         uint64_t id = canonical_id_parse(value, 0);
         struct vlt_file_t *file = file_id_lookup (&rt->vlt, id);
 
-        DYNAMIC_ARRAY_APPEND(rt->used_file_ids, id);
+        rt_add_used_file_id (ctx->note, id);
 
         if (file != NULL) {
             str_set_printf (&value_target, "files/%s", str_data(&file->path));
@@ -2624,7 +2968,7 @@ void attributed_block_html_append (struct psx_parser_ctx_t *ctx, struct html_t *
     struct html_element_t *new_dom_element = html_new_element (html, "p");
     html_element_attribute_set (html, new_dom_element, SSTR("data-block-attributes"), SSTR(""));
     html_element_append_child (html, parent, new_dom_element);
-    block_content_parse_text (ctx, html, new_dom_element, str_data(&block->inline_content), force_external_links);
+    block_content_parse_text_full (ctx, html, new_dom_element, str_data(&block->inline_content), psx_block_inline_tokens(block), force_external_links);
 }
 #else
 {
@@ -2641,7 +2985,7 @@ void attributed_block_html_append (struct psx_parser_ctx_t *ctx, struct html_t *
     if (str_len(&block->inline_content) > 0) {
         struct html_element_t *inline_content = html_new_element (html, "p");
         html_element_append_child (html, new_dom_element, inline_content);
-        block_content_parse_text (ctx, html, inline_content, str_data(&block->inline_content), force_external_links);
+        block_content_parse_text_full (ctx, html, inline_content, str_data(&block->inline_content), psx_block_inline_tokens(block), force_external_links);
     }
 
     struct html_element_t *block_attributes = html_new_element (html, "div");
@@ -2700,7 +3044,7 @@ void block_tree_to_html (struct psx_parser_ctx_t *ctx, struct html_t *html, stru
 
                 // Add a line break to mark the start of the HTML. Only if it's
                 // not within a list item.
-                if (strcmp(str_data(&new_dom_element->tag), "li") != 0) {
+                if (new_dom_element->tag != HTML_TAG_LI) {
                     html_element_append_no_escape_strn (html, new_dom_element, 1, "\n");
                 }
 
@@ -2709,7 +3053,7 @@ void block_tree_to_html (struct psx_parser_ctx_t *ctx, struct html_t *html, stru
                 html_element_append_child (html, parent, new_dom_element);
             }
 
-            block_content_parse_text (ctx, html, new_dom_element, block_content, force_external_links);
+            block_content_parse_text_full (ctx, html, new_dom_element, block_content, psx_block_inline_tokens(block), force_external_links);
 
         } else {
             attributed_block_html_append (ctx, html, block, parent, force_external_links);
@@ -2724,7 +3068,7 @@ void block_tree_to_html (struct psx_parser_ctx_t *ctx, struct html_t *html, stru
         html_element_attribute_set (html, new_dom_element, SSTR("id"), SSTR(str_data(&buff)));
 
         html_element_append_child (html, parent, new_dom_element);
-        block_content_parse_text (ctx, html, new_dom_element, str_data(&block->inline_content), force_external_links);
+        block_content_parse_text_full (ctx, html, new_dom_element, str_data(&block->inline_content), psx_block_inline_tokens(block), force_external_links);
 
     } else if (block->type == BLOCK_TYPE_CODE) {
         struct html_element_t *pre_element = html_new_element (html, "pre");
@@ -2813,15 +3157,16 @@ void block_tree_to_html (struct psx_parser_ctx_t *ctx, struct html_t *html, stru
     str_free (&buff);
 }
 
-void psx_parse_block_attributes (struct psx_parser_state_t *ps,
-                                 struct psx_block_t *block,
-                                 char *node_id,
-                                 struct splx_node_t *parent_entity)
+// Writes the data of a block into the SPLX data. Types are the ones in the
+// block's data tag separated by spaces and tsplx its content, both are NULL if
+// the block has no data tag. Data of notes replayed from the cache is written
+// through here too, so both paths produce the same entities.
+// :build_cache
+struct splx_node_t* psx_block_data_add (struct psx_parser_ctx_t *ctx,
+                                        char *node_id, char *types, char *tsplx,
+                                        struct splx_node_t *parent_entity)
 {
-    assert (block != NULL);
-
-    char *backup_pos = scr_pos(PS_SCR);
-    int backup_column_number = ps->scr.column_number;
+    assert(ctx->sd != NULL);
 
     // We don't want to add data nodes for all blocks, it feels wasteful to have
     // one for each paragraph (?). Instead we only add a node if it has an ID,
@@ -2829,37 +3174,100 @@ void psx_parse_block_attributes (struct psx_parser_state_t *ps,
     // That being said, we do force one data node for each note because we need
     // them to make references through links anyway.
     // :block_data_node_instantiation
-    if (node_id != NULL) {
-        block->data = splx_node_get_or_create(ps->ctx.sd, node_id, SPLX_NODE_TYPE_OBJECT);
+    struct splx_node_t *data = NULL;
+    if (node_id != NULL || types != NULL) {
+        data = splx_node_get_or_create(ctx->sd, node_id, SPLX_NODE_TYPE_OBJECT);
+    }
+
+    if (types != NULL) {
+        if (*types != '\0') {
+            char *type_start = types;
+            while (type_start != NULL) {
+                char *type_end = strchr (type_start, ' ');
+
+                string_t s = {0};
+                if (type_end != NULL) {
+                    strn_set (&s, type_start, type_end - type_start);
+                    type_start = type_end + 1;
+                } else {
+                    str_set (&s, type_start);
+                    type_start = NULL;
+                }
+
+                struct splx_node_t *type = splx_node_get_or_create (ctx->sd, str_data(&s), SPLX_NODE_TYPE_OBJECT);
+                splx_node_attribute_append (ctx->sd, data, "a", type);
+                str_free (&s);
+            }
+        }
+
+        tsplx_parse_str_name_full(ctx->sd, tsplx, data, ctx->error_msg);
+
+        if (!splx_node_has_name(data)) {
+            // Identified by the note and the number of virtual entities it
+            // created before this one. Blocks parsed outside of a note (like
+            // in tests) just get a number that's unique in this run.
+            int virtual_idx = ctx->note != NULL ? ctx->note->virtual_ids_len++ : rt_get()->next_virtual_id;
+            uint64_t key = build_hash_str (BUILD_HASH_INIT, "block");
+            key = build_hash_str (key, ctx->id != NULL ? ctx->id : "");
+            psx_set_virtual_id(data, build_hash (key, &virtual_idx, sizeof(virtual_idx)));
+
+            if (parent_entity != NULL) {
+                rt_link_entities (parent_entity, data, NULL, NULL);
+            }
+        }
+    }
+
+    return data;
+}
+
+bool psx_block_data_is_private (struct splx_node_t *data)
+{
+    bool is_private = false;
+
+    struct note_runtime_t *rt = rt_get();
+    if (rt != NULL) {
+        for (int i=0; i<rt->private_types_len; i++) {
+            if (splx_node_attribute_contains(data, "a", rt->private_types[i])) {
+                is_private = true;
+            }
+        }
     }
 
+    return is_private;
+}
+
+void psx_parse_block_attributes (struct psx_parser_state_t *ps,
+                                 struct psx_block_t *block,
+                                 char *node_id,
+                                 struct splx_node_t *parent_entity)
+{
+    assert (block != NULL);
+
+    char *backup_pos = scr_pos(PS_SCR);
+    int backup_column_number = ps->scr.column_number;
+
     scr_consume_spaces (PS_SCR);
 
+    bool has_data_tag = false;
+    string_t types = {0};
+    string_t tsplx_data = {0};
+
     struct psx_token_t tok = ps_inline_next (ps);
     if (ps_match(ps, TOKEN_TYPE_DATA_TAG, NULL)) {
-        assert(ps->ctx.sd != NULL);
-
-        // :block_data_node_instantiation
-        if (block->data == NULL) {
-            block->data = splx_node_get_or_create(ps->ctx.sd, node_id, SPLX_NODE_TYPE_OBJECT);
-        }
+        has_data_tag = true;
 
         if (tok.value.len > 0) {
             char *internal_backup_pos;
             int internal_backup_column_number;
 
+            int num_types = 0;
             do {
                 internal_backup_pos = scr_pos(PS_SCR);
                 internal_backup_column_number = ps->scr.column_number;
 
-                string_t s = {0};
-                str_set_sstr(&s, &tok.value);
-                struct splx_node_t *type = splx_node_get_or_create (ps->ctx.sd, str_data(&s), SPLX_NODE_TYPE_OBJECT);
-                splx_node_attribute_append (
-                    ps->ctx.sd,
-                    block->data,
-                    "a", type);
-                str_free (&s);
+                if (num_types > 0) str_cat_c (&types, " ");
+                str_cat_sstr (&types, &tok.value);
+                num_types++;
 
                 tok = ps_inline_next (ps);
             } while (ps_match(ps, TOKEN_TYPE_DATA_TAG, NULL));
@@ -2868,18 +3276,7 @@ void psx_parse_block_attributes (struct psx_parser_state_t *ps,
             ps->scr.column_number = internal_backup_column_number;
         }
 
-        string_t tsplx_data = {0};
         psx_cat_tag_content (ps, &tsplx_data, true);
-        tsplx_parse_str_name_full(ps->ctx.sd, str_data(&tsplx_data), block->data, ps->ctx.error_msg);
-        str_free (&tsplx_data);
-
-        if (!splx_node_has_name(block->data)) {
-            psx_set_virtual_id(block->data);
-
-            if (parent_entity != NULL) {
-                rt_link_entities (parent_entity, block->data, NULL, NULL);
-            }
-        }
 
         // At this point, we parsed some attributes, and we're setting the new
         // pos pointer in the state. If we had used peek before, the next call
@@ -2897,14 +3294,32 @@ void psx_parse_block_attributes (struct psx_parser_state_t *ps,
         ps->scr.column_number = backup_column_number;
     }
 
-    struct note_runtime_t *rt = rt_get();
-    if (rt != NULL) {
-        for (int i=0; i<rt->private_types_len; i++) {
-            if (splx_node_attribute_contains(block->data, "a", rt->private_types[i])) {
-                block->is_private = true;
+    if (node_id != NULL || has_data_tag) {
+        // :build_cache
+        struct note_t *note = ps->ctx.note;
+        if (note != NULL && note->is_replayed) {
+            struct note_data_op_t *op = note_next_block_op (note);
+            assert (op != NULL);
+            block->data = op->node;
+            block->is_private = op->is_private;
+
+        } else {
+            char *types_str = has_data_tag ? str_data(&types) : NULL;
+            char *tsplx_str = has_data_tag ? str_data(&tsplx_data) : NULL;
+            block->data = psx_block_data_add (&ps->ctx, node_id, types_str, tsplx_str, parent_entity);
+            block->is_private = psx_block_data_is_private (block->data);
+
+            struct note_data_op_t *op = note_add_data_op (note, NOTE_DATA_OP_BLOCK, node_id, types_str, tsplx_str);
+            if (op != NULL) {
+                op->has_parent = parent_entity != NULL;
+                op->node = block->data;
+                op->is_private = block->is_private;
             }
         }
     }
+
+    str_free (&types);
+    str_free (&tsplx_data);
 }
 
 static inline
@@ -2939,16 +3354,52 @@ void psx_parse_note_title (struct psx_parser_state_t *ps, sstring_t *title, bool
     // TODO: Validate that the title has no inline tags.
 }
 
+// Title of the note, without setting up a parser. This runs for every note
+// before anything else, to build the map from titles to notes, so it only
+// looks at the first line. It recognizes the same thing ps_next() returns as
+// a TOKEN_TYPE_TITLE token when it's the first one, for anything else it
+// returns false and parse_note_title() falls back to the tokenizer.
+// :title_scan
+bool psx_scan_note_title (char *note_text, sstring_t *title)
+{
+    char *p = note_text;
+    while (is_space(p)) p++;
+
+    if (*p != '#') return false;
+
+    int heading_number = 0;
+    while (*p == '#') {
+        heading_number++;
+        p++;
+    }
+    if (heading_number > 6) return false;
+
+    while (is_space(p)) p++;
+
+    char *start = p;
+    while (*p != '\n' && *p != '\0') p++;
+    if (*p == '\n') p++;
+
+    *title = sstr_strip(SSTRING(start, p - start));
+    return true;
+}
+
 bool parse_note_title (char *path, char *note_text, string_t *title, struct splx_data_t *sd, string_t *error_msg)
 {
     bool success = true;
 
+    // :title_scan
+    sstring_t title_s = {0};
+    if (psx_scan_note_title (note_text, &title_s)) {
+        str_set_sstr (title, &title_s);
+        return success;
+    }
+
     STACK_ALLOCATE(struct psx_parser_state_t, ps);
     ps->ctx.path = path;
     ps->ctx.sd = sd;
     ps_init (ps, note_text);
 
-    sstring_t title_s = {0};
     psx_parse_note_title (ps, &title_s, false);
     if (!ps->error) {
         str_set_sstr (title, &title_s);
@@ -3197,8 +3648,6 @@ struct psx_block_t* parse_note_text(mem_pool_t *pool, struct psx_parser_ctx_t *c
     }
 
     // Parse note's content
-    // NOTE: Would it be useful for performance to later have quick pass that
-    // parses the title and skips the content?.
     psx_parse (ps);
 
     if (ps->error) {
@@ -3333,7 +3782,7 @@ char* markup_to_html (
 
     // Create Links           @AUTO_MACRO(BEGIN)
     if (!note->error) {
-        psx_create_links (ctx, &note->tree);
+        psx_create_links (ctx, ba, &note->tree);
     }
     // @AUTO_MACRO(END)
 
@@ -3425,6 +3874,9 @@ void render_backlinks(struct note_runtime_t *rt, struct note_t *note)
 void render_all_backlinks(struct note_runtime_t *rt)
 {
     LINKED_LIST_FOR (struct note_t *, curr_note, rt->notes) {
+        // :build_cache
+        if (curr_note->is_up_to_date) continue;
+
         render_backlinks (rt, curr_note);
     }
 }
@@ -3475,7 +3927,7 @@ PSX_USER_TAG_CB(block_tag_handler)
             psx_parse_string (&pool_l, str_data(&tag->content), ctx, ba);
 
         if (block_content != NULL) {
-            psx_create_links (ctx, &block_content);
+            psx_create_links (ctx, ba, &block_content);
 
             psx_block_tree_user_callbacks (ctx, ba, &block_content);
 
@@ -3486,7 +3938,7 @@ PSX_USER_TAG_CB(block_tag_handler)
         }
 
 
-        string_t *html_str = html_to_string(html, &ps_inline->pool, 2);
+        string_t *html_str = html_to_string(html, &ps_inline->pool, rt_html_indent (ctx->rt));
         str_set_printf (&replacement->s, "\\html|%d|%s", str_len(html_str), str_data(html_str));
 
     } else {
@@ -3498,15 +3950,22 @@ PSX_USER_TAG_CB(block_tag_handler)
     return USER_TAG_CB_STATUS_CONTINUE;
 }
 
-PSX_USER_TAG_CB (summary_tag_handler)
+// Title and first paragraph of a note as they are in its source, before links
+// are created or user callbacks run. We can't use note->tree because those
+// phases modify it, and depending on the order notes are processed it may or
+// may not have been modified already.
+//
+// Parsing the whole note to get them is expensive, and the same note is
+// summarized from many places, so the first call parses it and the result is
+// kept in the note for the rest of the run. Returns NULL if the note can't be
+// parsed.
+//
+// CAUTION: Allocates from the note's pool, don't call it from the parallel
+// phase of note processing.
+// :note_summary
+struct psx_note_summary_t* psx_note_summary (struct note_t *note)
 {
-    struct psx_tag_t *tag = ps_parse_tag (ps_inline, NULL);
-
-    struct note_t *note = rt_get_note_by_title (&tag->content);
-    if (note != NULL) {
-        struct psx_block_t *result = NULL;
-        struct psx_block_t *result_end = NULL;
-
+    if (note->summary == NULL) {
         // We don't want this additional parsing of summarized notes to
         // interfere with the parent note. That's why we need empty_ctx and
         // empty_sd. Just passing ctx causes the parent note to get all the
@@ -3518,7 +3977,43 @@ PSX_USER_TAG_CB (summary_tag_handler)
         struct psx_block_t *note_tree = parse_note_text (&pool, empty_ctx, str_data(&note->psplx));
         splx_destroy (empty_sd);
 
-        struct psx_block_t *title = note_tree->block_content;
+        struct psx_note_summary_t *summary = mem_pool_push_struct (&note->pool, struct psx_note_summary_t);
+        *summary = ZERO_INIT (struct psx_note_summary_t);
+
+        if (note_tree != NULL) {
+            STACK_ALLOCATE (struct block_allocation_t, ba);
+            ba->pool = &note->pool;
+
+            summary->title = psx_block_new_cpy (ba, note_tree->block_content);
+
+            struct psx_block_t *after_title = note_tree->block_content->next;
+            if (after_title != NULL && after_title->type == BLOCK_TYPE_PARAGRAPH) {
+                summary->paragraph = psx_block_new_cpy (ba, after_title);
+            }
+        }
+
+        mem_pool_destroy (&pool);
+        note->summary = summary;
+    }
+
+    return note->summary->title != NULL ? note->summary : NULL;
+}
+
+PSX_USER_TAG_CB (summary_tag_handler)
+{
+    struct psx_tag_t *tag = ps_parse_tag (ps_inline, NULL);
+
+    struct note_t *note = rt_get_note_by_title (&tag->content);
+    struct psx_note_summary_t *summary = NULL;
+    if (note != NULL) {
+        summary = psx_note_summary (note);
+    }
+
+    if (summary != NULL) {
+        struct psx_block_t *result = NULL;
+        struct psx_block_t *result_end = NULL;
+
+        struct psx_block_t *title = summary->title;
         struct psx_block_t *new_title = psx_block_new_cpy (block_allocation, title);
         // NOTE: We can use inline tags because they are processed at a later step.
         str_set_printf (&new_title->inline_content, "\\note{%s}", str_data(&title->inline_content));
@@ -3529,23 +4024,28 @@ PSX_USER_TAG_CB (summary_tag_handler)
         new_title->heading_number = 2;
         LINKED_LIST_APPEND (result, new_title);
 
-        struct psx_block_t *after_title = note_tree->block_content->next;
-        if (after_title != NULL && after_title->type == BLOCK_TYPE_PARAGRAPH) {
-            struct psx_block_t *new_summary = psx_block_new_cpy (block_allocation, after_title);
+        if (summary->paragraph != NULL) {
+            struct psx_block_t *new_summary = psx_block_new_cpy (block_allocation, summary->paragraph);
             LINKED_LIST_APPEND (result, new_summary);
         }
 
-        mem_pool_destroy (&pool);
-
         psx_replace_block_multiple (block_allocation, block, result, result_end);
 
-        rt_link_entities_by_id(ctx->note->id, note->id, NULL, NULL);
+        // :build_cache
+        if (!ctx->note->is_replayed) {
+            note_add_data_op (ctx->note, NOTE_DATA_OP_SUMMARY, str_data(&tag->content), NULL, NULL);
+            rt_link_entities_by_id(ctx->note->id, note->id, NULL, NULL);
+        }
+        note_add_build_dep (ctx->note, BUILD_DEP_SUMMARY, NULL, str_data(&tag->content));
 
         // TODO: Add some user defined wrapper that allows setting a different
         // style for blocks of summary. For example if we ever get inline
         // editing from HTML we would like to disable editing in summary blocks
         // and have some UI to modify the target.
 
+    } else if (note != NULL) {
+        psx_error (ps_inline, "can't summarize note with title '%s', it has errors", str_data(&tag->content));
+
     } else {
         psx_error (ps_inline, "can't find note with title '%s'", str_data(&tag->content));
     }
@@ -3573,6 +4073,51 @@ enum psx_user_tag_cb_status_t math_tag_handler (struct psx_parser_state_t *ps_in
     return USER_TAG_CB_STATUS_CONTINUE;
 }
 
+// Renders all math tags in the block tree without modifying it, so the math
+// cache is already populated when user callbacks run. This mirrors how
+// psx_block_tree_user_callbacks() finds tags but doesn't report errors, it
+// only speeds things up. Math that only shows up after user callbacks run
+// (like the one copied by \summary) is just rendered later.
+// :katex_heap_pool
+void psx_block_tree_prerender_math (struct psx_parser_ctx_t *ctx, struct psx_block_t *block)
+{
+    if (block->block_content != NULL) {
+        LINKED_LIST_FOR (struct psx_block_t*, sub_block, block->block_content) {
+            psx_block_tree_prerender_math (ctx, sub_block);
+        }
+
+    } else {
+        struct psx_parser_state_t _ps_inline = {0};
+        struct psx_parser_state_t *ps_inline = &_ps_inline;
+        ps_inline->ctx = *ctx;
+        ps_inline->ctx.error_msg = NULL;
+        ps_init (ps_inline, str_data(&block->inline_content));
+        ps_inline->inline_tokens = psx_block_inline_tokens (block);
+
+        while (!ps_inline->scr.is_eof && !ps_inline->error) {
+            struct psx_token_t tok = ps_inline_next (ps_inline);
+            if (ps_match(ps_inline, TOKEN_TYPE_TEXT_TAG, NULL) && tok.value.len == 4 &&
+                (strncmp (tok.value.s, "math", 4) == 0 || strncmp (tok.value.s, "Math", 4) == 0)) {
+                bool is_display_mode = tok.value.s[0] == 'M';
+
+                char *original_pos;
+                struct psx_tag_t *tag = ps_parse_tag_full (&ps_inline->pool, ps_inline, &original_pos, true);
+                if (tag->has_content) {
+                    string_t res = {0};
+                    str_replace (&tag->content, "\n", " ", NULL);
+                    str_cat_math_strn (&res, is_display_mode, str_len(&tag->content), str_data(&tag->content));
+                    str_free (&res);
+
+                } else {
+                    ps_restore_pos (ps_inline, original_pos);
+                }
+            }
+        }
+
+        ps_destroy (ps_inline);
+    }
+}
+
 PSX_USER_TAG_CB(math_tag_inline_handler)
 {
     return math_tag_handler (ps_inline, replacement, false);
@@ -3616,7 +4161,7 @@ void psx_populate_internal_cb_tree (struct psx_user_tag_cb_t *tree)
 
 PSX_LATE_USER_TAG_CB(orphan_list_tag_handler)
 {
-    str_set(&html_placeholder->tag, "ul");
+    html_element_tag_set(note->html, html_placeholder, "ul");
 
     LINKED_LIST_FOR (struct note_t *, curr_note, rt->notes) {
         // TODO: Maybe use a map so we don't do an O(n) search in each iteration
@@ -3662,7 +4207,7 @@ PSX_LATE_USER_TAG_CB(orphan_list_tag_handler)
 
 PSX_LATE_USER_TAG_CB(entity_list_tag_handler)
 {
-    str_set(&html_placeholder->tag, "ul");
+    html_element_tag_set(note->html, html_placeholder, "ul");
 
     if (note->tree->data == NULL) {
         note->tree->data = splx_node_get_or_create(&rt->sd, note->id, SPLX_NODE_TYPE_OBJECT);
@@ -3709,7 +4254,7 @@ PSX_LATE_USER_TAG_CB(entity_list_tag_handler)
 
 PSX_LATE_USER_TAG_CB(virtual_list_tag_handler)
 {
-    str_set(&html_placeholder->tag, "ul");
+    html_element_tag_set(note->html, html_placeholder, "ul");
 
     LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, rt->sd.entities->floating_values) {
         struct splx_node_t *entity = curr_list_node->node;
@@ -3744,6 +4289,57 @@ PSX_LATE_USER_TAG_CB(virtual_list_tag_handler)
     }
 }
 
+// Late tags read data from the whole note base. This hashes the part of it
+// their output is generated from, so notes using them still can be cached. It
+// has to be kept in sync with the handlers above. Returns false for tags it
+// doesn't know, notes using them are rendered every time.
+// :build_cache
+bool psx_late_tag_build_hash (struct note_runtime_t *rt, char *tag_name, char *content, uint64_t *hash)
+{
+    bool is_known = true;
+
+    if (strcmp (tag_name, "orphan_list") == 0) {
+        LINKED_LIST_FOR (struct note_t *, curr_note, rt->notes) {
+            *hash = build_hash_str (*hash, curr_note->id);
+            *hash = build_hash_str (*hash, str_data(&curr_note->title));
+
+            bool is_orphan = false;
+            if (curr_note->tree != NULL) {
+                struct splx_node_list_t *backlinks = splx_node_get_attributes (curr_note->tree->data, "backlink");
+                is_orphan = backlinks == NULL && note_is_visible(curr_note);
+            }
+            *hash = build_hash (*hash, &is_orphan, sizeof(is_orphan));
+
+            struct note_t *target_note = rt_get_note_by_title (&curr_note->title);
+            *hash = build_hash_str (*hash, target_note != NULL ? target_note->id : "");
+        }
+
+        for (int i=0; i < rt->title_note_ids_len; i++) {
+            *hash = build_hash_str (*hash, rt->title_note_ids[i]);
+        }
+
+    } else if (strcmp (tag_name, "entity_list") == 0) {
+        // Entities can be sorted by any attribute, hash all of them.
+        struct splx_node_list_t *entities_of_type = splx_get_node_by_type (&rt->sd, content);
+        LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, entities_of_type) {
+            *hash = build_hash_attributes (*hash, curr_list_node->node);
+        }
+
+    } else if (strcmp (tag_name, "virtual_list") == 0) {
+        LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, rt->sd.entities->floating_values) {
+            struct splx_node_t *entity = curr_list_node->node;
+            if (splx_node_get_attribute (entity, "t:virtual_id") != NULL) {
+                *hash = build_hash_entity (*hash, entity);
+            }
+        }
+
+    } else {
+        is_known = false;
+    }
+
+    return is_known;
+}
+
 // Register callbacks
 // :late_tag_api
 #define PSX_LATE_INTERNAL_TAG_TABLE \
@@ -188,6 +188,11 @@ void set_expected_html_path (string_t *str, char *note_id)
     set_expected_path (str, note_id, ".html");
 }
 
+void set_expected_minified_html_path (string_t *str, char *note_id)
+{
+    set_expected_path (str, note_id, ".min.html");
+}
+
 struct negative_test_clsr_t {
     struct test_ctx_t *t;
     struct note_runtime_t *rt;
@@ -232,6 +237,176 @@ void cat_note_tsplx_full (string_t *str, struct splx_data_t *sd, struct psx_bloc
     }
 }
 
+// is_canonical_id() replaces matching identifier_r, both must agree.
+void canonical_id_tests (struct test_ctx_t *t)
+{
+    struct {
+        char *s;
+        bool is_id;
+    } cases[] = {
+        {"23456789", true},
+        {"CFGHJMPQRVWX", true},
+        {"X2C3F4G5H6J7M8P9QRVW2345", true},
+        {"2345678", false},
+        {"", false},
+        {"2345678A", false},
+        {"1234567890", false},
+        {"cfghjmpq", false},
+        {" 23456789", false},
+        {"23456789 ", false},
+        {"23456789.png", false},
+        {"2345_6789", false},
+    };
+
+    test_push (t, "Canonical ID matches identifier_r");
+    Reprog *regex = regcomp_cached (identifier_r);
+    for (int i=0; i<ARRAY_SIZE(cases); i++) {
+        Resub m;
+        bool regex_match = !regexec (regex, cases[i].s, &m, 0);
+
+        bool is_id = is_canonical_id (cases[i].s);
+
+        test_push (t, "'%s'", cases[i].s);
+        if (!test_bool (t, is_id == cases[i].is_id && regex_match == cases[i].is_id)) {
+            test_error (t, "is_canonical_id() returned %s, identifier_r %s",
+                        is_id ? "true" : "false", regex_match ? "matches" : "doesn't match");
+        }
+    }
+    test_pop_parent (t);
+}
+
+// fwrite_js_string() looks for characters to escape 8 bytes at a time, each
+// case is also tested at all offsets from an 8 byte boundary.
+void js_string_tests (struct test_ctx_t *t)
+{
+    struct {
+        char *name;
+        char *s;
+        size_t len;
+        char quote;
+        char *expected;
+    } cases[] = {
+        {"plain", "abc", 3, '"', "abc"},
+        {"double quote", "a\"b", 3, '"', "a\\\"b"},
+        {"single quote", "a'b\"", 4, '\'', "a\\'b\""},
+        {"backslash", "a\\b", 3, '"', "a\\\\b"},
+        {"newline, return and tab", "\n\r\t", 3, '"', "\\n\\r\\t"},
+        {"control characters", "\x01\x1f\x7f", 3, '"', "\\u0001\\u001f\x7f"},
+        {"null byte", "a\0b", 3, '"', "a\\u0000b"},
+        {"U+2028", "a\xe2\x80\xa8" "b", 5, '"', "a\\u2028b"},
+        {"U+2029", "\xe2\x80\xa9", 3, '"', "\\u2029"},
+        {"other 0xE2 sequences", "\xe2\x82\xac\xe2\x80\xa7", 6, '"', "\xe2\x82\xac\xe2\x80\xa7"},
+        {"truncated U+2028", "\xe2\x80", 2, '"', "\xe2\x80"},
+        {"non ASCII", "\xc3\xb1\xf0\x9f\x98\x80", 6, '"', "\xc3\xb1\xf0\x9f\x98\x80"},
+    };
+
+    test_push (t, "JavaScript string escaping");
+    for (int i=0; i<ARRAY_SIZE(cases); i++) {
+        bool success = true;
+        char s[64];
+        string_t expected = {0};
+
+        test_push (t, "%s", cases[i].name);
+        for (int padding=0; success && padding<16; padding++) {
+            // Not a string_t because some cases contain null bytes.
+            size_t s_len = 0;
+            memset (s + s_len, 'x', padding);
+            s_len += padding;
+            memcpy (s + s_len, cases[i].s, cases[i].len);
+            s_len += cases[i].len;
+            memset (s + s_len, 'y', padding);
+            s_len += padding;
+
+            str_set (&expected, "");
+            str_cat_char (&expected, cases[i].quote, 1);
+            str_cat_char (&expected, 'x', padding);
+            str_cat_c (&expected, cases[i].expected);
+            str_cat_char (&expected, 'y', padding);
+            str_cat_char (&expected, cases[i].quote, 1);
+
+            char *result = NULL;
+            size_t result_len = 0;
+            FILE *f = open_memstream (&result, &result_len);
+            fwrite_js_string (f, cases[i].quote, s, s_len);
+            fclose (f);
+
+            success = result_len == str_len(&expected) &&
+                memcmp (result, str_data(&expected), result_len) == 0;
+            if (!success) {
+                test_error_current (t, "padding %d: got %s, expected %s", padding, result, str_data(&expected));
+            }
+
+            free (result);
+        }
+        test_bool (t, success);
+
+        str_free (&expected);
+    }
+    test_pop_parent (t);
+}
+
+// psx_scan_note_title() must return the same title ps_next() would, and return
+// false when ps_next() doesn't find a title. Expected titles are NULL if
+// there's no title.
+void note_title_scan_tests (struct test_ctx_t *t)
+{
+    struct {
+        char *name;
+        char *text;
+        char *expected;
+    } cases[] = {
+        {"simple", "# Title\n\nBody", "Title"},
+        {"no newline", "# Title", "Title"},
+        {"no space after #", "#Title\n", "Title"},
+        {"surrounding spaces", "#\t Title   \n", "Title"},
+        {"# inside title", "# A # B\n", "A # B"},
+        {"indented", "  # Title\n", "Title"},
+        {"indented with tab", "\t# Title\n", "Title"},
+        {"indented 8 spaces", "        # Title\n", "Title"},
+        {"######", "###### Title\n", "Title"},
+        {"#######", "####### Title\n", NULL},
+        {"empty #", "#\n", ""},
+        {"empty # at end", "#", ""},
+        {"empty # with spaces", "# \n", ""},
+        {"empty # then heading", "#\n# Title\n", ""},
+        {"leading blank line", "\n# Title\n", NULL},
+        {"leading blank lines with spaces", "\n \n\t# Title\n", NULL},
+        {"no title", "Title\n", NULL},
+        {"empty note", "", NULL},
+    };
+
+    test_push (t, "Note title scanner matches tokenizer");
+    for (int i=0; i<ARRAY_SIZE(cases); i++) {
+        sstring_t scanned = {0};
+        bool is_scanned = psx_scan_note_title (cases[i].text, &scanned);
+
+        string_t error_msg = {0};
+        sstring_t parsed = {0};
+        STACK_ALLOCATE(struct psx_parser_state_t, ps);
+        ps->ctx.error_msg = &error_msg;
+        ps_init (ps, cases[i].text);
+        psx_parse_note_title (ps, &parsed, false);
+        bool is_parsed = !ps->error;
+
+        bool success = is_scanned == is_parsed && is_scanned == (cases[i].expected != NULL);
+        if (success && is_scanned) {
+            sstring_t expected = SSTRING_C(cases[i].expected);
+            success = sstr_equals (&scanned, &expected) && sstr_equals (&parsed, &expected);
+        }
+
+        test_push (t, "%s", cases[i].name);
+        if (!test_bool (t, success)) {
+            test_error (t, "scanner: %s '%.*s', tokenizer: %s '%.*s'",
+                        is_scanned ? "title" : "no title", scanned.len, scanned.s,
+                        is_parsed ? "title" : "no title", parsed.len, parsed.s);
+        }
+
+        ps_destroy (ps);
+        str_free (&error_msg);
+    }
+    test_pop_parent (t);
+}
+
 int main(int argc, char** argv)
 {
     mem_pool_t pool = {0};
@@ -256,6 +431,10 @@ int main(int argc, char** argv)
         test_pop (t, success);
     }
 
+    canonical_id_tests (t);
+    js_string_tests (t);
+    note_title_scan_tests (t);
+
     __g_note_runtime = ZERO_INIT (struct note_runtime_t);
     struct note_runtime_t *rt = &__g_note_runtime;
 
@@ -264,9 +443,12 @@ int main(int argc, char** argv)
     STACK_ALLOCATE (struct cli_ctx_t, cli_ctx);
     bool tsplx_out = get_cli_bool_opt_ctx (cli_ctx, "--tsplx", argv, argc);
     bool html_out = get_cli_bool_opt_ctx (cli_ctx, "--html", argv, argc);
+    bool minify = get_cli_bool_opt_ctx (cli_ctx, "--minify", argv, argc);
     bool blocks_out = get_cli_bool_opt_ctx (cli_ctx, "--blocks", argv, argc);
     bool no_output = get_cli_bool_opt_ctx (cli_ctx, "--none", argv, argc);
     t->show_all_children = get_cli_bool_opt_ctx (cli_ctx, "--full", argv, argc);
+    char *jobs = get_cli_arg_opt_ctx (cli_ctx, "--jobs", argv, argc);
+    if (jobs != NULL) rt->jobs = atoi(jobs);
     char *note_id = get_cli_no_opt_arg (cli_ctx, argv, argc);
 
     bool notes_processed = true;
@@ -335,9 +517,46 @@ int main(int argc, char** argv)
                 test_str (t, str_data(&html_str), expected_html);
                 str_free(&html_str);
 
+                // This is how weaver writes note files, without going through
+                // a string_t.
+                if (note->html != NULL) {
+                    test_push (t, "Streamed HTML matches expected HTML");
+
+                    FILE *tmp = tmpfile ();
+                    struct html_writer_t *w = malloc (sizeof(struct html_writer_t));
+                    html_writer_init_fd (w, fileno(tmp));
+                    html_write (w, note->html, 2);
+                    html_writer_flush (w);
+
+                    long streamed_len = ftell (tmp);
+                    char *streamed_html = calloc (streamed_len + 1, 1);
+                    rewind (tmp);
+                    size_t bytes_read = fread (streamed_html, 1, streamed_len, tmp);
+
+                    test_bool (t, !w->error && bytes_read == streamed_len && strcmp (streamed_html, expected_html) == 0);
+
+                    free (streamed_html);
+                    free (w);
+                    fclose (tmp);
+                }
+
                 free (expected_html);
             }
 
+            // :minify
+            set_expected_minified_html_path (&buff, note->id);
+            if (path_exists (str_data(&buff)) && note->html != NULL) {
+                char *expected_minified_html = full_file_read (NULL, str_data(&buff), NULL);
+
+                test_push (t, "Matches expected minified HTML");
+                string_t html_str = {0};
+                str_cat_html (&html_str, note->html, HTML_MINIFY);
+                test_str (t, str_data(&html_str), expected_minified_html);
+                str_free(&html_str);
+
+                free (expected_minified_html);
+            }
+
             test_pop_parent(t);
 
             set_expected_tsplx_path (&buff, note->id);
@@ -360,7 +579,7 @@ int main(int argc, char** argv)
             if (!note->error) {
                 if (html_out) {
                     string_t html_str = {0};
-                    str_cat_html (&html_str, note->html, 2);
+                    str_cat_html (&html_str, note->html, minify ? HTML_MINIFY : 2);
                     printf ("%s", str_data(&html_str));
                     str_free(&html_str);
 
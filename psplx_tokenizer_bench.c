@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+#include "lib/cJSON.h"
+
+#include "common.h"
+#include "scanner.c"
+#include "binary_tree.c"
+#include "cli_parser.c"
+#include "html_builder.h"
+#include "automacros.h"
+
+#include "file_utility.h"
+#include "block.h"
+#include "note_runtime.h"
+
+#include "psplx_parser.c"
+#include "note_runtime.c"
+
+#include <time.h>
+
+// Throughput of the PSPLX tokenizers over a directory of notes. The block
+// tokenizer (ps_next()) is what parse_note_text() runs over the whole note,
+// the inline tokenizer (ps_inline_next()) is what runs over the content of
+// each block. Here the inline one runs over the whole note so both see the
+// same text.
+//
+// The fingerprint hashes the type, value and position of every token, it's
+// computed in a separate pass that isn't timed. It must not change when
+// changing the tokenizers' implementation.
+// :tokenizer_fast_path
+
+double wall_time_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+struct bench_notes_t {
+    mem_pool_t pool;
+    int len;
+    char **texts;
+    uint64_t total_len;
+};
+
+ITERATE_DIR_CB (load_note)
+{
+    struct bench_notes_t *notes = (struct bench_notes_t*)data;
+    if (is_dir) return;
+
+    uint64_t len = 0;
+    char *text = full_file_read (&notes->pool, fname, &len);
+    if (text == NULL) return;
+
+    notes->texts = realloc (notes->texts, (notes->len+1)*sizeof(char*));
+    notes->texts[notes->len++] = text;
+    notes->total_len += len;
+}
+
+static inline
+void token_hash (uint64_t *hash, struct psx_parser_state_t *ps, struct psx_token_t *tok)
+{
+    if (hash == NULL) return;
+
+    int data[] = {tok->type, tok->value.len, tok->margin, tok->coalesced_spaces,
+                  PS_SCR->line_number, PS_SCR->column_number, PS_SCR->is_eof};
+    *hash = build_hash (*hash, data, sizeof(data));
+    *hash = build_hash (*hash, tok->value.s, tok->value.len);
+}
+
+// Returns the number of tokens. If hash isn't NULL the tokens are hashed into
+// it.
+int block_tokenize (char *text, uint64_t *hash)
+{
+    int num_tokens = 0;
+
+    STACK_ALLOCATE (struct psx_parser_state_t, ps);
+    ps_init (ps, text);
+    while (!PS_SCR->is_eof) {
+        struct psx_token_t tok = ps_next (ps);
+        token_hash (hash, ps, &tok);
+        num_tokens++;
+    }
+    ps_destroy (ps);
+
+    return num_tokens;
+}
+
+int inline_tokenize (char *text, uint64_t *hash)
+{
+    int num_tokens = 0;
+
+    STACK_ALLOCATE (struct psx_parser_state_t, ps);
+    ps_init (ps, text);
+    while (!PS_SCR->is_eof) {
+        char *start = scr_pos(PS_SCR);
+        struct psx_token_t tok = ps_inline_next (ps);
+        token_hash (hash, ps, &tok);
+        num_tokens++;
+
+        if (scr_pos(PS_SCR) == start && !PS_SCR->is_eof) break;
+    }
+    ps_destroy (ps);
+
+    return num_tokens;
+}
+
+void bench (char *name, struct bench_notes_t *notes, int iterations, int (*tokenize)(char*, uint64_t*))
+{
+    uint64_t fingerprint = BUILD_HASH_INIT;
+    for (int i=0; i<notes->len; i++) {
+        tokenize (notes->texts[i], &fingerprint);
+    }
+
+    int num_tokens = 0;
+    double start = wall_time_ms ();
+    for (int it=0; it<iterations; it++) {
+        num_tokens = 0;
+        for (int i=0; i<notes->len; i++) {
+            num_tokens += tokenize (notes->texts[i], NULL);
+        }
+    }
+    double time = wall_time_ms () - start;
+
+    printf ("%-7s %.1f MB/s, %d tokens, fingerprint %016" PRIx64 "\n",
+            name, (notes->total_len*(double)iterations)/(time*1000.0), num_tokens, fingerprint);
+}
+
+int main (int argc, char **argv)
+{
+    char *notes_path = "tests/example/notes";
+    char *path_str = get_cli_arg_opt ("--notes", argv, argc);
+    if (path_str != NULL) notes_path = path_str;
+
+    int iterations = 10;
+    char *iterations_str = get_cli_arg_opt ("--iterations", argv, argc);
+    if (iterations_str != NULL) iterations = atoi (iterations_str);
+
+    STACK_ALLOCATE (struct bench_notes_t, notes);
+    iterate_dir (notes_path, load_note, notes);
+    if (notes->len == 0) {
+        printf ("no notes in '%s'\n", notes_path);
+        return 1;
+    }
+
+    printf ("%d notes, %" PRIu64 " bytes\n", notes->len, notes->total_len);
+    bench ("block", notes, iterations, block_tokenize);
+    bench ("inline", notes, iterations, inline_tokenize);
+
+    free (notes->texts);
+    mem_pool_destroy (&notes->pool);
+
+    return 0;
+}
@@ -301,7 +301,7 @@ def generate_public ():
 
 def publish ():
     if generate_common(target=public_out_dir):
-        ex (f'./bin/weaver generate --static --public --verbose --output-dir {public_out_dir}')
+        ex (f'./bin/weaver generate --static --public --minify --verbose --output-dir {public_out_dir}')
         ex ('rclone sync --fast-list --checksum ~/.cache/weaver/public/ aws-s3:weaver.thrachyon.net/santileortiz/');
 
         ex (f'./bin/weaver generate --custom blog --public --verbose --output-dir {blog_out_dir}')
@@ -359,11 +359,29 @@ C_FLAGS = modes[mode]
 def check_js_toggle():
     return get_cli_persistent_toggle ('use_js', '--js-enable', '--js-disable', True)
 
+# Parsing and compiling katex.min.js takes longer than everything else a
+# single note run does, so builds with javascript embed its precompiled
+# bytecode instead. See katex_dump.c.
+# :katex_bytecode
+katex_bytecode_header = 'bin/katex_bytecode.h'
+def katex_bytecode_build():
+    status = 0
+    if c_needs_rebuild ('katex_dump.c', 'bin/katex_dump'):
+        status = ex (f'gcc {C_FLAGS} -pthread -o bin/katex_dump katex_dump.c lib/duktape.c -lm -lrt')
+
+    if status == 0:
+        status = ex (f'./bin/katex_dump static/lib/katex/katex.min.js {katex_bytecode_header}')
+
+    return status
+
 def common_build(c_sources, out_fname, use_js, subprocess_test=True):
     global C_FLAGS
 
     if use_js:
         c_sources += " lib/duktape.c"
+
+        if katex_bytecode_build() == 0:
+            C_FLAGS += f" -DKATEX_BYTECODE='\"{katex_bytecode_header}\"'"
     else:
         C_FLAGS += " -DNO_JS"
 
@@ -374,7 +392,7 @@ def common_build(c_sources, out_fname, use_js, subprocess_test=True):
 
     generate_automacros ('automacros.h')
 
-    return ex (f'gcc {C_FLAGS} -o {out_fname} {c_sources} -lm -lrt')
+    return ex (f'gcc {C_FLAGS} -pthread -o {out_fname} {c_sources} -lm -lrt')
 
 def weaver_build (use_js):
     return common_build ("weaver.c", 'bin/weaver', use_js)
@@ -404,6 +422,18 @@ def tsplx_parser_tests():
 
     return common_build ("tsplx_parser_tests.c", 'bin/tsplx_parser_tests', False, subprocess_test)
 
+def binary_tree_bench():
+    return common_build ("binary_tree_bench.c", 'bin/binary_tree_bench', False)
+
+def psplx_tokenizer_bench():
+    return common_build ("psplx_tokenizer_bench.c", 'bin/psplx_tokenizer_bench', False)
+
+def tsplx_lexer_bench():
+    return common_build ("tsplx_lexer_bench.c", 'bin/tsplx_lexer_bench', False)
+
+def katex_bench():
+    return ex (f'gcc {C_FLAGS} -pthread -o bin/katex_bench katex_bench.c lib/duktape.c -lm -lrt')
+
 def cloc():
     ex ('cloc --exclude-list-file=.clocignore .')
 
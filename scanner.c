@@ -2,6 +2,10 @@
  * Copyright (C) 2022 Santiago León O.
  */
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 struct scanner_t {
     char *str;
     char *pos;
@@ -168,6 +172,60 @@ bool scr_match_double_quoted_string (struct scanner_t *scr)
     return found;
 }
 
+// Finding the end of a line one character at a time with scr_advance_char() is
+// what most of the time tokenizing notes went into. These find the next \n or
+// \0 16 or 32 bytes at a time. Loads are aligned so they never cross into the
+// next page, which makes it safe to read past the terminating \0. That's still
+// reading outside of the string as far as AddressSanitizer is concerned, so
+// it's disabled for these.
+// :tokenizer_fast_path
+#if defined(__AVX2__)
+#define SCR_CHUNK_SIZE 32
+#define scr_chunk_t __m256i
+#define scr_chunk_load(p) _mm256_load_si256(p)
+#define scr_chunk_eq(chunk,c) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c))))
+
+#elif defined(__SSE2__)
+#define SCR_CHUNK_SIZE 16
+#define scr_chunk_t __m128i
+#define scr_chunk_load(p) _mm_load_si128(p)
+#define scr_chunk_eq(chunk,c) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c))))
+#endif
+
+#if defined(SCR_CHUNK_SIZE)
+// Calls MASK_FUNC on each aligned chunk starting with the one containing str,
+// until one returns a bit set for a byte at or after str. Evaluates to a
+// pointer to that byte.
+#define SCR_CHUNK_FIND(str,MASK_FUNC)                                          \
+({                                                                             \
+    uintptr_t _offset = (uintptr_t)(str) % SCR_CHUNK_SIZE;                     \
+    const scr_chunk_t *_chunk = (const scr_chunk_t*)((str) - _offset);         \
+    uint32_t _mask = MASK_FUNC(scr_chunk_load(_chunk)) & (UINT32_MAX << _offset); \
+    while (_mask == 0) {                                                       \
+        _chunk++;                                                              \
+        _mask = MASK_FUNC(scr_chunk_load(_chunk));                             \
+    }                                                                          \
+    (char*)_chunk + __builtin_ctz(_mask);                                      \
+})
+
+static inline
+uint32_t scr_line_end_mask (scr_chunk_t chunk)
+{
+    return scr_chunk_eq(chunk, '\n') | scr_chunk_eq(chunk, '\0');
+}
+#endif
+
+__attribute__((no_sanitize_address))
+char* scr_line_end (char *str)
+{
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, scr_line_end_mask);
+#else
+    while (*str != '\n' && *str != '\0') str++;
+    return str;
+#endif
+}
+
 // NOTE: The resulting sstring_t does include the first found \n character.
 // This has been relevant because this character may trigger different
 // behaviors sometimes they are ignored, sometimes they are replaced with
@@ -176,8 +234,22 @@ bool scr_match_double_quoted_string (struct scanner_t *scr)
 sstring_t scr_advance_line(struct scanner_t *scr)
 {
     char *start = scr->pos;
-    while (!scr->is_eof && scr_curr_char(scr) != '\n') {
-        scr_advance_char (scr);
+
+    // Same as calling scr_advance_char() until reaching \n or \0. None of the
+    // characters before it is a \n so only the column changes, unless we
+    // arrive at one.
+    // :tokenizer_fast_path
+    if (!scr->is_eof) {
+        char *end = scr_line_end (scr->pos);
+        if (end != scr->pos) {
+            scr->column_number += end - scr->pos;
+            scr->pos = end;
+
+            if (*end == '\n') {
+                scr->line_number++;
+                scr->column_number = 0;
+            }
+        }
     }
 
     scr_advance_char (scr);
@@ -140,8 +140,15 @@ function copy_note_cmd ()
     let open_note = opened_notes[opened_notes.length-1]
 
     let psplx = "";
+    // The shard of an open virtual entity was loaded when it was opened. If it's
+    // still being fetched, copy the command without the PSPLX.
+    let entity = undefined;
     if (open_note[0] === "virtual") {
-        let unescaped = virtual_entities[open_note[1]].psplx;
+        entity = get_virtual_entity(open_note[1]);
+    }
+
+    if (entity !== undefined) {
+        let unescaped = entity.psplx;
         unescaped = unescaped.replace("\n", "\\n");
         unescaped = unescaped.replace("\"", "\\\"");
         unescaped = unescaped.replace("#", "\\#");
@@ -168,6 +175,41 @@ function get_note_and_run (note_id, callback)
     )
 }
 
+// Virtual entity data is split into shards, data.js only has the shard of each
+// entity and its title. Shards are fetched the first time one of their entities
+// is opened and kept here afterwards.
+// :virtual_shards
+let virtual_shards = {};
+
+function get_virtual_entity (note_id)
+{
+    let shard = virtual_shards[virtual_entities[note_id].shard];
+    if (shard === undefined || shard instanceof Promise) {
+        return undefined;
+    }
+    return shard[note_id];
+}
+
+function get_virtual_entity_and_run (note_id, callback)
+{
+    let shard_idx = virtual_entities[note_id].shard;
+    if (virtual_shards[shard_idx] === undefined) {
+        virtual_shards[shard_idx] = fetch("virtual/" + shard_idx + ".json")
+            .then(response => response.json())
+            .then(shard => {
+                virtual_shards[shard_idx] = shard;
+                return shard;
+            });
+    }
+
+    Promise.resolve(virtual_shards[shard_idx])
+        .then(shard => callback(shard[note_id]))
+        .catch(error => {
+            delete virtual_shards[shard_idx];
+            console.error('Error:', error);
+        });
+}
+
 function set_breadcrumbs()
 {
     var breadcrumbs = document.getElementById("breadcrumbs");
@@ -273,10 +315,14 @@ function open_virtual_entity(note_id)
     let expanded_note = document.querySelector(".note");
     expanded_note.innerHTML = '';
 
-    let note_container = document.getElementById("note-container");
-    note_text_to_element(note_container, note_id, virtual_entities[note_id].html);
-    set_breadcrumbs();
-    push_state();
+    get_virtual_entity_and_run (note_id,
+        function(entity) {
+            let note_container = document.getElementById("note-container");
+            note_text_to_element(note_container, note_id, entity.html);
+            set_breadcrumbs();
+            push_state();
+        }
+    );
 
     return false;
 }
@@ -340,9 +386,13 @@ function navigate_to_current_url()
             )
 
         } else if (note_type === "virtual") {
-            let note_container = document.getElementById("note-container")
-            note_text_to_element(note_container, note_id, virtual_entities[note_id].html)
-            set_breadcrumbs();
+            get_virtual_entity_and_run (note_id,
+                function(entity) {
+                    let note_container = document.getElementById("note-container")
+                    note_text_to_element(note_container, note_id, entity.html)
+                    set_breadcrumbs();
+                }
+            )
         }
 
     } else {
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2021 Santiago León O.
+ */
+#include "lib/cJSON.h"
+
+#include "common.h"
+#include "scanner.c"
+#include "binary_tree.c"
+#include "cli_parser.c"
+
+#define ATTRIBUTE_PLACEHOLDER
+#include "tsplx_parser.c"
+
+#include <time.h>
+
+// Throughput of the TSPLX lexer over all .tsplx files in a directory, repeated
+// enough times to get something the size of a large metadata.tsplx. It
+// compares tps_next() with a copy of it that advances one character at a time,
+// which is how tps_next() worked before it had fast paths. Both must produce
+// the same tokens, at the same lines and columns.
+// :tsplx_lexer_fast_path
+
+double wall_time_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+// 64 bit FNV-1a, same as build_hash() in note_runtime.h.
+uint64_t fingerprint_add (uint64_t hash, void *data, size_t len)
+{
+    unsigned char *bytes = (unsigned char*)data;
+    for (size_t i=0; i<len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+ITERATE_DIR_CB (load_tsplx)
+{
+    string_t *corpus = (string_t*)data;
+    if (is_dir) return;
+
+    char *extension = get_extension (fname);
+    if (extension == NULL || strcmp (extension, "tsplx") != 0) return;
+
+    mem_pool_t pool = {0};
+    char *text = full_file_read (&pool, fname, NULL);
+    if (text != NULL) {
+        str_cat_c (corpus, text);
+        str_cat_c (corpus, "\n");
+    }
+    mem_pool_destroy (&pool);
+}
+
+static inline
+bool ref_tps_is_identifier_char (struct tsplx_parser_state_t *tps)
+{
+    return !tps_is_eof(tps) && !char_in_str(tps_curr_char(tps), ";,.[]{}()=") &&
+        !tps_is_space(tps) && tps_curr_char(tps) != '\n';
+}
+
+static inline
+bool ref_tps_is_digit (struct tsplx_parser_state_t *tps)
+{
+    return !tps_is_eof(tps) && char_in_str(tps_curr_char(tps), "1234567890");
+}
+
+static inline
+bool ref_tps_match_digits (struct tsplx_parser_state_t *tps)
+{
+    char *pos = tps->pos;
+    int column_number = tps->column_number;
+    int line_number = tps->line_number;
+
+    bool found = false;
+    if (ref_tps_is_digit(tps)) {
+        found = true;
+        while (ref_tps_is_digit(tps)) {
+            tps_advance_char (tps);
+        }
+    }
+
+    if (ref_tps_is_identifier_char(tps)) {
+        tps->pos = pos;
+        tps->column_number = column_number;
+        tps->line_number = line_number;
+        found = false;
+    }
+
+    return found;
+}
+
+sstring_t ref_tps_advance_line(struct tsplx_parser_state_t *tps)
+{
+    char *start = tps->pos;
+    while (!tps_is_eof(tps) && tps_curr_char(tps) != '\n') {
+        tps_advance_char (tps);
+    }
+
+    tps_advance_char (tps);
+
+    return SSTRING(start, tps->pos - start);
+}
+
+void ref_tps_parse_identifier (struct tsplx_parser_state_t *tps, struct tsplx_token_t *tok)
+{
+    char *start = tps->pos;
+    while (ref_tps_is_identifier_char(tps)) {
+        tps_advance_char (tps);
+    }
+
+    tok->value = SSTRING(start, tps->pos - start);
+}
+
+struct tsplx_token_t ref_tps_next (struct tsplx_parser_state_t *tps)
+{
+    struct tsplx_token_t _tok = {0};
+    struct tsplx_token_t *tok = &_tok;
+
+    while (tps_is_space(tps) || tps_curr_char(tps) == '\n') {
+        tps_advance_char (tps);
+    }
+
+    char *non_space_pos = tps->pos;
+    if (tps_is_eof(tps)) {
+        tps->is_eof = true;
+        tok->type = TSPLX_TOKEN_TYPE_EOF;
+
+    } else if (tps_match_str(tps, "//")) {
+        tok->type = TSPLX_TOKEN_TYPE_COMMENT;
+        tok->value = ref_tps_advance_line (tps);
+
+    } else if (ref_tps_match_digits(tps)) {
+        tok->value = SSTRING(non_space_pos, tps->pos - non_space_pos);
+        tok->type = TSPLX_TOKEN_TYPE_NUMBER;
+
+    } else if (tps_match_str(tps, "<")) {
+        char *start = tps->pos;
+        while (!tps_is_eof(tps) && tps_curr_char(tps) != '>') {
+            tps_advance_char (tps);
+        }
+
+        tok->type = TSPLX_TOKEN_TYPE_URI;
+        tok->value = SSTRING(start, tps->pos - start);
+        tps_advance_char (tps);
+
+    } else if (tps_match_str(tps, "\"\"\"")) {
+        char *start = tps->pos;
+        while (!tps_is_eof(tps) && !tps_match_str(tps, "\"\"\"")) {
+            tps_advance_char (tps);
+        }
+
+        tok->type = TSPLX_TOKEN_TYPE_MULTILINE_STRING;
+        tok->value = SSTRING(start, tps->pos - start - 3);
+
+    } else if (tps_match_str(tps, "\"")) {
+        char *start = tps->pos;
+        while (!tps_is_eof(tps) && tps_curr_char(tps) != '"') {
+            tps_advance_char (tps);
+
+            if (tps_curr_char(tps) == '"' && *(tps->pos - 1) == '\\') {
+                tps_advance_char (tps);
+            }
+        }
+
+        tok->type = TSPLX_TOKEN_TYPE_STRING;
+        tok->value = SSTRING(start, tps->pos - start);
+        tps_advance_char (tps);
+
+    } else if (tps_match_str(tps, "q\"")) {
+        char *start = tps->pos;
+        while (!tps_is_eof(tps) && tps_curr_char(tps) != '"') {
+            tps_advance_char (tps);
+
+            if (tps_curr_char(tps) == '"' && *(tps->pos - 1) == '\\') {
+                tps_advance_char (tps);
+            }
+        }
+
+        tok->type = TSPLX_TOKEN_TYPE_SOFT_REFERENCE;
+        tok->value = SSTRING(start, tps->pos - start);
+        tps_advance_char (tps);
+
+    } else if (!tps_is_eof(tps) && char_in_str(tps_curr_char(tps), ";,.[]{}()=")) {
+        tok->type = TSPLX_TOKEN_TYPE_OPERATOR;
+        tok->value = SSTRING(tps->pos, 1);
+        tps_advance_char (tps);
+
+    } else if (tps_match_str(tps, "?")) {
+        ref_tps_parse_identifier (tps, tok);
+        tok->type = TSPLX_TOKEN_TYPE_VARIABLE;
+
+    } else {
+        ref_tps_parse_identifier (tps, tok);
+        tok->type = TSPLX_TOKEN_TYPE_IDENTIFIER;
+    }
+
+    tps->token = *tok;
+
+    return tps->token;
+}
+
+// Returns the number of tokens. If hash isn't NULL the tokens are hashed into
+// it.
+int tokenize (char *text, uint64_t *hash, struct tsplx_token_t (*next)(struct tsplx_parser_state_t*))
+{
+    int num_tokens = 0;
+
+    STACK_ALLOCATE (struct tsplx_parser_state_t, tps);
+    tps_init (tps, text, NULL);
+    while (!tps->is_eof) {
+        struct tsplx_token_t tok = next (tps);
+        num_tokens++;
+
+        if (hash != NULL) {
+            int data[] = {tok.type, tok.value.len, tps->line_number, tps->column_number, tps->is_eof};
+            *hash = fingerprint_add (*hash, data, sizeof(data));
+            *hash = fingerprint_add (*hash, tok.value.s, tok.value.len);
+        }
+    }
+
+    return num_tokens;
+}
+
+uint64_t bench (char *name, char *text, uint64_t text_len, int iterations, struct tsplx_token_t (*next)(struct tsplx_parser_state_t*))
+{
+    uint64_t fingerprint = 0xcbf29ce484222325ULL;
+    tokenize (text, &fingerprint, next);
+
+    int num_tokens = 0;
+    double start = wall_time_ms ();
+    for (int it=0; it<iterations; it++) {
+        num_tokens = tokenize (text, NULL, next);
+    }
+    double time = wall_time_ms () - start;
+
+    printf ("%-9s %.2f Mtokens/s, %.1f MB/s, %d tokens, fingerprint %016" PRIx64 "\n",
+            name, (num_tokens*(double)iterations)/(time*1000.0),
+            (text_len*(double)iterations)/(time*1000.0), num_tokens, fingerprint);
+
+    return fingerprint;
+}
+
+int main (int argc, char **argv)
+{
+    char *tests_path = "tests";
+    char *path_str = get_cli_arg_opt ("--tests", argv, argc);
+    if (path_str != NULL) tests_path = path_str;
+
+    int scale = 200;
+    char *scale_str = get_cli_arg_opt ("--scale", argv, argc);
+    if (scale_str != NULL) scale = atoi (scale_str);
+
+    int iterations = 10;
+    char *iterations_str = get_cli_arg_opt ("--iterations", argv, argc);
+    if (iterations_str != NULL) iterations = atoi (iterations_str);
+
+    string_t corpus = {0};
+    iterate_dir (tests_path, load_tsplx, &corpus);
+    if (str_len(&corpus) == 0) {
+        printf ("no .tsplx files in '%s'\n", tests_path);
+        return 1;
+    }
+
+    string_t text = {0};
+    for (int i=0; i<scale; i++) {
+        str_cat (&text, &corpus);
+    }
+
+    printf ("%" PRIu32 " bytes x %d\n", str_len(&corpus), scale);
+    uint64_t ref_fingerprint = bench ("reference", str_data(&text), str_len(&text), iterations, ref_tps_next);
+    uint64_t fingerprint = bench ("tps_next", str_data(&text), str_len(&text), iterations, tps_next);
+
+    bool success = ref_fingerprint == fingerprint;
+    printf ("tokens %s\n", success ? "OK" : "DIFFERENT");
+
+    str_free (&text);
+    str_free (&corpus);
+
+    return success ? 0 : 1;
+}
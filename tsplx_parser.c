@@ -2,8 +2,173 @@
  * Copyright (C) 2021 Santiago León O.
  */
 
+#include <pthread.h>
+
 #include "tsplx_parser.h"
 
+// String interning
+//
+// All SPLX data in the process shares one table, so strings of different
+// splx_data_t can also be compared by pointer. Interned strings live until the
+// process ends.
+//
+// Adding strings takes a mutex, it mostly happens while parsing, which is
+// sequential, but nothing stops a user callback from creating nodes. Lookups
+// with splx_intern_find() happen while generating HTML from several threads,
+// so they don't lock. Entries are published with atomic stores, and when the
+// table grows the old slot arrays are kept because a reader may still be
+// probing one. Together they are smaller than the current array.
+// :string_pool
+struct splx_string_table_entry_t {
+    char *str;
+    uint32_t len;
+    uint32_t hash;
+};
+
+// Open addressing with linear probing, size is a power of 2 and the table is
+// kept at most half full.
+struct splx_string_table_slots_t {
+    struct splx_string_table_slots_t *prev;
+    uint32_t size;
+    struct splx_string_table_entry_t entries[];
+};
+
+struct splx_string_table_t {
+    pthread_mutex_t mutex;
+    mem_pool_t pool;
+
+    struct splx_string_table_slots_t *slots;
+    uint32_t len;
+};
+
+struct splx_string_table_t __g_splx_strings = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static inline
+uint32_t splx_string_hash (const char *str, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i<len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the entry for str, or the empty one where it would be inserted. The
+// string the entry had when it was checked is put in entry_str_out, readers
+// that don't hold the mutex must use that one and never read entry->str
+// again, a writer may have filled the empty slot since.
+static inline
+struct splx_string_table_entry_t* splx_string_table_slot (struct splx_string_table_slots_t *slots,
+                                                          const char *str, size_t len, uint32_t hash,
+                                                          char **entry_str_out)
+{
+    uint32_t mask = slots->size - 1;
+    uint32_t i = hash & mask;
+    while (true) {
+        struct splx_string_table_entry_t *entry = &slots->entries[i];
+        char *entry_str = __atomic_load_n (&entry->str, __ATOMIC_ACQUIRE);
+        if (entry_str == NULL ||
+            (entry->hash == hash && entry->len == len && memcmp (entry_str, str, len) == 0)) {
+            if (entry_str_out != NULL) *entry_str_out = entry_str;
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static inline
+void splx_string_table_entry_set (struct splx_string_table_entry_t *entry, char *str, uint32_t len, uint32_t hash)
+{
+    entry->len = len;
+    entry->hash = hash;
+    __atomic_store_n (&entry->str, str, __ATOMIC_RELEASE);
+}
+
+void splx_string_table_grow (struct splx_string_table_t *table)
+{
+    struct splx_string_table_slots_t *old_slots = table->slots;
+    uint32_t old_size = old_slots == NULL ? 0 : old_slots->size;
+
+    uint32_t size = old_size == 0 ? 1024 : 2*old_size;
+    // Not allocated from the pool, atomics need aligned entries.
+    struct splx_string_table_slots_t *slots =
+        calloc (1, sizeof(struct splx_string_table_slots_t) + size*sizeof(struct splx_string_table_entry_t));
+    slots->prev = old_slots;
+    slots->size = size;
+
+    for (uint32_t i=0; i<old_size; i++) {
+        struct splx_string_table_entry_t *entry = &old_slots->entries[i];
+        if (entry->str != NULL) {
+            splx_string_table_entry_set (splx_string_table_slot (slots, entry->str, entry->len, entry->hash, NULL),
+                                         entry->str, entry->len, entry->hash);
+        }
+    }
+
+    __atomic_store_n (&table->slots, slots, __ATOMIC_RELEASE);
+}
+
+// Returns the interned copy of str, which is always NULL terminated. Strings
+// may contain NULL bytes, len is what's used to compare them.
+char* splx_intern (const char *str, size_t len)
+{
+    struct splx_string_table_t *table = &__g_splx_strings;
+    uint32_t hash = splx_string_hash (str, len);
+
+    pthread_mutex_lock (&table->mutex);
+
+    if (table->slots == NULL || 2*(table->len + 1) > table->slots->size) {
+        splx_string_table_grow (table);
+    }
+
+    struct splx_string_table_entry_t *entry = splx_string_table_slot (table->slots, str, len, hash, NULL);
+    if (entry->str == NULL) {
+        char *new_str = mem_pool_push_size (&table->pool, len + 1);
+        memcpy (new_str, str, len);
+        new_str[len] = '\0';
+        splx_string_table_entry_set (entry, new_str, len, hash);
+        table->len++;
+    }
+    char *result = entry->str;
+
+    pthread_mutex_unlock (&table->mutex);
+    return result;
+}
+
+char* splx_intern_c (const char *str)
+{
+    return splx_intern (str, strlen(str));
+}
+
+// Like splx_intern() but doesn't add the string if it isn't in the table. A
+// NULL result means no SPLX data has this string. Doesn't lock, see
+// :string_pool.
+char* splx_intern_find (const char *str)
+{
+    struct splx_string_table_slots_t *slots = __atomic_load_n (&__g_splx_strings.slots, __ATOMIC_ACQUIRE);
+    if (slots == NULL) return NULL;
+
+    size_t len = strlen (str);
+    char *result;
+    splx_string_table_slot (slots, str, len, splx_string_hash (str, len), &result);
+    return result;
+}
+
+void splx_node_set_strn (struct splx_node_t *node, const char *str, size_t len)
+{
+    // :string_view
+    str_set_view (&node->str, splx_intern (str, len), len);
+}
+
+static inline
+void splx_node_set_str (struct splx_node_t *node, const char *str)
+{
+    splx_node_set_strn (node, str, strlen(str));
+}
+
 void splx_destroy (struct splx_data_t *sd)
 {
     mem_pool_destroy (&sd->pool);
@@ -20,9 +185,8 @@ char* splx_get_node_id_str (struct splx_data_t *sd, char *id)
     char *node_id_str = NULL;
     struct cstr_to_splx_node_map_node_t *predicate_tree_node = NULL;
     if (!cstr_to_splx_node_map_lookup (&sd->nodes, id, &predicate_tree_node)) {
-        // TODO: Should use a string pool...
         // :string_pool
-        node_id_str = pom_strdup (&sd->pool, id);
+        node_id_str = splx_intern_c (id);
         cstr_to_splx_node_map_insert (&sd->nodes, node_id_str, NULL);
     } else {
         node_id_str = predicate_tree_node->key;
@@ -137,10 +301,34 @@ bool tps_is_eof (struct tsplx_parser_state_t *tps)
     return tps->is_eof || tps_curr_char(tps) == '\0';
 }
 
+#define TSPLX_CHAR_OPERATOR        0x1
+#define TSPLX_CHAR_SPACE           0x2
+#define TSPLX_CHAR_IDENTIFIER_END  0x4
+#define TSPLX_CHAR_DIGIT           0x8
+static const uint8_t tsplx_char_class[256] = {
+    ['0' ... '9'] = TSPLX_CHAR_DIGIT,
+
+    [';'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    [','] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['.'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['['] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    [']'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['{'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['}'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['('] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    [')'] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+    ['='] = TSPLX_CHAR_OPERATOR|TSPLX_CHAR_IDENTIFIER_END,
+
+    [' ']  = TSPLX_CHAR_SPACE|TSPLX_CHAR_IDENTIFIER_END,
+    ['\t'] = TSPLX_CHAR_SPACE|TSPLX_CHAR_IDENTIFIER_END,
+    ['\n'] = TSPLX_CHAR_SPACE|TSPLX_CHAR_IDENTIFIER_END,
+    ['\0'] = TSPLX_CHAR_IDENTIFIER_END,
+};
+
 static inline
 bool tps_is_digit (struct tsplx_parser_state_t *tps)
 {
-    return !tps_is_eof(tps) && char_in_str(tps_curr_char(tps), "1234567890");
+    return !tps_is_eof(tps) && (tsplx_char_class[(uint8_t)tps_curr_char(tps)] & TSPLX_CHAR_DIGIT);
 }
 
 static inline
@@ -152,13 +340,13 @@ bool tps_is_space (struct tsplx_parser_state_t *ps)
 static inline
 bool tps_is_operator (struct tsplx_parser_state_t *tps)
 {
-    return !tps_is_eof(tps) && char_in_str(tps_curr_char(tps), ";,.[]{}()=");
+    return !tps_is_eof(tps) && (tsplx_char_class[(uint8_t)tps_curr_char(tps)] & TSPLX_CHAR_OPERATOR);
 }
 
 static inline
 bool tps_is_identifier_char (struct tsplx_parser_state_t *tps)
 {
-    return !tps_is_eof(tps) && !tps_is_operator(tps) && !tps_is_space(tps) && tps_curr_char(tps) != '\n';
+    return !tps->is_eof && !(tsplx_char_class[(uint8_t)tps_curr_char(tps)] & TSPLX_CHAR_IDENTIFIER_END);
 }
 
 static inline
@@ -179,7 +367,129 @@ void tps_advance_char (struct tsplx_parser_state_t *tps)
     }
 }
 
+// Same as calling tps_advance_char() until reaching end. There can't be a \0
+// before end.
+// :tsplx_lexer_fast_path
+static inline
+void tps_advance_to (struct tsplx_parser_state_t *tps, char *end)
+{
+    char *last_newline = NULL;
+    char *p = tps->pos + 1;
+    while (p <= end && (p = memchr (p, '\n', end + 1 - p)) != NULL) {
+        tps->line_number++;
+        last_newline = p;
+        p++;
+    }
+
+    if (last_newline != NULL) {
+        tps->column_number = end - last_newline;
+    } else {
+        tps->column_number += end - tps->pos;
+    }
+
+    tps->pos = end;
+}
+
+// Character by character the lexer was what took most of the time loading
+// large TSPLX files. These find the end of runs of identifier characters,
+// spaces and string content a chunk at a time, like scr_line_end() does. See
+// it about reading past the end of the string.
+#if defined(SCR_CHUNK_SIZE)
+static inline
+uint32_t tps_identifier_end_mask (scr_chunk_t chunk)
+{
+    // Same characters as TSPLX_CHAR_IDENTIFIER_END in tsplx_char_class.
+    return scr_chunk_eq(chunk, ';') | scr_chunk_eq(chunk, ',') |
+        scr_chunk_eq(chunk, '.') | scr_chunk_eq(chunk, '[') |
+        scr_chunk_eq(chunk, ']') | scr_chunk_eq(chunk, '{') |
+        scr_chunk_eq(chunk, '}') | scr_chunk_eq(chunk, '(') |
+        scr_chunk_eq(chunk, ')') | scr_chunk_eq(chunk, '=') |
+        scr_chunk_eq(chunk, ' ') | scr_chunk_eq(chunk, '\t') |
+        scr_chunk_eq(chunk, '\n') | scr_chunk_eq(chunk, '\0');
+}
+
+static inline
+uint32_t tps_space_end_mask (scr_chunk_t chunk)
+{
+    uint32_t space = scr_chunk_eq(chunk, ' ') | scr_chunk_eq(chunk, '\t') | scr_chunk_eq(chunk, '\n');
+
+    // Only the low SCR_CHUNK_SIZE bits correspond to bytes of the chunk.
+    return ~space & (uint32_t)((1ULL << SCR_CHUNK_SIZE) - 1);
+}
+
+static inline
+uint32_t tps_string_end_mask (scr_chunk_t chunk)
+{
+    return scr_chunk_eq(chunk, '"') | scr_chunk_eq(chunk, '\0');
+}
+
+static inline
+uint32_t tps_uri_end_mask (scr_chunk_t chunk)
+{
+    return scr_chunk_eq(chunk, '>') | scr_chunk_eq(chunk, '\0');
+}
+#endif
+
+__attribute__((no_sanitize_address))
+char* tps_identifier_end (char *str)
+{
+    // Most identifiers are shorter than a chunk, looking them up in the table
+    // is faster than setting up the chunk comparisons.
+    for (int i=0; i<16; i++) {
+        if (tsplx_char_class[(uint8_t)str[i]] & TSPLX_CHAR_IDENTIFIER_END) return str + i;
+    }
+    str += 16;
+
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, tps_identifier_end_mask);
+#else
+    while (!(tsplx_char_class[(uint8_t)*str] & TSPLX_CHAR_IDENTIFIER_END)) str++;
+    return str;
+#endif
+}
+
+__attribute__((no_sanitize_address))
+char* tps_space_end (char *str)
+{
+    // Same as in tps_identifier_end(), most runs are a line break and some
+    // indentation.
+    for (int i=0; i<16; i++) {
+        if (!(tsplx_char_class[(uint8_t)str[i]] & TSPLX_CHAR_SPACE)) return str + i;
+    }
+    str += 16;
+
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, tps_space_end_mask);
+#else
+    while (tsplx_char_class[(uint8_t)*str] & TSPLX_CHAR_SPACE) str++;
+    return str;
+#endif
+}
+
+__attribute__((no_sanitize_address))
+char* tps_string_end (char *str)
+{
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, tps_string_end_mask);
+#else
+    while (*str != '"' && *str != '\0') str++;
+    return str;
+#endif
+}
+
+__attribute__((no_sanitize_address))
+char* tps_uri_end (char *str)
+{
+#if defined(SCR_CHUNK_SIZE)
+    return SCR_CHUNK_FIND(str, tps_uri_end_mask);
+#else
+    while (*str != '>' && *str != '\0') str++;
+    return str;
+#endif
+}
+
 // NOTE: c_str MUST be null terminated!!
+static inline
 bool tps_match_str(struct tsplx_parser_state_t *tps, char *c_str)
 {
     char *backup_pos = tps->pos;
@@ -230,8 +540,21 @@ bool tps_match_digits (struct tsplx_parser_state_t *tps)
 sstring_t tps_advance_line(struct tsplx_parser_state_t *tps)
 {
     char *start = tps->pos;
-    while (!tps_is_eof(tps) && tps_curr_char(tps) != '\n') {
-        tps_advance_char (tps);
+
+    // None of the characters before the end of the line is a \n, so only the
+    // column changes unless we arrive at one.
+    // :tsplx_lexer_fast_path
+    if (!tps->is_eof) {
+        char *end = scr_line_end (tps->pos);
+        if (end != tps->pos) {
+            tps->column_number += end - tps->pos;
+            tps->pos = end;
+
+            if (*end == '\n') {
+                tps->line_number++;
+                tps->column_number = 0;
+            }
+        }
     }
 
     // Advance over the \n character.
@@ -243,19 +566,51 @@ sstring_t tps_advance_line(struct tsplx_parser_state_t *tps)
 static inline
 void tps_consume_empty_lines (struct tsplx_parser_state_t *tps)
 {
-    while (tps_is_space(tps) || tps_curr_char(tps) == '\n') {
-        tps_advance_char (tps);
+    // :tsplx_lexer_fast_path
+    if (!tps->is_eof) {
+        tps_advance_to (tps, tps_space_end (tps->pos));
     }
 }
 
+// Advances to the " that ends the string starting at the current position, or
+// to the end of the input. A " right after \ doesn't end it.
+// :scr_match_double_quoted_string
+static inline
+void tps_advance_string (struct tsplx_parser_state_t *tps)
+{
+    // Same as calling tps_advance_char() until arriving at an unescaped ".
+    // :tsplx_lexer_fast_path
+    if (tps_is_eof(tps) || tps_curr_char(tps) == '"') return;
+
+    char *end = tps_string_end (tps->pos + 1);
+    while (*end == '"' && *(end - 1) == '\\') {
+        end = tps_string_end (end + 1);
+    }
+
+    tps_advance_to (tps, end);
+}
+
 void tps_parse_identifier (struct tsplx_parser_state_t *tps, struct tsplx_token_t *tok)
 {
     char *start = tps->pos;
     // TODO: Maybe better define a set of valid identifier characters?.
     // Reserve : for prefixes, don't allow identifiers starting with
     // numbers.
-    while (tps_is_identifier_char(tps)) {
-        tps_advance_char (tps);
+
+    // Same as calling tps_advance_char() while tps_is_identifier_char(). A \n
+    // ends the identifier so it can only be the character we arrive at.
+    // :tsplx_lexer_fast_path
+    if (!tps->is_eof) {
+        char *end = tps_identifier_end (tps->pos);
+        if (end != tps->pos) {
+            tps->column_number += end - tps->pos;
+            tps->pos = end;
+
+            if (*end == '\n') {
+                tps->line_number++;
+                tps->column_number = 0;
+            }
+        }
     }
 
     tok->value = SSTRING(start, tps->pos - start);
@@ -284,8 +639,8 @@ struct tsplx_token_t tps_next (struct tsplx_parser_state_t *tps)
 
     } else if (tps_match_str(tps, "<")) {
         char *start = tps->pos;
-        while (!tps_is_eof(tps) && tps_curr_char(tps) != '>') {
-            tps_advance_char (tps);
+        if (!tps->is_eof) {
+            tps_advance_to (tps, tps_uri_end (tps->pos));
         }
 
         tok->type = TSPLX_TOKEN_TYPE_URI;
@@ -305,14 +660,7 @@ struct tsplx_token_t tps_next (struct tsplx_parser_state_t *tps)
 
     } else if (tps_match_str(tps, "\"")) {
         char *start = tps->pos;
-        // :scr_match_double_quoted_string
-        while (!tps_is_eof(tps) && tps_curr_char(tps) != '"') {
-            tps_advance_char (tps);
-
-            if (tps_curr_char(tps) == '"' && *(tps->pos - 1) == '\\') {
-                tps_advance_char (tps);
-            }
-        }
+        tps_advance_string (tps);
 
         tok->type = TSPLX_TOKEN_TYPE_STRING;
         tok->value = SSTRING(start, tps->pos - start);
@@ -322,13 +670,7 @@ struct tsplx_token_t tps_next (struct tsplx_parser_state_t *tps)
 
     } else if (tps_match_str(tps, "q\"")) {
         char *start = tps->pos;
-        while (!tps_is_eof(tps) && tps_curr_char(tps) != '"') {
-            tps_advance_char (tps);
-
-            if (tps_curr_char(tps) == '"' && *(tps->pos - 1) == '\\') {
-                tps_advance_char (tps);
-            }
-        }
+        tps_advance_string (tps);
 
         tok->type = TSPLX_TOKEN_TYPE_SOFT_REFERENCE;
         tok->value = SSTRING(start, tps->pos - start);
@@ -453,10 +795,71 @@ struct splx_node_t* splx_node_new (struct splx_data_t *sd)
 {
     struct splx_node_t *new_node = mem_pool_push_struct (&sd->pool, struct splx_node_t);
     *new_node = ZERO_INIT (struct splx_node_t);
-    str_pool (&sd->pool, &new_node->str);
+
+    // Without this, the attribute map of each node would allocate nodes from a
+    // pool of its own, with a bin of at least MEM_POOL_DEFAULT_MIN_BIN_SIZE.
+    new_node->attributes.pool = &sd->pool;
     return new_node;
 }
 
+// :entity_index
+void splx_entity_index_add (struct splx_data_t *sd, struct splx_entity_index_t *index,
+                            struct splx_node_t *entity, struct splx_node_t *value)
+{
+    if (index->pool == NULL) index->pool = &sd->pool;
+
+    struct splx_entity_index_list_t *list = splx_entity_index_get (index, str_data(&value->str));
+    if (list == NULL) {
+        list = mem_pool_push_struct (&sd->pool, struct splx_entity_index_list_t);
+        *list = ZERO_INIT (struct splx_entity_index_list_t);
+
+        // Node strings are interned, no need to copy them. :string_pool
+        splx_entity_index_insert (index, str_data(&value->str), list);
+    }
+
+    struct splx_entity_index_entry_t *entry = mem_pool_push_struct (&sd->pool, struct splx_entity_index_entry_t);
+    *entry = ZERO_INIT (struct splx_entity_index_entry_t);
+    entry->entity = entity;
+    entry->value = value;
+
+    if (list->entries_end == NULL || list->entries_end->entity->entity_idx <= entity->entity_idx) {
+        LINKED_LIST_APPEND (list->entries, entry);
+
+    } else {
+        // The attribute was added to an entity that was created before the
+        // last one in the list. Not common, most attributes are set right
+        // after creating the entity.
+        struct splx_entity_index_entry_t **pos = &list->entries;
+        while ((*pos)->entity->entity_idx <= entity->entity_idx) {
+            pos = &(*pos)->next;
+        }
+
+        entry->next = *pos;
+        *pos = entry;
+    }
+}
+
+// Must be called with the value list elements added to an attribute of node.
+// Values of nodes that aren't entities yet are indexed by splx_node_add().
+void splx_entity_index_values (struct splx_data_t *sd, struct splx_node_t *node, char *predicate, struct splx_node_list_t *values)
+{
+    if (node->entity_idx == 0) return;
+
+    struct splx_entity_index_t *index = NULL;
+    if (strcmp (predicate, "a") == 0) {
+        index = &sd->type_index;
+
+    } else if (strcmp (predicate, "name") == 0) {
+        index = &sd->name_index;
+    }
+
+    if (index != NULL) {
+        LINKED_LIST_FOR (struct splx_node_list_t *, curr_value, values) {
+            splx_entity_index_add (sd, index, node, curr_value->node);
+        }
+    }
+}
+
 void splx_node_add (struct splx_data_t *sd, struct splx_node_t *node)
 {
     // Don't reuse literal nodes.
@@ -482,6 +885,13 @@ void splx_node_add (struct splx_data_t *sd, struct splx_node_t *node)
 
         struct splx_node_list_t *list_node = tps_wrap_in_list_node (sd, node);
         LINKED_LIST_APPEND (sd->entities->floating_values, list_node);
+
+        // :entity_index
+        if (node->entity_idx == 0) {
+            node->entity_idx = ++sd->entities_len;
+            splx_entity_index_values (sd, node, "a", splx_node_get_attributes (node, "a"));
+            splx_entity_index_values (sd, node, "name", splx_node_get_attributes (node, "name"));
+        }
     }
 }
 
@@ -489,7 +899,7 @@ struct splx_node_t* splx_node (struct splx_data_t *sd, char *c_str, enum splx_no
 {
     struct splx_node_t *node = splx_node_new (sd);
 
-    if (c_str != NULL) str_set (&node->str, c_str);
+    if (c_str != NULL) splx_node_set_str (node, c_str);
     node->type = type;
     splx_node_add (sd, node);
 
@@ -499,10 +909,14 @@ struct splx_node_t* splx_node (struct splx_data_t *sd, char *c_str, enum splx_no
 void splx_node_clear (struct splx_node_t *node)
 {
     node->type = SPLX_NODE_TYPE_UNKNOWN;
-    strn_set (&node->str, "", 0);
+    node->str = ZERO_INIT (string_t);
 
+    // Attribute map nodes belong to the pool of the SPLX data, they're freed
+    // with it.
+    mem_pool_t *pool = node->attributes.pool;
     cstr_to_splx_node_list_map_destroy (&node->attributes);
     node->attributes = ZERO_INIT (struct cstr_to_splx_node_list_map_t);
+    node->attributes.pool = pool;
 
     node->floating_values = NULL;
     node->floating_values_end = NULL;
@@ -518,7 +932,7 @@ struct splx_node_t* splx_node_get_or_create (struct splx_data_t *sd,
         subject_node = cstr_to_splx_node_map_get (&sd->nodes, id);
         if (subject_node == NULL) {
             subject_node = splx_node_new (sd);
-            str_set (&subject_node->str, id);
+            splx_node_set_str (subject_node, id);
             subject_node->type = type;
             splx_node_add (sd, subject_node);
         }
@@ -541,7 +955,7 @@ void splx_node_attribute_add (struct splx_data_t *sd, struct splx_node_t *node,
     // :id_attribute
     if(value != NULL && strcmp(predicate, "id") == 0) {
         if (!splx_node_has_name(node)) {
-            str_set (&node->str, value);
+            splx_node_set_str (node, value);
 
         } else {
             printf (ECMA_YELLOW("warning:") " ignored setting id of entity that already has one.");
@@ -555,6 +969,11 @@ void splx_node_attribute_add (struct splx_data_t *sd, struct splx_node_t *node,
     struct splx_node_list_t *subject_node_list = tps_wrap_in_list_node (sd, subject_node);
 
     cstr_to_splx_node_list_map_insert (&node->attributes, predicate_str, subject_node_list);
+
+    // Insertion doesn't replace an existing value list.
+    if (cstr_to_splx_node_list_map_get (&node->attributes, predicate_str) == subject_node_list) {
+        splx_entity_index_values (sd, node, predicate_str, subject_node_list);
+    }
 }
 
 void splx_node_attribute_append (struct splx_data_t *sd, struct splx_node_t *node,
@@ -566,19 +985,21 @@ void splx_node_attribute_append (struct splx_data_t *sd, struct splx_node_t *nod
 
     char *predicate_str = splx_get_node_id_str (sd, predicate);
 
+    struct splx_node_list_t *new_node_list_element = tps_wrap_in_list_node (sd, object);
+
     struct splx_node_list_t *subject_node_list = cstr_to_splx_node_list_map_get (&node->attributes, predicate_str);
     if (subject_node_list == NULL) {
-        subject_node_list = tps_wrap_in_list_node (sd, object);
-        cstr_to_splx_node_list_map_insert (&node->attributes, predicate_str, subject_node_list);
+        cstr_to_splx_node_list_map_insert (&node->attributes, predicate_str, new_node_list_element);
 
     } else {
         while (subject_node_list->next != NULL) {
             subject_node_list = subject_node_list->next;
         }
 
-        struct splx_node_list_t *new_node_list_element = tps_wrap_in_list_node (sd, object);
         subject_node_list->next = new_node_list_element;
     }
+
+    splx_entity_index_values (sd, node, predicate_str, new_node_list_element);
 }
 
 void splx_node_attribute_append_c_str (struct splx_data_t *sd, struct splx_node_t *node,
@@ -601,6 +1022,7 @@ void splx_node_attribute_append_once (struct splx_data_t *sd, struct splx_node_t
     if (subject_node_list == NULL) {
         subject_node_list = tps_wrap_in_list_node (sd, object);
         cstr_to_splx_node_list_map_insert (&node->attributes, predicate_str, subject_node_list);
+        splx_entity_index_values (sd, node, predicate_str, subject_node_list);
 
     } else {
         found = false;
@@ -615,6 +1037,7 @@ void splx_node_attribute_append_once (struct splx_data_t *sd, struct splx_node_t
         if (!found) {
             struct splx_node_list_t *new_node_list_element = tps_wrap_in_list_node (sd, object);
             curr_list_node->next = new_node_list_element;
+            splx_entity_index_values (sd, node, predicate_str, new_node_list_element);
         }
     }
 }
@@ -626,16 +1049,20 @@ void splx_node_attribute_append_once_c_str (struct splx_data_t *sd, struct splx_
 {
     char *predicate_str = splx_get_node_id_str (sd, predicate);
 
+    // :string_pool
+    char *value_str = splx_intern_c (c_str);
+
     bool found = false;
     struct splx_node_list_t *subject_node_list = cstr_to_splx_node_list_map_get (&node->attributes, predicate_str);
     if (subject_node_list == NULL) {
         subject_node_list = tps_wrap_in_list_node (sd, splx_node (sd, c_str, type));
         cstr_to_splx_node_list_map_insert (&node->attributes, predicate_str, subject_node_list);
+        splx_entity_index_values (sd, node, predicate_str, subject_node_list);
 
     } else {
         found = false;
         LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, subject_node_list) {
-            if (strcmp (c_str, str_data(&curr_list_node->node->str)) == 0) {
+            if (value_str == str_data(&curr_list_node->node->str)) {
                 found = true;
             }
 
@@ -646,6 +1073,7 @@ void splx_node_attribute_append_once_c_str (struct splx_data_t *sd, struct splx_
             struct splx_node_t *value = splx_node (sd, c_str, type);
             struct splx_node_list_t *new_node_list_element = tps_wrap_in_list_node (sd, value);
             curr_list_node->next = new_node_list_element;
+            splx_entity_index_values (sd, node, predicate_str, new_node_list_element);
         }
     }
 }
@@ -655,30 +1083,24 @@ struct splx_node_list_t* splx_node_get_attributes (struct splx_node_t *node, cha
     return cstr_to_splx_node_list_map_get (&node->attributes, attr);
 }
 
+// :entity_index
 struct splx_node_t* splx_get_node_by_name(struct splx_data_t *sd, char *name)
 {
     struct splx_node_t *result = NULL;
 
-    LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, sd->entities->floating_values) {
-        struct splx_node_t *entity = curr_list_node->node;
-
-        struct splx_node_list_t *names = splx_node_get_attributes (entity, "name");
-        LINKED_LIST_FOR (struct splx_node_list_t *, curr_name, names) {
-            struct splx_node_t *node = curr_name->node;
-
-            if (node->type == SPLX_NODE_TYPE_STRING && strcmp(str_data(&node->str), name) == 0) {
-                result = entity;
+    struct splx_entity_index_list_t *named = splx_entity_index_get (&sd->name_index, name);
+    if (named != NULL) {
+        LINKED_LIST_FOR (struct splx_entity_index_entry_t *, curr_entry, named->entries) {
+            if (curr_entry->value->type == SPLX_NODE_TYPE_STRING) {
+                result = curr_entry->entity;
                 break;
             }
         }
-
-        if (result != NULL) break;
     }
 
     return result;
 }
 
-
 int splx_statement_node_cmp (struct splx_statement_node_t *a,  struct splx_statement_node_t *b)
 {
     if (a->subject < b->subject) {
@@ -687,7 +1109,7 @@ int splx_statement_node_cmp (struct splx_statement_node_t *a,  struct splx_state
         return 1;
     }
 
-    int pred_cmp = strcmp(a->predicate, b->predicate);
+    int pred_cmp = splx_str_cmp(a->predicate, b->predicate);
     if (pred_cmp != 0) {
         return pred_cmp;
     }
@@ -749,69 +1171,63 @@ struct splx_node_t* splx_statement_node_get (struct splx_data_t *sd, struct splx
 
 struct query_ctx_t {
     bool done;
-    struct splx_node_list_t *curr_node;
+    struct splx_entity_index_entry_t *next_entry;
+    struct splx_node_t *last_result;
 };
 
+// Iterates all entities with a name, in the order they were created.
+// :entity_index
 struct splx_node_t* splx_next_by_name(struct query_ctx_t *ctx, struct splx_data_t *sd, char *name)
 {
     assert (ctx != NULL);
 
     if (ctx->done) return NULL;
 
-    struct splx_node_t *result = NULL;
-
-    if (ctx->curr_node == NULL) {
-        ctx->curr_node = sd->entities->floating_values;
+    if (ctx->next_entry == NULL && ctx->last_result == NULL) {
+        struct splx_entity_index_list_t *named = splx_entity_index_get (&sd->name_index, name);
+        if (named != NULL) {
+            ctx->next_entry = named->entries;
+        }
     }
 
-    LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, ctx->curr_node) {
-        struct splx_node_t *entity = curr_list_node->node;
-
-        struct splx_node_list_t *names = splx_node_get_attributes (entity, "name");
-        LINKED_LIST_FOR (struct splx_node_list_t *, curr_name, names) {
-            struct splx_node_t *node = curr_name->node;
+    struct splx_node_t *result = NULL;
+    while (result == NULL && ctx->next_entry != NULL) {
+        struct splx_node_t *entity = ctx->next_entry->entity;
+        ctx->next_entry = ctx->next_entry->next;
 
-            if (strcmp(str_data(&node->str), name) == 0) {
-                result = entity;
-                break;
-            }
+        // An entity with the same name more than once has consecutive entries.
+        if (entity != ctx->last_result) {
+            result = entity;
         }
-
-        if (result != NULL) break;
     }
 
-    if (curr_list_node != NULL && result == NULL) {
-        ctx->curr_node = curr_list_node->next;
-    } else {
+    if (result == NULL) {
         ctx->done = true;
     }
 
+    ctx->last_result = result;
     return result;
 }
 
+// Prefers entities of the passed type, otherwise returns the first entity with
+// the name.
 // TODO: Handle multiple matches...
+// :entity_index
 struct splx_node_t* splx_get_node_by_name_optional_type(struct splx_data_t *sd, char *type, char *name)
 {
     struct splx_node_t *result = NULL;
 
-    LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, sd->entities->floating_values) {
-        struct splx_node_t *entity = curr_list_node->node;
-
-        struct splx_node_list_t *names = splx_node_get_attributes (entity, "name");
-        LINKED_LIST_FOR (struct splx_node_list_t *, curr_name, names) {
-            struct splx_node_t *node = curr_name->node;
-
-            if (strcmp(str_data(&node->str), name) == 0 &&
-                splx_node_attribute_contains(node, "a", type)) {
-                result = entity;
+    struct splx_entity_index_list_t *named = splx_entity_index_get (&sd->name_index, name);
+    if (named != NULL) {
+        LINKED_LIST_FOR (struct splx_entity_index_entry_t *, curr_entry, named->entries) {
+            if (splx_node_attribute_contains(curr_entry->entity, "a", type)) {
+                result = curr_entry->entity;
                 break;
 
-            } else if (strcmp(str_data(&node->str), name) == 0) {
-                result = entity;
+            } else if (result == NULL) {
+                result = curr_entry->entity;
             }
         }
-
-        if (result != NULL) break;
     }
 
     return result;
@@ -828,16 +1244,17 @@ struct splx_node_t* splx_node_dup (struct splx_data_t *sd, struct splx_node_t *o
 
     // Copy all simple attributes
     *new_node = *original;
+    new_node->entity_idx = 0;
 
 
     // Zero initialize all non-simple attributes, set their value from original
 
-    // Value string
-    new_node->str = ZERO_INIT(string_t);
-    str_set (&new_node->str, str_data(&original->str));
+    // Value string, it's interned so it was already copied with the simple
+    // attributes. :string_pool
 
     // Attributes tree
     new_node->attributes = ZERO_INIT (struct cstr_to_splx_node_list_map_t);
+    new_node->attributes.pool = &sd->pool;
     BINARY_TREE_FOR (cstr_to_splx_node_list_map, &original->attributes, curr_attribute) {
         cstr_to_splx_node_list_map_insert (&new_node->attributes, curr_attribute->key, curr_attribute->value);
     }
@@ -1635,7 +2052,7 @@ void tps_resolve_id_attribute(struct tsplx_parser_state_t *tps,
 {
     if (str_len(&curr_object->str) == 0) {
         if (subject->type == SPLX_NODE_TYPE_OBJECT || subject->type == SPLX_NODE_TYPE_STRING) {
-            str_set (&curr_object->str, str_data(&subject->str));
+            curr_object->str = subject->str;
             cstr_to_splx_node_map_insert (&sd->nodes, str_data(&curr_object->str), curr_object);
 
         } else {
@@ -1662,6 +2079,11 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
     struct splx_node_t *curr_object = root_object;
     struct splx_node_list_t *curr_value = NULL;
 
+    // Predicate of the attribute curr_value belongs to, NULL if it's a floating
+    // value.
+    // :entity_index
+    char *curr_predicate = NULL;
+
     int triple_idx = 0;
     struct splx_node_t triple[3];
     for (int i=0; i<ARRAY_SIZE(triple); i++) {
@@ -1676,9 +2098,9 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                 splx_node_clear (node);
 
                 if (tps->token.value.len == 1 && *tps->token.value.s == '_') {
-                    strn_set (&node->str, "", 0);
+                    node->str = ZERO_INIT (string_t);
                 } else {
-                    strn_set (&node->str, tps->token.value.s, tps->token.value.len);
+                    splx_node_set_strn (node, tps->token.value.s, tps->token.value.len);
                 }
                 node->type = SPLX_NODE_TYPE_OBJECT;
                 if (tps_match(tps, TSPLX_TOKEN_TYPE_URI, NULL)) {
@@ -1699,7 +2121,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                 target_node = tree_node->value;
 
                 // :string_pool
-                char *variable_name_str = pom_strdup (&sd->pool, str_data(&variable_name));
+                char *variable_name_str = splx_intern (str_data(&variable_name), str_len(&variable_name));
                 cstr_to_splx_node_map_insert (&scope->used_variables, variable_name_str, tree_node->value);
 
             } else {
@@ -1708,7 +2130,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
 
             if (!tps->error && node != NULL) {
                 splx_node_clear (node);
-                strn_set (&node->str, str_data(&target_node->str), str_len(&target_node->str));
+                node->str = target_node->str;
                 target_node->type = target_node->type;
                 triple_idx++;
             }
@@ -1722,11 +2144,14 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
             struct splx_node_t *node = tps_get_triple_node (tps, triple, triple_idx);
             if (node != NULL) {
                 splx_node_clear (node);
-                strn_set (&node->str, tps->token.value.s, tps->token.value.len);
-                str_replace (&node->str, "\\n", "\n", NULL);
-                str_replace (&node->str, "\\t", "\t", NULL);
 
-                str_dedent(&node->str);
+                string_t value = {0};
+                strn_set (&value, tps->token.value.s, tps->token.value.len);
+                str_replace (&value, "\\n", "\n", NULL);
+                str_replace (&value, "\\t", "\t", NULL);
+                str_dedent(&value);
+                splx_node_set_strn (node, str_data(&value), str_len(&value));
+                str_free (&value);
 
                 node->type = SPLX_NODE_TYPE_STRING;
                 triple_idx++;
@@ -1736,9 +2161,14 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
             struct splx_node_t *node = tps_get_triple_node (tps, triple, triple_idx);
             if (node != NULL) {
                 splx_node_clear (node);
-                strn_set (&node->str, tps->token.value.s, tps->token.value.len);
-                str_replace (&node->str, "\\n", "\n", NULL);
-                str_replace (&node->str, "\\t", "\t", NULL);
+
+                string_t value = {0};
+                strn_set (&value, tps->token.value.s, tps->token.value.len);
+                str_replace (&value, "\\n", "\n", NULL);
+                str_replace (&value, "\\t", "\t", NULL);
+                splx_node_set_strn (node, str_data(&value), str_len(&value));
+                str_free (&value);
+
                 node->type = SPLX_NODE_TYPE_STRING;
                 triple_idx++;
             }
@@ -1747,7 +2177,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
             struct splx_node_t *node = tps_get_triple_node (tps, triple, triple_idx);
             if (node != NULL) {
                 splx_node_clear (node);
-                strn_set (&node->str, tps->token.value.s, tps->token.value.len);
+                splx_node_set_strn (node, tps->token.value.s, tps->token.value.len);
                 node->type = SPLX_NODE_TYPE_SOFT_REFERENCE;
                 triple_idx++;
             }
@@ -1756,7 +2186,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
             struct splx_node_t *node = tps_get_triple_node (tps, triple, triple_idx);
             if (node != NULL) {
                 splx_node_clear (node);
-                strn_set (&node->str, tps->token.value.s, tps->token.value.len);
+                splx_node_set_strn (node, tps->token.value.s, tps->token.value.len);
                 node->type = SPLX_NODE_TYPE_INTEGER;
                 triple_idx++;
             }
@@ -1799,7 +2229,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                         strn_set (&parameter_name, tps->token.value.s, tps->token.value.len);
 
                         // :string_pool
-                        parameter_name_str = pom_strdup (&sd->pool, str_data(&parameter_name));
+                        parameter_name_str = splx_intern (str_data(&parameter_name), str_len(&parameter_name));
 
                         string_t parameter_id = {0};
                         str_set_printf (&parameter_id, "__%s_p%i", str_data(&constructor_lhs->str), parameter_idx+1);
@@ -1907,6 +2337,9 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
 
                 if (curr_value != NULL && curr_value != curr_object->floating_values_end) {
                     curr_value->next = subject_node_list;
+                    if (curr_predicate != NULL) {
+                        splx_entity_index_values (sd, curr_object, curr_predicate, subject_node_list);
+                    }
 
                 } else {
                     // There is no current value to link to the value that was
@@ -1914,6 +2347,7 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                     // floating.
                     LINKED_LIST_APPEND (curr_object->floating_values, subject_node_list);
                     while (curr_object->floating_values_end->next != NULL) curr_object->floating_values_end = curr_object->floating_values_end->next;
+                    curr_predicate = NULL;
                 }
 
                 curr_value = subject_node_list;
@@ -1941,7 +2375,9 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                             while (existing_subject_list->next != NULL) existing_subject_list = existing_subject_list->next;
                             existing_subject_list->next = subject_node_list;
                         }
+                        splx_entity_index_values (sd, curr_object, predicate_str, subject_node_list);
 
+                        curr_predicate = predicate_str;
                         curr_value = subject_node_list;
                         while (curr_value->next != NULL) curr_value = curr_value->next;
                     }
@@ -1966,6 +2402,9 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
                     struct splx_node_list_t *subject_node_list = tps_subject_node_list_from_tmp_node (sd, &triple[2]);
 
                     cstr_to_splx_node_list_map_insert (&new_node->attributes, predicate_str, subject_node_list);
+                    splx_entity_index_values (sd, new_node, predicate_str, subject_node_list);
+
+                    curr_predicate = predicate_str;
                     curr_value = subject_node_list;
                     while (curr_value->next != NULL) curr_value = curr_value->next;
 
@@ -1983,10 +2422,6 @@ bool tps_parse_node (struct tsplx_parser_state_t *tps, struct splx_node_t *root_
         }
     }
 
-    for (int i=0; i<ARRAY_SIZE(triple); i++) {
-        str_free (&triple[i].str);
-    }
-
     return !tps->error;
 }
 
@@ -2085,13 +2520,24 @@ bool splx_node_attribute_contains (struct splx_node_t *node, char *attr, char *v
 {
     if (node == NULL) return false;
 
+    // Node strings are interned, if value isn't then no node has it. Empty
+    // strings are the exception, nodes without a string don't point to the
+    // interned one.
+    // :string_pool
+    char *value_str = NULL;
+    if (value != NULL && *value != '\0') {
+        value_str = splx_intern_find (value);
+        if (value_str == NULL) return false;
+    }
+
     bool found = false;
 
     struct splx_node_list_t *attributes = splx_node_get_attributes (node, attr);
     LINKED_LIST_FOR (struct splx_node_list_t *, curr_attr, attributes) {
         struct splx_node_t *node = curr_attr->node;
 
-        if (value == NULL || strcmp(str_data(&node->str), value) == 0) {
+        if (value == NULL || str_data(&node->str) == value_str ||
+            (value_str == NULL && str_len(&node->str) == 0)) {
             found = true;
             break;
         }
@@ -2100,20 +2546,22 @@ bool splx_node_attribute_contains (struct splx_node_t *node, char *attr, char *v
     return found;
 }
 
+// Returns a new list, callers are free to reorder it. Entities are in reverse
+// order of creation.
+// :entity_index
 struct splx_node_list_t* splx_get_node_by_type (struct splx_data_t *sd, char *type)
 {
     struct splx_node_list_t *result = NULL;
 
-    LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, sd->entities->floating_values) {
-        struct splx_node_t *entity = curr_list_node->node;
+    // :string_pool
+    char *type_str = splx_intern_find (type);
+    if (type_str == NULL) return NULL;
 
-        struct splx_node_list_t *types = splx_node_get_attributes (entity, "a");
-        LINKED_LIST_FOR (struct splx_node_list_t *, curr_type, types) {
-            if (strcmp(str_data(&curr_type->node->str), type) == 0)
-            {
-                struct splx_node_list_t *list_node = tps_wrap_in_list_node (sd, entity);
-                LINKED_LIST_PUSH (result, list_node);
-            }
+    struct splx_entity_index_list_t *entities_of_type = splx_entity_index_get (&sd->type_index, type_str);
+    if (entities_of_type != NULL) {
+        LINKED_LIST_FOR (struct splx_entity_index_entry_t *, curr_entry, entities_of_type->entries) {
+            struct splx_node_list_t *list_node = tps_wrap_in_list_node (sd, curr_entry->entity);
+            LINKED_LIST_PUSH (result, list_node);
         }
     }
 
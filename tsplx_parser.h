@@ -4,9 +4,16 @@
 
 #if !defined(TSPLX_PARSER_H)
 
+// Node strings, predicates and keys of SPLX maps are interned (see
+// splx_intern()), equal strings are usually the same pointer. Maps still
+// order keys with strcmp() so iteration order stays alphabetical, but finding
+// an interned key doesn't compare its characters.
+// :string_pool
+#define splx_str_cmp(a,b) ((a) == (b) ? 0 : strcmp((a), (b)))
+
 BINARY_TREE_NEW (ptr_set, void*, void*, (a==b) ? 0 : (a<b ? -1 : 1))
-BINARY_TREE_NEW (cstr_to_splx_node_map, char*, struct splx_node_t*, strcmp(a, b))
-BINARY_TREE_NEW (cstr_to_splx_node_list_map, char*, struct splx_node_list_t*, strcmp(a, b))
+BINARY_TREE_NEW (cstr_to_splx_node_map, char*, struct splx_node_t*, splx_str_cmp(a, b))
+BINARY_TREE_NEW (cstr_to_splx_node_list_map, char*, struct splx_node_list_t*, splx_str_cmp(a, b))
 
 struct splx_statement_node_t {
     struct splx_node_t *subject;
@@ -39,6 +46,10 @@ char* splx_node_type_names[] = {
 
 struct splx_node_t {
     enum splx_node_type_t type;
+
+    // Points to an interned string, it doesn't own its memory. Set it with
+    // splx_node_set_str() and never modify it in place.
+    // :string_pool
     string_t str;
 
     struct cstr_to_splx_node_list_map_t attributes;
@@ -47,6 +58,10 @@ struct splx_node_t {
     struct splx_node_list_t *floating_values_end;
 
     bool uri_formatted_identifier;
+
+    // 1 based position of this node in sd->entities, 0 if it isn't an entity.
+    // :entity_index
+    int entity_idx;
 };
 
 struct splx_node_list_t {
@@ -54,6 +69,23 @@ struct splx_node_list_t {
     struct splx_node_list_t *next;
 };
 
+// Maps values of an attribute to the entities that have them. Entries are kept
+// in the same order entities have in sd->entities, so queries return the same
+// thing a linear scan over all entities would.
+// :entity_index
+struct splx_entity_index_entry_t {
+    struct splx_node_t *entity;
+    struct splx_node_t *value;
+
+    struct splx_entity_index_entry_t *next;
+};
+
+struct splx_entity_index_list_t {
+    LINKED_LIST_DECLARE (struct splx_entity_index_entry_t, entries);
+};
+
+BINARY_TREE_NEW (splx_entity_index, char*, struct splx_entity_index_list_t*, splx_str_cmp(a, b))
+
 struct splx_data_t {
     mem_pool_t pool;
 
@@ -62,6 +94,12 @@ struct splx_data_t {
 
     struct statement_nodes_map_t statement_nodes;
 
+    // Kept up to date as "a" and "name" attributes are added to entities.
+    // :entity_index
+    int entities_len;
+    struct splx_entity_index_t type_index;
+    struct splx_entity_index_t name_index;
+
     // The root is different than "entities" in that it has the actual nesting
     // structure of the whole object parsed, entities instead is just a flat
     // node containing all entities as floating objects. Some entities without
@@ -73,6 +111,10 @@ struct splx_data_t {
 
 /////////
 // API
+char* splx_intern (const char *str, size_t len);
+char* splx_intern_c (const char *str);
+char* splx_intern_find (const char *str);
+
 struct splx_node_t* splx_node_new (struct splx_data_t *sd);
 
 struct splx_node_list_t* splx_node_get_attributes (struct splx_node_t *node, char *attr);
@@ -1,14 +1,17 @@
 /*
  * Copyright (C) 2021 Santiago León O.
  */
+#include "lib/cJSON.h"
 
 #include "common.h"
+#include "scanner.c"
 #include "binary_tree.c"
 #include "test_logger.c"
 #include "cli_parser.c"
 
 #define ATTRIBUTE_PLACEHOLDER
 #include "tsplx_parser.c"
+#include "tsplx_snapshot.c"
 
 #include "testing.c"
 
@@ -185,6 +188,27 @@ int main(int argc, char** argv)
                         test_str (t, str_data(&buff), expected_canonical);
                     }
 
+                    // :splx_snapshot
+                    {
+                        test_push (t, "Snapshot round trip");
+
+                        char snapshot_path[] = "/tmp/weaver-splx-snapshot-XXXXXX";
+                        close (mkstemp (snapshot_path));
+
+                        struct splx_data_t loaded = {0};
+                        if (!splx_snapshot_write (&sd, snapshot_path, 0) && splx_snapshot_load (&loaded, snapshot_path, 0)) {
+                            str_set (&buff, "");
+                            str_cat_splx_canonical (&buff, &loaded, loaded.root);
+                            test_str (t, str_data(&buff), expected_canonical);
+                        } else {
+                            test_bool (t, false);
+                            test_error_c (t, "could not write and load snapshot");
+                        }
+
+                        splx_destroy (&loaded);
+                        unlink (snapshot_path);
+                    }
+
                     free (expected_canonical);
                 }
 
@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Binary snapshot of a struct splx_data_t.
+//
+// Parsing is the only way of getting SPLX data otherwise, which means parsing
+// the whole note base. A snapshot instead can be mapped into memory and turned
+// into a splx_data_t with a single pass over its records that converts indices
+// into pointers. The only strings copied out of the mapping are the ones that
+// weren't interned yet (see splx_intern()).
+//
+// After the header, the file has these sections, each one an array of records
+// of the given type:
+//
+//   nodes               struct splx_snapshot_node_t
+//   attributes          struct splx_snapshot_attribute_t
+//   values              uint32_t, index of a node
+//   node ids            struct splx_snapshot_node_id_t
+//   statements          struct splx_snapshot_statement_t
+//   index keys          struct splx_snapshot_index_key_t, type index then name index
+//   index entries       struct splx_snapshot_index_entry_t
+//   strings             NULL terminated strings
+//
+// Nodes reference a run of consecutive attributes, attributes and floating
+// values reference a run of consecutive values. Records of trees are stored in
+// the order BINARY_TREE_FOR visits them, so loading them doesn't need any key
+// comparisons. Statements are the exception, their key compares node pointers.
+// They are sorted by node index, which is the same order the loaded nodes have
+// in memory because they're allocated in a single array.
+//
+// Strings are referenced by their offset in the strings section. Numbers use
+// the machine's byte order, like the vault index this is a local cache, not an
+// interchange format.
+// :splx_snapshot
+
+#include <sys/mman.h>
+
+#define SPLX_SNAPSHOT_MAGIC "weaver-splx-snapshot 1\n"
+#define SPLX_SNAPSHOT_NONE UINT32_MAX
+
+struct splx_snapshot_header_t {
+    char magic[24];
+
+    // Set by the caller when writing, a snapshot is only loaded if the caller
+    // expects the same key.
+    uint64_t key;
+
+    uint32_t nodes_len;
+    uint32_t attributes_len;
+    uint32_t values_len;
+    uint32_t node_ids_len;
+    uint32_t statements_len;
+    uint32_t type_index_len;
+    uint32_t name_index_len;
+    uint32_t index_entries_len;
+    uint32_t strings_len;
+
+    uint32_t root;
+    uint32_t entities;
+    uint32_t entities_len;
+};
+
+struct splx_snapshot_node_t {
+    uint32_t type;
+    uint32_t str;
+    uint32_t str_len;
+    uint32_t uri_formatted_identifier;
+    int32_t entity_idx;
+
+    uint32_t attributes;
+    uint32_t attributes_len;
+
+    uint32_t floating_values;
+    uint32_t floating_values_len;
+};
+
+struct splx_snapshot_attribute_t {
+    uint32_t predicate;
+    uint32_t values;
+    uint32_t values_len;
+};
+
+// Node is SPLX_SNAPSHOT_NONE for ids that have only been used as predicates.
+struct splx_snapshot_node_id_t {
+    uint32_t id;
+    uint32_t node;
+};
+
+struct splx_snapshot_statement_t {
+    uint32_t subject;
+    uint32_t predicate;
+    uint32_t object;
+    uint32_t node;
+};
+
+struct splx_snapshot_index_key_t {
+    uint32_t value;
+    uint32_t entries;
+    uint32_t entries_len;
+};
+
+struct splx_snapshot_index_entry_t {
+    uint32_t entity;
+    uint32_t value;
+};
+
+BINARY_TREE_NEW (splx_snapshot_string_offsets, char*, uint32_t, strcmp(a, b))
+
+struct splx_snapshot_writer_t {
+    mem_pool_t pool;
+
+    // Node pointer to its index plus one.
+    struct ptr_set_t node_idx;
+    DYNAMIC_ARRAY_DEFINE (struct splx_node_t*, nodes);
+
+    // Strings used as keys are stored only once.
+    struct splx_snapshot_string_offsets_t string_offsets;
+
+    FILE *attributes;
+    FILE *values;
+    FILE *strings;
+    char *attributes_data, *values_data, *strings_data;
+    size_t attributes_size, values_size, strings_size;
+};
+
+uint32_t splx_snapshot_node_idx (struct splx_snapshot_writer_t *wr, struct splx_node_t *node)
+{
+    if (node == NULL) return SPLX_SNAPSHOT_NONE;
+
+    uintptr_t idx = (uintptr_t)ptr_set_get (&wr->node_idx, node);
+    if (idx == 0) {
+        DYNAMIC_ARRAY_APPEND (wr->nodes, node);
+        idx = wr->nodes_len;
+        ptr_set_insert (&wr->node_idx, node, (void*)idx);
+    }
+
+    return idx - 1;
+}
+
+uint32_t splx_snapshot_strn (struct splx_snapshot_writer_t *wr, char *str, size_t len)
+{
+    uint32_t offset = ftell (wr->strings);
+    fwrite (str, 1, len, wr->strings);
+    fputc ('\0', wr->strings);
+    return offset;
+}
+
+uint32_t splx_snapshot_key_str (struct splx_snapshot_writer_t *wr, char *str)
+{
+    uint32_t offset;
+    if (!splx_snapshot_string_offsets_maybe_get (&wr->string_offsets, str, &offset)) {
+        offset = splx_snapshot_strn (wr, str, strlen(str));
+        splx_snapshot_string_offsets_insert (&wr->string_offsets, str, offset);
+    }
+    return offset;
+}
+
+uint32_t splx_snapshot_values (struct splx_snapshot_writer_t *wr, struct splx_node_list_t *list, uint32_t *len)
+{
+    uint32_t first = ftell (wr->values)/sizeof(uint32_t);
+
+    *len = 0;
+    LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, list) {
+        uint32_t idx = splx_snapshot_node_idx (wr, curr_list_node->node);
+        fwrite (&idx, sizeof(idx), 1, wr->values);
+        (*len)++;
+    }
+
+    return first;
+}
+
+void splx_snapshot_index (struct splx_snapshot_writer_t *wr, struct splx_entity_index_t *index,
+                          FILE *keys, FILE *entries, uint32_t *len)
+{
+    *len = 0;
+    BINARY_TREE_FOR (splx_entity_index, index, curr_node) {
+        struct splx_snapshot_index_key_t key = {0};
+        key.value = splx_snapshot_key_str (wr, curr_node->key);
+        key.entries = ftell (entries)/sizeof(struct splx_snapshot_index_entry_t);
+
+        LINKED_LIST_FOR (struct splx_entity_index_entry_t *, curr_entry, curr_node->value->entries) {
+            struct splx_snapshot_index_entry_t entry = {0};
+            entry.entity = splx_snapshot_node_idx (wr, curr_entry->entity);
+            entry.value = splx_snapshot_node_idx (wr, curr_entry->value);
+            fwrite (&entry, sizeof(entry), 1, entries);
+            key.entries_len++;
+        }
+
+        fwrite (&key, sizeof(key), 1, keys);
+        (*len)++;
+    }
+}
+
+int splx_snapshot_statement_cmp (const void *a, const void *b, void *data)
+{
+    const struct splx_snapshot_statement_t *s1 = a, *s2 = b;
+    char *strings = data;
+
+    // Loaded NULL nodes compare less than all others.
+#define NODE_ORDER(idx) ((idx) == SPLX_SNAPSHOT_NONE ? -1 : (int64_t)(idx))
+    if (s1->subject != s2->subject) return NODE_ORDER(s1->subject) < NODE_ORDER(s2->subject) ? -1 : 1;
+
+    int pred_cmp = strcmp (strings + s1->predicate, strings + s2->predicate);
+    if (pred_cmp != 0) return pred_cmp;
+
+    if (s1->object != s2->object) return NODE_ORDER(s1->object) < NODE_ORDER(s2->object) ? -1 : 1;
+    return 0;
+#undef NODE_ORDER
+}
+
+// Returns true on failure, like full_file_write().
+bool splx_snapshot_write (struct splx_data_t *sd, char *path, uint64_t key)
+{
+    bool failed = false;
+
+    STACK_ALLOCATE (struct splx_snapshot_writer_t, wr);
+    wr->node_idx.pool = &wr->pool;
+    wr->string_offsets.pool = &wr->pool;
+    DYNAMIC_ARRAY_INIT (&wr->pool, wr->nodes, -1);
+
+    wr->attributes = open_memstream (&wr->attributes_data, &wr->attributes_size);
+    wr->values = open_memstream (&wr->values_data, &wr->values_size);
+    wr->strings = open_memstream (&wr->strings_data, &wr->strings_size);
+
+    char *nodes_data, *node_ids_data, *index_keys_data, *index_entries_data;
+    size_t nodes_size, node_ids_size, index_keys_size, index_entries_size;
+    FILE *nodes = open_memstream (&nodes_data, &nodes_size);
+    FILE *node_ids = open_memstream (&node_ids_data, &node_ids_size);
+    FILE *index_keys = open_memstream (&index_keys_data, &index_keys_size);
+    FILE *index_entries = open_memstream (&index_entries_data, &index_entries_size);
+
+    struct splx_snapshot_header_t header = {0};
+    strncpy (header.magic, SPLX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.root = splx_snapshot_node_idx (wr, sd->root);
+    header.entities = splx_snapshot_node_idx (wr, sd->entities);
+    header.entities_len = sd->entities_len;
+
+    BINARY_TREE_FOR (cstr_to_splx_node_map, &sd->nodes, curr_node) {
+        struct splx_snapshot_node_id_t node_id = {0};
+        node_id.id = splx_snapshot_key_str (wr, curr_node->key);
+        node_id.node = splx_snapshot_node_idx (wr, curr_node->value);
+        fwrite (&node_id, sizeof(node_id), 1, node_ids);
+        header.node_ids_len++;
+    }
+
+    struct splx_snapshot_statement_t *statements =
+        mem_pool_push_array (&wr->pool, sd->statement_nodes.num_nodes, struct splx_snapshot_statement_t);
+    BINARY_TREE_FOR (statement_nodes_map, &sd->statement_nodes, curr_statement) {
+        struct splx_snapshot_statement_t *statement = &statements[header.statements_len++];
+        statement->subject = splx_snapshot_node_idx (wr, curr_statement->key.subject);
+        statement->predicate = splx_snapshot_key_str (wr, curr_statement->key.predicate);
+        statement->object = splx_snapshot_node_idx (wr, curr_statement->key.object);
+        statement->node = splx_snapshot_node_idx (wr, curr_statement->value);
+    }
+
+    splx_snapshot_index (wr, &sd->type_index, index_keys, index_entries, &header.type_index_len);
+    splx_snapshot_index (wr, &sd->name_index, index_keys, index_entries, &header.name_index_len);
+    header.index_entries_len = ftell (index_entries)/sizeof(struct splx_snapshot_index_entry_t);
+    fclose (index_keys);
+    fclose (index_entries);
+    fclose (node_ids);
+
+    // Nodes reached from attributes and floating values are appended to
+    // wr->nodes while we iterate it, at the end it has all reachable nodes.
+    for (int i=0; i<wr->nodes_len; i++) {
+        struct splx_node_t *node = wr->nodes[i];
+
+        struct splx_snapshot_node_t record = {0};
+        record.type = node->type;
+        record.str_len = str_len(&node->str);
+        record.str = splx_snapshot_strn (wr, str_data(&node->str), record.str_len);
+        record.uri_formatted_identifier = node->uri_formatted_identifier;
+        record.entity_idx = node->entity_idx;
+
+        record.attributes = ftell (wr->attributes)/sizeof(struct splx_snapshot_attribute_t);
+        BINARY_TREE_FOR (cstr_to_splx_node_list_map, &node->attributes, curr_attribute) {
+            struct splx_snapshot_attribute_t attribute = {0};
+            attribute.predicate = splx_snapshot_key_str (wr, curr_attribute->key);
+            attribute.values = splx_snapshot_values (wr, curr_attribute->value, &attribute.values_len);
+            fwrite (&attribute, sizeof(attribute), 1, wr->attributes);
+            record.attributes_len++;
+        }
+
+        record.floating_values = splx_snapshot_values (wr, node->floating_values, &record.floating_values_len);
+
+        fwrite (&record, sizeof(record), 1, nodes);
+    }
+    header.nodes_len = wr->nodes_len;
+    fclose (nodes);
+
+    fclose (wr->attributes);
+    fclose (wr->values);
+    fclose (wr->strings);
+    header.attributes_len = wr->attributes_size/sizeof(struct splx_snapshot_attribute_t);
+    header.values_len = wr->values_size/sizeof(uint32_t);
+    header.strings_len = wr->strings_size;
+
+    // Predicate offsets are only valid after the string table is complete.
+    qsort_r (statements, header.statements_len, sizeof(*statements), splx_snapshot_statement_cmp, wr->strings_data);
+
+    struct file_replace_t fr;
+    FILE *f = file_replace_begin (&fr, path);
+    if (f != NULL) {
+        fwrite (&header, sizeof(header), 1, f);
+        fwrite (nodes_data, 1, nodes_size, f);
+        fwrite (wr->attributes_data, 1, wr->attributes_size, f);
+        fwrite (wr->values_data, 1, wr->values_size, f);
+        fwrite (node_ids_data, 1, node_ids_size, f);
+        fwrite (statements, sizeof(*statements), header.statements_len, f);
+        fwrite (index_keys_data, 1, index_keys_size, f);
+        fwrite (index_entries_data, 1, index_entries_size, f);
+        fwrite (wr->strings_data, 1, wr->strings_size, f);
+
+        if (file_replace_end (&fr)) {
+            printf ("Error writing %s\n", path);
+            failed = true;
+        }
+
+    } else {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        failed = true;
+    }
+
+    free (nodes_data);
+    free (wr->attributes_data);
+    free (wr->values_data);
+    free (wr->strings_data);
+    free (node_ids_data);
+    free (index_keys_data);
+    free (index_entries_data);
+    mem_pool_destroy (&wr->pool);
+
+    return failed;
+}
+
+// Pointers to the start of each section of a mapped snapshot.
+struct splx_snapshot_t {
+    struct splx_snapshot_header_t *header;
+    struct splx_snapshot_node_t *nodes;
+    struct splx_snapshot_attribute_t *attributes;
+    uint32_t *values;
+    struct splx_snapshot_node_id_t *node_ids;
+    struct splx_snapshot_statement_t *statements;
+    struct splx_snapshot_index_key_t *index_keys;
+    struct splx_snapshot_index_entry_t *index_entries;
+    char *strings;
+};
+
+// Checks all sizes, indices and offsets in the snapshot are in bounds. After
+// this loading doesn't need any checks.
+bool splx_snapshot_validate (struct splx_snapshot_t *snp, size_t len)
+{
+    struct splx_snapshot_header_t *h = snp->header;
+
+    // Section lengths come from the file, add them up in 64 bits.
+    uint64_t expected_len = sizeof(*h) +
+        (uint64_t)h->nodes_len*sizeof(struct splx_snapshot_node_t) +
+        (uint64_t)h->attributes_len*sizeof(struct splx_snapshot_attribute_t) +
+        (uint64_t)h->values_len*sizeof(uint32_t) +
+        (uint64_t)h->node_ids_len*sizeof(struct splx_snapshot_node_id_t) +
+        (uint64_t)h->statements_len*sizeof(struct splx_snapshot_statement_t) +
+        ((uint64_t)h->type_index_len + h->name_index_len)*sizeof(struct splx_snapshot_index_key_t) +
+        (uint64_t)h->index_entries_len*sizeof(struct splx_snapshot_index_entry_t) +
+        h->strings_len;
+    if (expected_len != len || h->strings_len == 0 || snp->strings[h->strings_len-1] != '\0') return false;
+
+#define VALID_NODE(idx) ((idx) < h->nodes_len)
+#define VALID_STR(offset) ((offset) < h->strings_len)
+#define VALID_RUN(first,run_len,len) ((first) <= (len) && (run_len) <= (len) - (first))
+#define VALID_NODE_OR_NONE(idx) (VALID_NODE(idx) || (idx) == SPLX_SNAPSHOT_NONE)
+
+    if (!VALID_NODE_OR_NONE(h->root) || !VALID_NODE_OR_NONE(h->entities)) return false;
+
+    for (uint32_t i=0; i<h->nodes_len; i++) {
+        struct splx_snapshot_node_t *node = &snp->nodes[i];
+        if (!VALID_RUN(node->str, node->str_len, h->strings_len - 1) ||
+            !VALID_RUN(node->attributes, node->attributes_len, h->attributes_len) ||
+            !VALID_RUN(node->floating_values, node->floating_values_len, h->values_len)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<h->attributes_len; i++) {
+        struct splx_snapshot_attribute_t *attribute = &snp->attributes[i];
+        if (!VALID_STR(attribute->predicate) || !VALID_RUN(attribute->values, attribute->values_len, h->values_len)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<h->values_len; i++) {
+        if (!VALID_NODE(snp->values[i])) return false;
+    }
+
+    for (uint32_t i=0; i<h->node_ids_len; i++) {
+        struct splx_snapshot_node_id_t *node_id = &snp->node_ids[i];
+        if (!VALID_STR(node_id->id) || !VALID_NODE_OR_NONE(node_id->node)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<h->statements_len; i++) {
+        struct splx_snapshot_statement_t *statement = &snp->statements[i];
+        if (!VALID_NODE_OR_NONE(statement->subject) || !VALID_STR(statement->predicate) ||
+            !VALID_NODE_OR_NONE(statement->object) || !VALID_NODE_OR_NONE(statement->node)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<h->type_index_len + h->name_index_len; i++) {
+        struct splx_snapshot_index_key_t *key = &snp->index_keys[i];
+        if (!VALID_STR(key->value) || key->entries_len == 0 ||
+            !VALID_RUN(key->entries, key->entries_len, h->index_entries_len)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<h->index_entries_len; i++) {
+        struct splx_snapshot_index_entry_t *entry = &snp->index_entries[i];
+        if (!VALID_NODE(entry->entity) || !VALID_NODE(entry->value)) return false;
+    }
+
+#undef VALID_NODE
+#undef VALID_STR
+#undef VALID_RUN
+#undef VALID_NODE_OR_NONE
+
+    return true;
+}
+
+// Links a run of values into a list, lists is the array with a list node for
+// every value in the snapshot.
+struct splx_node_list_t* splx_snapshot_link_list (struct splx_node_list_t *lists, uint32_t first, uint32_t len)
+{
+    if (len == 0) return NULL;
+
+    for (uint32_t i=first; i<first+len-1; i++) {
+        lists[i].next = &lists[i+1];
+    }
+    return &lists[first];
+}
+
+void splx_snapshot_load_index (struct splx_data_t *sd, struct splx_snapshot_t *snp,
+                               struct splx_node_t *nodes, struct splx_entity_index_t *index,
+                               struct splx_snapshot_index_key_t *keys, uint32_t keys_len)
+{
+    if (keys_len == 0) return;
+
+    index->pool = &sd->pool;
+    struct splx_entity_index_node_t *tree_nodes = mem_pool_push_array (&sd->pool, keys_len, struct splx_entity_index_node_t);
+    struct splx_entity_index_list_t *lists = mem_pool_push_array (&sd->pool, keys_len, struct splx_entity_index_list_t);
+
+    for (uint32_t i=0; i<keys_len; i++) {
+        struct splx_entity_index_entry_t *entries = mem_pool_push_array (&sd->pool, keys[i].entries_len, struct splx_entity_index_entry_t);
+        for (uint32_t j=0; j<keys[i].entries_len; j++) {
+            struct splx_snapshot_index_entry_t *entry = &snp->index_entries[keys[i].entries + j];
+            entries[j].entity = &nodes[entry->entity];
+            entries[j].value = &nodes[entry->value];
+            entries[j].next = j+1 < keys[i].entries_len ? &entries[j+1] : NULL;
+        }
+
+        lists[i].entries = entries;
+        lists[i].entries_end = &entries[keys[i].entries_len - 1];
+
+        tree_nodes[i] = ZERO_INIT (struct splx_entity_index_node_t);
+        tree_nodes[i].key = splx_intern_c (snp->strings + keys[i].value);
+        tree_nodes[i].value = &lists[i];
+    }
+
+    splx_entity_index_set_sorted (index, tree_nodes, keys_len);
+}
+
+// Loads a snapshot into sd, which must be empty. Returns false if the file
+// doesn't exist, isn't a valid snapshot, or its key is different than key.
+bool splx_snapshot_load (struct splx_data_t *sd, char *path, uint64_t key)
+{
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct splx_snapshot_header_t)) {
+        data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+    if (data == MAP_FAILED) return false;
+
+    struct splx_snapshot_t _snp = {0};
+    struct splx_snapshot_t *snp = &_snp;
+    struct splx_snapshot_header_t *h = snp->header = data;
+
+    bool success = strncmp (h->magic, SPLX_SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 && h->key == key;
+    if (success) {
+        snp->nodes = (void*)(h + 1);
+        snp->attributes = (void*)(snp->nodes + h->nodes_len);
+        snp->values = (void*)(snp->attributes + h->attributes_len);
+        snp->node_ids = (void*)(snp->values + h->values_len);
+        snp->statements = (void*)(snp->node_ids + h->node_ids_len);
+        snp->index_keys = (void*)(snp->statements + h->statements_len);
+        snp->index_entries = (void*)(snp->index_keys + h->type_index_len + h->name_index_len);
+        snp->strings = (void*)(snp->index_entries + h->index_entries_len);
+
+        // Pointers may be past the end of the mapping if the lengths are
+        // wrong, validation checks the lengths before dereferencing them.
+        success = splx_snapshot_validate (snp, st.st_size);
+    }
+
+    if (!success) {
+        munmap (data, st.st_size);
+        return false;
+    }
+
+    struct splx_node_t *nodes = mem_pool_push_array (&sd->pool, h->nodes_len, struct splx_node_t);
+#define NODE_OR_NULL(idx) ((idx) != SPLX_SNAPSHOT_NONE ? &nodes[idx] : NULL)
+    struct splx_node_list_t *lists = mem_pool_push_array (&sd->pool, h->values_len, struct splx_node_list_t);
+    struct cstr_to_splx_node_list_map_node_t *attributes =
+        mem_pool_push_array (&sd->pool, h->attributes_len, struct cstr_to_splx_node_list_map_node_t);
+
+    for (uint32_t i=0; i<h->values_len; i++) {
+        lists[i].node = &nodes[snp->values[i]];
+        lists[i].next = NULL;
+    }
+
+    for (uint32_t i=0; i<h->attributes_len; i++) {
+        struct splx_snapshot_attribute_t *attribute = &snp->attributes[i];
+        attributes[i] = ZERO_INIT (struct cstr_to_splx_node_list_map_node_t);
+        attributes[i].key = splx_intern_c (snp->strings + attribute->predicate);
+        attributes[i].value = splx_snapshot_link_list (lists, attribute->values, attribute->values_len);
+    }
+
+    for (uint32_t i=0; i<h->nodes_len; i++) {
+        struct splx_snapshot_node_t *record = &snp->nodes[i];
+        struct splx_node_t *node = &nodes[i];
+        *node = ZERO_INIT (struct splx_node_t);
+
+        node->type = record->type;
+        node->uri_formatted_identifier = record->uri_formatted_identifier;
+        node->entity_idx = record->entity_idx;
+
+        if (record->str_len > 0) {
+            splx_node_set_strn (node, snp->strings + record->str, record->str_len);
+        }
+
+        node->attributes.pool = &sd->pool;
+        cstr_to_splx_node_list_map_set_sorted (&node->attributes, attributes + record->attributes, record->attributes_len);
+
+        node->floating_values = splx_snapshot_link_list (lists, record->floating_values, record->floating_values_len);
+        if (record->floating_values_len > 0) {
+            node->floating_values_end = &lists[record->floating_values + record->floating_values_len - 1];
+        }
+    }
+
+    sd->root = NODE_OR_NULL(h->root);
+    sd->entities = NODE_OR_NULL(h->entities);
+    sd->entities_len = h->entities_len;
+
+    {
+        sd->nodes.pool = &sd->pool;
+        struct cstr_to_splx_node_map_node_t *tree_nodes =
+            mem_pool_push_array (&sd->pool, h->node_ids_len, struct cstr_to_splx_node_map_node_t);
+        for (uint32_t i=0; i<h->node_ids_len; i++) {
+            struct splx_snapshot_node_id_t *node_id = &snp->node_ids[i];
+            tree_nodes[i] = ZERO_INIT (struct cstr_to_splx_node_map_node_t);
+            tree_nodes[i].key = splx_intern_c (snp->strings + node_id->id);
+            tree_nodes[i].value = NODE_OR_NULL(node_id->node);
+        }
+        cstr_to_splx_node_map_set_sorted (&sd->nodes, tree_nodes, h->node_ids_len);
+    }
+
+    {
+        sd->statement_nodes.pool = &sd->pool;
+        struct statement_nodes_map_node_t *tree_nodes =
+            mem_pool_push_array (&sd->pool, h->statements_len, struct statement_nodes_map_node_t);
+        for (uint32_t i=0; i<h->statements_len; i++) {
+            struct splx_snapshot_statement_t *statement = &snp->statements[i];
+            tree_nodes[i] = ZERO_INIT (struct statement_nodes_map_node_t);
+            tree_nodes[i].key.subject = NODE_OR_NULL(statement->subject);
+            tree_nodes[i].key.predicate = splx_intern_c (snp->strings + statement->predicate);
+            tree_nodes[i].key.object = NODE_OR_NULL(statement->object);
+            tree_nodes[i].value = NODE_OR_NULL(statement->node);
+        }
+        statement_nodes_map_set_sorted (&sd->statement_nodes, tree_nodes, h->statements_len);
+    }
+#undef NODE_OR_NULL
+
+    splx_snapshot_load_index (sd, snp, nodes, &sd->type_index, snp->index_keys, h->type_index_len);
+    splx_snapshot_load_index (sd, snp, nodes, &sd->name_index, snp->index_keys + h->type_index_len, h->name_index_len);
+
+    // All strings are interned now, nothing points into the mapping anymore.
+    munmap (data, st.st_size);
+
+    return true;
+}
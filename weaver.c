@@ -23,6 +23,7 @@
 #include "lib/mustach-cjson.h"
 
 #include "psplx_parser.c"
+#include "tsplx_snapshot.c"
 #include "note_runtime.c"
 
 //////////////////////////////////////
@@ -46,10 +47,17 @@ void rt_init_push_file (struct note_runtime_t *rt, char *fname)
 
     str_set (&new_note->path, fname);
 
-    size_t source_len;
-    char *source = full_file_read (NULL, fname, &source_len);
-    strn_set (&new_note->psplx, source, source_len);
-    free (source);
+    // Sources are read directly into a pool and stay there until the end,
+    // instead of reading them into a temporary buffer and copying them into
+    // each note. Nothing modifies them, blocks that keep some of the text copy
+    // it.
+    if (rt->sources_pool.min_bin_size == 0) rt->sources_pool.min_bin_size = 1024*1024;
+
+    uint64_t source_len = 0;
+    char *source = full_file_read (&rt->sources_pool, fname, &source_len);
+    if (source != NULL && source_len > 0) {
+        str_set_view (&new_note->psplx, source, source_len);
+    }
 
     if (!parse_note_title (fname, str_data(&new_note->psplx), &new_note->title, &rt->sd, &new_note->error_msg)) {
         new_note->error = true;
@@ -165,6 +173,32 @@ void rt_init_push_dir (struct note_runtime_t *rt, char *path)
     iterate_dir (path, test_dir_iter, rt);
 }
 
+ITERATE_DIR_CB(notes_key_iter)
+{
+    uint64_t *key = (uint64_t*)data;
+
+    struct stat st;
+    if (!is_dir && stat (fname, &st) == 0) {
+        uint64_t file_key = build_hash_str (BUILD_HASH_INIT, fname);
+        file_key = build_hash (file_key, &st.st_size, sizeof(st.st_size));
+        file_key = build_hash (file_key, &st.st_mtim, sizeof(st.st_mtim));
+
+        // Added, so the key doesn't depend on the order of directory entries.
+        *key += file_key;
+    }
+}
+
+// Key of the SPLX snapshot, it changes if any note is added, removed or
+// modified since the snapshot was written, or if weaver changed. Files in the
+// notes directory are visited the same way rt_init_push_dir() does.
+// :splx_snapshot
+uint64_t notes_snapshot_key (char *notes_path)
+{
+    uint64_t key = build_hash_str (BUILD_HASH_INIT, __DATE__ " " __TIME__);
+    iterate_dir (notes_path, notes_key_iter, &key);
+    return key;
+}
+
 void rt_init (struct note_runtime_t *rt, struct splx_data_t *config)
 {
     rt->notes_by_id.pool = &rt->pool;
@@ -190,6 +224,10 @@ struct config_t {
     string_t config_path;
 
     string_t metadata_path;
+    string_t build_cache_path;
+    string_t vault_index_path;
+    string_t math_cache_path;
+    string_t snapshot_path;
 
     string_t source_notes_path;
     string_t source_files_path;
@@ -202,6 +240,11 @@ void cfg_destroy (struct config_t *cfg)
 {
     str_free (&cfg->home);
     str_free (&cfg->config_path);
+    str_free (&cfg->metadata_path);
+    str_free (&cfg->build_cache_path);
+    str_free (&cfg->vault_index_path);
+    str_free (&cfg->math_cache_path);
+    str_free (&cfg->snapshot_path);
     str_free (&cfg->source_notes_path);
     str_free (&cfg->source_files_path);
     str_free (&cfg->target_path);
@@ -230,31 +273,29 @@ void generate_data_json (struct note_runtime_t *rt, char *out_fname)
     // TODO: This should create an identity map serialization of all entities.
     // It should call into a generic JSON serializer for TSPLX data.
 
-    string_t generated_data = {0};
+    FILE *f = fopen (out_fname, "w");
+    if (f == NULL) {
+        printf ("Error opening %s: %s\n", out_fname, strerror(errno));
+        return;
+    }
 
     bool is_first = true;
-
-    string_t escaped_title = {0};
-    is_first = true;
-    str_cat_c(&generated_data, "{");
+    fputc ('{', f);
     LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
-        if (!is_first) str_cat_c(&generated_data, ",\n");
+        if (!is_first) fputs (",\n", f);
         is_first = false;
 
-        str_set (&escaped_title, str_data(&curr_note->title));
-        str_replace (&escaped_title, "\"", "\\\"", NULL);
-        str_cat_printf(&generated_data, "\"%s\":", curr_note->id);
+        fprintf (f, "\"%s\":", curr_note->id);
 
-        str_cat_c(&generated_data, "{");
-        str_cat_printf(&generated_data, "\"name\":\"%s\",", str_data(&escaped_title));
-        str_cat_printf(&generated_data, "\"@type\":\"page\"");
-        str_cat_c(&generated_data, "}");
+        fputs ("{\"name\":", f);
+        fwrite_js_string (f, '"', str_data(&curr_note->title), str_len(&curr_note->title));
+        fputs (",\"@type\":\"page\"}", f);
     }
-    str_cat_c(&generated_data, "}\n");
-    str_free(&escaped_title);
+    fputs ("}\n", f);
 
-    full_file_write (str_data(&generated_data), str_len(&generated_data), out_fname);
-    str_free (&generated_data);
+    if (fclose (f) != 0) {
+        printf ("Error writing %s: %s\n", out_fname, strerror(errno));
+    }
 }
 
 void generate_metadata (struct note_runtime_t *rt, struct config_t *cfg)
@@ -302,24 +343,264 @@ void generate_metadata (struct note_runtime_t *rt, struct config_t *cfg)
     str_free(&metadata_str);
 }
 
-void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char *home)
+// :build_cache
+#define BUILD_CACHE_HEADER "weaver-build-cache 3\n"
+
+// After the header comes the salt of the run that wrote the cache (see
+// rt_build_salt()) and then a record for each note:
+//
+//   <note id>\0 <key:uint64> <source hash:uint64> <number of deps:uint32>
+//
+// followed by each dep, a type byte and its name\0 and value\0. Then come the
+// note's data ops:
+//
+//   <number of data ops:uint32>
+//
+// each one is a type byte, a phase byte and a flags byte, followed by the
+// arguments that aren't NULL as arg\0. The first 3 bits of flags tell which
+// arguments are present, the 4th one is has_parent. Like in the vault index,
+// numbers use the machine's byte order and loading stops at the first
+// malformed record.
+//
+// If the salt changed the cache is ignored. Entries whose output file is
+// missing from notes_dir are dropped, so those notes get rendered again.
+void build_cache_load (struct build_cache_t *cache, char *path, char *notes_dir, uint64_t salt)
+{
+    if (!path_exists (path)) return;
+
+    uint64_t len = 0;
+    char *data = full_file_read (cache->pool, path, &len);
+    if (data == NULL) return;
+
+    size_t header_len = strlen (BUILD_CACHE_HEADER);
+    if (len < header_len + sizeof(uint64_t) || strncmp (data, BUILD_CACHE_HEADER, header_len) != 0) return;
+
+    uint64_t cache_salt;
+    memcpy (&cache_salt, data + header_len, sizeof(uint64_t));
+    if (cache_salt != salt) return;
+
+    string_t output_path = {0};
+    str_set_path (&output_path, notes_dir);
+    str_cat_path (&output_path, "");
+    size_t end = str_len (&output_path);
+
+    char *pos = data + header_len + sizeof(uint64_t);
+    char *data_end = data + len;
+    while (pos < data_end) {
+        char *id = pos;
+        pos = vlt_index_skip_str (pos, data_end);
+        if (pos == NULL || data_end - pos < 2*sizeof(uint64_t) + sizeof(uint32_t)) break;
+
+        uint32_t deps_len;
+        struct build_cache_entry_t entry = {0};
+        memcpy (&entry.key, pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+        memcpy (&entry.source_hash, pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+        memcpy (&deps_len, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+
+        entry.deps_len = deps_len;
+        entry.deps = mem_pool_push_array (cache->pool, entry.deps_len, struct build_dep_t);
+        for (int i=0; pos != NULL && i<entry.deps_len; i++) {
+            if (pos == data_end || (unsigned char)*pos > BUILD_DEP_LATE_TAG) {
+                pos = NULL;
+            } else {
+                entry.deps[i].type = *pos;
+                entry.deps[i].name = pos + 1;
+                pos = vlt_index_skip_str (pos + 1, data_end);
+                if (pos != NULL) {
+                    entry.deps[i].value = pos;
+                    pos = vlt_index_skip_str (pos, data_end);
+                }
+            }
+        }
+        if (pos == NULL || data_end - pos < sizeof(uint32_t)) break;
+
+        uint32_t data_ops_len;
+        memcpy (&data_ops_len, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+
+        entry.data_ops_len = data_ops_len;
+        entry.data_ops = mem_pool_push_array (cache->pool, entry.data_ops_len, struct note_data_op_t);
+        for (int i=0; pos != NULL && i<entry.data_ops_len; i++) {
+            struct note_data_op_t *op = &entry.data_ops[i];
+            *op = ZERO_INIT(struct note_data_op_t);
+
+            if (data_end - pos < 3 || (unsigned char)pos[0] > NOTE_DATA_OP_SUMMARY || (unsigned char)pos[1] > NOTE_PHASE_USER_CALLBACKS) {
+                pos = NULL;
+            } else {
+                op->type = pos[0];
+                op->phase = pos[1];
+                char flags = pos[2];
+                op->has_parent = flags & 0x8;
+                pos += 3;
+
+                for (int j=0; pos != NULL && j<ARRAY_SIZE(op->args); j++) {
+                    if (flags & (1<<j)) {
+                        op->args[j] = pos;
+                        pos = vlt_index_skip_str (pos, data_end);
+                    }
+                }
+            }
+        }
+        if (pos == NULL) break;
+
+        str_put_printf (&output_path, end, "%s", id);
+        if (path_exists (str_data(&output_path))) {
+            build_cache_insert (cache, id, entry);
+        }
+    }
+
+    str_free (&output_path);
+}
+
+void build_cache_write (struct note_runtime_t *rt, char *path)
+{
+    struct file_replace_t fr;
+    FILE *f = file_replace_begin (&fr, path);
+    if (f == NULL) return;
+
+    fputs (BUILD_CACHE_HEADER, f);
+    fwrite (&rt->build_salt, sizeof(uint64_t), 1, f);
+
+    LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+        // Notes with warnings are always rendered again so warnings aren't
+        // silenced after the first run.
+        if (curr_note->error || !curr_note->is_cacheable || !note_is_visible(curr_note) || str_len(&curr_note->error_msg) > 0) {
+            continue;
+        }
+
+        // Up to date notes didn't record deps in this run, they still have
+        // the ones from the cache.
+        struct build_dep_t *deps = curr_note->build_deps;
+        int deps_len = curr_note->build_deps_len;
+        if (curr_note->is_up_to_date) {
+            struct build_cache_entry_t entry = {0};
+            build_cache_maybe_get (rt->build_cache, curr_note->id, &entry);
+            deps = entry.deps;
+            deps_len = entry.deps_len;
+        }
+
+        uint32_t num_deps = deps_len;
+        fwrite (curr_note->id, 1, strlen(curr_note->id) + 1, f);
+        fwrite (&curr_note->build_key, sizeof(uint64_t), 1, f);
+        fwrite (&curr_note->source_hash, sizeof(uint64_t), 1, f);
+        fwrite (&num_deps, sizeof(uint32_t), 1, f);
+
+        for (int i=0; i<deps_len; i++) {
+            fputc (deps[i].type, f);
+            fwrite (deps[i].name, 1, strlen(deps[i].name) + 1, f);
+            fwrite (deps[i].value, 1, strlen(deps[i].value) + 1, f);
+        }
+
+        uint32_t num_data_ops = curr_note->data_ops_len;
+        fwrite (&num_data_ops, sizeof(uint32_t), 1, f);
+
+        for (int i=0; i<curr_note->data_ops_len; i++) {
+            struct note_data_op_t *op = &curr_note->data_ops[i];
+
+            char flags = op->has_parent ? 0x8 : 0;
+            for (int j=0; j<ARRAY_SIZE(op->args); j++) {
+                if (op->args[j] != NULL) flags |= 1<<j;
+            }
+
+            fputc (op->type, f);
+            fputc (op->phase, f);
+            fputc (flags, f);
+
+            for (int j=0; j<ARRAY_SIZE(op->args); j++) {
+                if (op->args[j] != NULL) fwrite (op->args[j], 1, strlen(op->args[j]) + 1, f);
+            }
+        }
+    }
+
+    file_replace_end (&fr);
+}
+
+ITERATE_DIR_CB (remove_stale_note_file)
+{
+    struct note_runtime_t *rt = (struct note_runtime_t*)data;
+
+    if (!is_dir) {
+        struct note_t *note = id_to_note_get (&rt->notes_by_id, path_basename (fname));
+        if (note == NULL || note->error || !note_is_visible(note)) {
+            unlink (fname);
+        }
+    }
+}
+
+// Virtual entities are split into shards of this many entities, written as
+// JSON files in the virtual/ directory of the target. data.js only has an index
+// from entity ids to shards and the titles, so the size of what the frontend
+// loads before showing the first note doesn't grow with the number of virtual
+// entities. Shards are fetched by note_renderer.js the first time one of their
+// entities is opened.
+// :virtual_shards
+#define VIRTUAL_SHARD_SIZE 256
+
+FILE* virtual_shard_open (char *shards_path, int shard_idx)
 {
-    string_t generated_data = {0};
+    string_t path = {0};
+    str_set_path (&path, shards_path);
+    str_cat_printf (&path, "/%d.json", shard_idx);
 
-    str_cat_printf(&generated_data, "home_path = '%s';\n\n", home);
+    FILE *f = fopen (str_data(&path), "w");
+    if (f == NULL) {
+        printf ("Error opening %s: %s\n", str_data(&path), strerror(errno));
+    } else {
+        fputc ('{', f);
+    }
+
+    str_free (&path);
+    return f;
+}
+
+void virtual_shard_close (FILE *f, char *shards_path, int shard_idx)
+{
+    if (f == NULL) return;
+
+    fputs ("}\n", f);
+    if (fclose (f) != 0) {
+        printf ("Error writing %s/%d.json: %s\n", shards_path, shard_idx, strerror(errno));
+    }
+}
+
+void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char *shards_path, char *home)
+{
+    FILE *f = fopen (out_fname, "w");
+    if (f == NULL) {
+        printf ("Error opening %s: %s\n", out_fname, strerror(errno));
+        return;
+    }
+
+    fputs ("home_path = ", f);
+    fwrite_js_string_c (f, '\'', home);
+    fputs (";\n\n", f);
 
     bool is_first = true;
-    str_cat_c(&generated_data, "title_notes = [");
+    fputs ("title_notes = [", f);
     for (int i=0; i<rt->title_note_ids_len; i++) {
-        if (!is_first) str_cat_c(&generated_data, ",");
+        if (!is_first) fputc (',', f);
         is_first = false;
 
-        str_cat_printf(&generated_data, "\"%s\"", rt->title_note_ids[i]);
+        fwrite_js_string_c (f, '"', rt->title_note_ids[i]);
+    }
+    fputs ("];\n\n", f);
+
+
+    // Shards are numbered by position, so old ones can't be reused if the set of
+    // virtual entities changed. They're cheap to write, regenerate all of them.
+    if (path_exists (shards_path)) {
+        path_rmrf (shards_path);
     }
-    str_cat_c(&generated_data, "];\n\n");
+    path_ensure_dir (shards_path);
 
+    int shard_idx = 0;
+    int shard_len = 0;
+    FILE *shard = NULL;
 
-    str_cat_c(&generated_data, "virtual_entities = {\n");
+    fputs ("virtual_entities = {\n", f);
 
     LINKED_LIST_FOR (struct splx_node_list_t *, curr_list_node, rt->sd.entities->floating_values) {
         struct splx_node_t *entity = curr_list_node->node;
@@ -341,7 +622,6 @@ void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char
                 }
             }
             str_cat_c (&psplx, name_str);
-            str_replace (&psplx, "'", "\\'", NULL);
             str_replace (&psplx, "\n", " ", NULL);
             str_cat_c (&psplx, "\n");
 
@@ -353,8 +633,6 @@ void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char
                 str_cat_c (&psplx, str_data(&node->str));
             }
 
-            str_replace (&psplx, "\n", "\\n", NULL);
-
 
             // Generate HTML
             string_t html = {0};
@@ -380,9 +658,7 @@ void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char
             }
             block_tree_to_html (ctx, dummy_note->html, dummy_note->tree, dummy_note->html->root, false);
             render_backlinks (rt, dummy_note);
-            str_cat_html (&html, dummy_note->html, 2);
-            str_replace (&html, "'", "\\'", NULL);
-            str_replace (&html, "\n", "\\n", NULL);
+            str_cat_html (&html, dummy_note->html, rt_html_indent (rt));
             note_destroy (dummy_note);
             ps_destroy (ps);
 
@@ -390,39 +666,70 @@ void generate_data_javascript (struct note_runtime_t *rt, char *out_fname, char
             // Generate TSPLX
             string_t tsplx = {0};
             str_cat_splx_canonical_shallow (&tsplx, entity);
-            str_replace (&tsplx, "'", "\\'", NULL);
-            str_replace (&tsplx, "\n", "\\n", NULL);
 
 
-            string_t name_escaped = {0};
-            str_set (&name_escaped, name_str);
-            str_replace (&name_escaped, "\n", " ", NULL);
-            str_replace (&name_escaped, "'", "\\'", NULL);
+            string_t title = {0};
+            str_set (&title, name_str);
+            str_replace (&title, "\n", " ", NULL);
 
             if (virtual_id != NULL) {
-                str_cat_printf(&generated_data,
-                               "  '%s': {psplx: '%s', html: '%s', tsplx: '%s', title: '%s'},\n",
-                               str_data(splx_node_get_id (virtual_id)),
-                               str_data(&psplx),
-                               str_data(&html),
-                               str_data(&tsplx),
-                               str_data(&name_escaped));
+                char *id = str_data(splx_node_get_id (virtual_id));
+
+                if (shard_len == VIRTUAL_SHARD_SIZE) {
+                    virtual_shard_close (shard, shards_path, shard_idx);
+                    shard = NULL;
+                    shard_idx++;
+                    shard_len = 0;
+                }
+
+                if (shard_len == 0) {
+                    shard = virtual_shard_open (shards_path, shard_idx);
+                } else if (shard != NULL) {
+                    fputs (",", shard);
+                }
+                shard_len++;
+
+                if (shard != NULL) {
+                    fputs ("\n", shard);
+                    fwrite_js_string_c (shard, '"', id);
+                    fputs (":{\"psplx\":", shard);
+                    fwrite_js_string (shard, '"', str_data(&psplx), str_len(&psplx));
+                    fputs (",\"html\":", shard);
+                    fwrite_js_string (shard, '"', str_data(&html), str_len(&html));
+                    fputs (",\"tsplx\":", shard);
+                    fwrite_js_string (shard, '"', str_data(&tsplx), str_len(&tsplx));
+                    fputs ("}", shard);
+                }
+
+                fputs ("  ", f);
+                fwrite_js_string_c (f, '\'', id);
+                fprintf (f, ": {shard: %d, title: ", shard_idx);
+                fwrite_js_string (f, '\'', str_data(&title), str_len(&title));
+                fputs ("},\n", f);
             }
 
+            str_free (&title);
             str_free (&tsplx);
             str_free (&html);
             str_free (&psplx);
         }
     }
 
-    str_cat_c(&generated_data, "};\n");
-    full_file_write (str_data(&generated_data), str_len(&generated_data), out_fname);
-    str_free (&generated_data);
+    virtual_shard_close (shard, shards_path, shard_idx);
+
+    fputs ("};\n", f);
+
+    if (fclose (f) != 0) {
+        printf ("Error writing %s: %s\n", out_fname, strerror(errno));
+    }
 }
 
 int main(int argc, char** argv)
 {
     int retval = 0;
+
+    // :math_cache
+    bool rendered_all_notes = false;
     bool success = true;
 
     __g_note_runtime = ZERO_INIT (struct note_runtime_t);
@@ -461,6 +768,18 @@ int main(int argc, char** argv)
     str_set_path (&cfg->metadata_path, str_data(&cfg->home));
     str_cat_path (&cfg->metadata_path, "metadata.tsplx");
 
+    str_set_path (&cfg->build_cache_path, str_data(&cfg->home));
+    str_cat_path (&cfg->build_cache_path, "build-cache");
+
+    str_set_path (&cfg->vault_index_path, str_data(&cfg->home));
+    str_cat_path (&cfg->vault_index_path, "vault-index");
+
+    str_set_path (&cfg->math_cache_path, str_data(&cfg->home));
+    str_cat_path (&cfg->math_cache_path, "math-cache");
+
+    str_set_path (&cfg->snapshot_path, str_data(&cfg->home));
+    str_cat_path (&cfg->snapshot_path, "splx-snapshot");
+
     str_set_path (&cfg->source_notes_path, str_data(&cfg->home));
     str_cat_path (&cfg->source_notes_path, "notes/");
 
@@ -478,12 +797,10 @@ int main(int argc, char** argv)
     }
 
     rt->is_public = get_cli_bool_opt_ctx (cli_ctx, "--public", argv, argc);
+    rt->minify_html = get_cli_bool_opt_ctx (cli_ctx, "--minify", argv, argc);
     rt_init (rt, &config);
     rt->metadata = metadata;
 
-    rt->vlt.base_dir = str_data(&cfg->source_files_path);
-    vlt_init (&rt->vlt);
-
     string_t error_msg = {0};
 
     enum cli_command_t command = CLI_COMMAND_NONE;
@@ -506,6 +823,20 @@ int main(int argc, char** argv)
     }
 
     bool is_verbose = get_cli_bool_opt_ctx (cli_ctx, "--verbose", argv, argc);
+    bool no_cache = get_cli_bool_opt_ctx (cli_ctx, "--no-cache", argv, argc);
+    bool vault_stats = get_cli_bool_opt_ctx (cli_ctx, "--vault-stats", argv, argc);
+
+    char *jobs_str = get_cli_arg_opt_ctx (cli_ctx, "--jobs", argv, argc);
+    if (jobs_str != NULL) {
+        char *end;
+        long jobs = strtol (jobs_str, &end, 10);
+        if (*end != '\0' || jobs < 1) {
+            success = false;
+            printf (ECMA_RED("error: ") "invalid number of jobs '%s'\n", jobs_str);
+        } else {
+            rt->jobs = jobs;
+        }
+    }
 
     char *output_dir = get_cli_arg_opt_ctx (cli_ctx, "--output-dir", argv, argc);
     if (output_dir != NULL) {
@@ -544,10 +875,35 @@ int main(int argc, char** argv)
         printf (ECMA_RED("error: ") "files directory could not be created\n");
     }
 
+    {
+        struct timespec scan_start, scan_end;
+        clock_gettime (CLOCK_MONOTONIC, &scan_start);
+
+        rt->vlt.base_dir = str_data(&cfg->source_files_path);
+        rt->vlt.jobs = rt->jobs;
+        if (!no_cache) {
+            rt->vlt.index_path = str_data(&cfg->vault_index_path);
+        }
+        vlt_init (&rt->vlt);
+
+        clock_gettime (CLOCK_MONOTONIC, &scan_end);
+        if (vault_stats) {
+            double seconds = (scan_end.tv_sec - scan_start.tv_sec) + (scan_end.tv_nsec - scan_start.tv_nsec)/1e9;
+            uint64_t num_entries = rt->vlt.num_scanned_entries;
+            printf ("vault scan: %" PRIu64 " entries, %" PRIu64 " directories (%" PRIu64 " from index), %" PRIu64 " stat calls, %.3fs (%.0f entries/s)\n",
+                    num_entries, rt->vlt.num_scanned_dirs, rt->vlt.num_index_hits, rt->vlt.num_stat_calls,
+                    seconds, seconds > 0 ? num_entries/seconds : 0.0);
+        }
+    }
+
     string_t output_data_file = {0};
     str_set_path (&output_data_file, str_data(&cfg->target_path));
     path_cat (&output_data_file, "data.js");
 
+    string_t output_shards_path = {0};
+    str_set_path (&output_shards_path, str_data(&cfg->target_path));
+    path_cat (&output_shards_path, "virtual");
+
     string_t output_json_file = {0};
     str_set_path (&output_json_file, str_data(&cfg->target_path));
     path_cat (&output_json_file, "data.json");
@@ -595,10 +951,33 @@ int main(int argc, char** argv)
             rt_init_push_file (rt, curr_note_path);
         }
 
+    } else if (command == CLI_COMMAND_LOOKUP && !no_cache &&
+               splx_snapshot_load (&rt->sd, str_data(&cfg->snapshot_path), notes_snapshot_key (str_data(&cfg->source_notes_path))))
+    {
+        // The SPLX data of the last static site generation is still valid,
+        // queries use it instead of parsing all notes.
+        // :splx_snapshot
+
     } else {
         rt_init_push_dir (rt, str_data(&cfg->source_notes_path));
     }
 
+    // Only full static site generation is incremental. Single notes passed in
+    // the CLI and custom sites are always generated from scratch.
+    // :build_cache
+    STACK_ALLOCATE (struct build_cache_t, build_cache);
+    build_cache->pool = &rt->pool;
+    if (success && command == CLI_COMMAND_GENERATE && output_type == CLI_OUTPUT_TYPE_STATIC_SITE && !require_target_dir && !no_cache) {
+        rt_build_salt (rt, str_data(&cfg->target_notes_path));
+        build_cache_load (build_cache, str_data(&cfg->build_cache_path), str_data(&cfg->target_notes_path), rt->build_salt);
+        rt->build_cache = build_cache;
+    }
+
+    // :math_cache
+    if (success && !no_cache) {
+        math_cache_load (str_data(&cfg->math_cache_path));
+    }
+
     // PROCESS DATA
     if (rt->notes_len > 0) {
         rt_process_notes (rt, &error_msg);
@@ -627,8 +1006,13 @@ int main(int argc, char** argv)
                 }
 
                 if (!require_target_dir || str_len(&cfg->target_notes_path) > 0) {
-                    // Clear the notes directory before writing into it.
-                    if (path_exists(str_data(&cfg->target_notes_path))) {
+                    // Clear the notes directory before writing into it. When
+                    // building incrementally only remove files of notes that
+                    // aren't part of the output anymore.
+                    if (rt->build_cache != NULL) {
+                        iterate_dir (str_data(&cfg->target_notes_path), remove_stale_note_file, rt);
+
+                    } else if (path_exists(str_data(&cfg->target_notes_path))) {
                         path_rmrf(str_data(&cfg->target_notes_path));
                     }
 
@@ -641,19 +1025,34 @@ int main(int argc, char** argv)
                     }
                     str_cat_path (&html_path, ""); // Ensure path ends in '/'
 
+                    int num_rendered = 0;
                     size_t end = str_len (&html_path);
                     LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
                         str_put_printf (&html_path, end, "%s", curr_note->id);
 
-                        if (!curr_note->error && note_is_visible(curr_note))
+                        if (!curr_note->error && note_is_visible(curr_note) && !curr_note->is_up_to_date)
                         {
-                            string_t html_str = {0};
-                            str_cat_html (&html_str, curr_note->html, 2);
-                            full_file_write (str_data(&html_str), str_len(&html_str), str_data(&html_path));
-                            str_free(&html_str);
+                            num_rendered++;
+
+                            html_write_file (curr_note->html, rt_html_indent (rt), str_data(&html_path));
+                        }
+                    }
+
+
+                    if (rt->build_cache != NULL) {
+                        build_cache_write (rt, str_data(&cfg->build_cache_path));
+                    }
+
+                    if (!require_target_dir) {
+                        rendered_all_notes = true;
+                        LINKED_LIST_FOR (struct note_t*, curr_note, rt->notes) {
+                            if (curr_note->is_up_to_date) rendered_all_notes = false;
                         }
                     }
 
+                    if (is_verbose) {
+                        printf ("rendered %d of %d notes\n", num_rendered, rt->notes_len);
+                    }
 
                     if (str_len(&error_msg) > 0) {
                         if (has_output) {
@@ -676,9 +1075,14 @@ int main(int argc, char** argv)
                 }
 
                 generate_metadata(rt, cfg);
-                generate_data_javascript(rt, str_data(&output_data_file), cli_home ? str_data(&cfg->home) : DEFAULT_HOME_DIR);
+                generate_data_javascript(rt, str_data(&output_data_file), str_data(&output_shards_path), cli_home ? str_data(&cfg->home) : DEFAULT_HOME_DIR);
                 generate_data_json(rt, str_data(&output_json_file));
 
+                // :splx_snapshot
+                if (!require_target_dir) {
+                    splx_snapshot_write (&rt->sd, str_data(&cfg->snapshot_path), notes_snapshot_key (str_data(&cfg->source_notes_path)));
+                }
+
                 if (is_verbose) {
                     printf ("target: %s\n", str_data(&cfg->target_path));
                 }
@@ -749,22 +1153,17 @@ int main(int argc, char** argv)
                     struct note_t *note = rt_get_note_by_id (str_data(splx_node_get_id(entity)));
 
                     // Excerpt
+                    // :note_summary
+                    struct psx_note_summary_t *summary = NULL;
                     if (note != NULL) {
-                        STACK_ALLOCATE (struct splx_data_t, empty_sd);
-                        STACK_ALLOCATE (struct psx_parser_ctx_t, empty_ctx);
-                        empty_ctx->sd = empty_sd;
-                        struct psx_block_t *note_tree = parse_note_text (&pool_l, empty_ctx, str_data(&note->psplx));
-                        splx_destroy (empty_sd);
-
-                        struct psx_block_t *after_title = note_tree->block_content->next;
-                        if (after_title != NULL && after_title->type == BLOCK_TYPE_PARAGRAPH) {
-
-                            string_t excerpt = {0};
-                            str_cat_inline_content_as_plain (str_data(&after_title->inline_content), &excerpt);
-                            splx_node_attribute_append_c_str(&rt->sd, entity, "excerpt", str_data(&excerpt), SPLX_NODE_TYPE_STRING);
-                            str_free (&excerpt);
-                        }
+                        summary = psx_note_summary (note);
+                    }
 
+                    if (summary != NULL && summary->paragraph != NULL) {
+                        string_t excerpt = {0};
+                        str_cat_inline_content_as_plain (str_data(&summary->paragraph->inline_content), &excerpt);
+                        splx_node_attribute_append_c_str(&rt->sd, entity, "excerpt", str_data(&excerpt), SPLX_NODE_TYPE_STRING);
+                        str_free (&excerpt);
                     }
 
                     // Content
@@ -775,7 +1174,7 @@ int main(int argc, char** argv)
                         block_tree_to_html (ctx, content_html, note->tree, content_html->root, true);
 
                         str_set (&buff, "");
-                        str_cat_html_element_siblings(&buff, content_html->root->children->next->next->next, 2);
+                        str_cat_html_element_siblings(&buff, content_html->root->children->next->next->next, rt_html_indent (rt));
                         splx_node_attribute_append_c_str(&rt->sd, entity, "content", str_data(&buff), SPLX_NODE_TYPE_STRING);
                     }
 
@@ -946,43 +1345,15 @@ int main(int argc, char** argv)
                 }
 
             } else if (strcmp(query, "type()") == 0) {
-                struct splx_node_t *entities_node = rt->sd.entities;
-
-                struct cstr_to_splx_node_list_map_t type_index = {0};
-
-                LINKED_LIST_FOR(struct splx_node_list_t *, curr_list_node, entities_node->floating_values) {
-                    struct splx_node_t *entitity = curr_list_node->node;
-
-                    BINARY_TREE_FOR (cstr_to_splx_node_list_map, &entitity->attributes, curr_attribute) {
-                        if (strcmp(curr_attribute->key, "a") == 0) {
-                            LINKED_LIST_FOR (struct splx_node_list_t *, curr_node_list_element, curr_attribute->value) {
-                                struct splx_node_list_t *new_node_list_element =
-                                    tps_wrap_in_list_node (&rt->sd, curr_node_list_element->node);
-
-                                char *type = str_data(&curr_node_list_element->node->str);
-                                struct splx_node_list_t *existing_list = cstr_to_splx_node_list_map_get (&type_index, type);
-                                if (existing_list == NULL) {
-                                    cstr_to_splx_node_list_map_insert (&type_index, type, new_node_list_element);
-                                } else {
-                                    new_node_list_element->next = existing_list->next;
-                                    existing_list->next = new_node_list_element;
-                                }
-                            }
-                        }
-                    }
-                }
-
-
-                BINARY_TREE_FOR (cstr_to_splx_node_list_map, &type_index, curr_type) {
+                // :entity_index
+                BINARY_TREE_FOR (splx_entity_index, &rt->sd.type_index, curr_type) {
                     int num_instances = 0;
-                    LINKED_LIST_FOR (struct splx_node_list_t *, curr_node_list_element, curr_type->value) {
+                    LINKED_LIST_FOR (struct splx_entity_index_entry_t *, curr_entry, curr_type->value->entries) {
                         num_instances++;
                     }
 
                     printf ("%s (%i)\n", curr_type->key, num_instances);
                 }
-
-                cstr_to_splx_node_list_map_destroy (&type_index);
             }
         }
 
@@ -990,8 +1361,10 @@ int main(int argc, char** argv)
     }
 
     mem_pool_destroy (&rt->pool);
+    mem_pool_destroy (&rt->sources_pool);
 
-    cfg_destroy (cfg);
+    math_cache_write (rendered_all_notes);
     js_destroy ();
+    cfg_destroy (cfg);
     return retval;
 }